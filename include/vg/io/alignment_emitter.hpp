@@ -103,12 +103,18 @@ public:
 /// Automatically applies per-thread buffering, but needs to know how many OMP
 /// threads will be in use.
 ///
+/// GAM output is BGZF-compressed at the given compression level (0-9, or -1
+/// for the default). Level 1 is a good choice for intermediate files, and
+/// level 0 stores the data uncompressed but still BGZF-framed.
+///
 /// If you want a generalization of this that supports hts, look for
 /// get_alignment_emitter in hts_alignment_emitter.hpp
 unique_ptr<AlignmentEmitter> get_non_hts_alignment_emitter(const string& filename, const string& format, 
                                                            const map<string, int64_t>& path_length, size_t max_threads,
                                                            const HandleGraph* graph = nullptr,
-                                                           const handlegraph::NamedNodeBackTranslation* translate_through = nullptr);
+                                                           const handlegraph::NamedNodeBackTranslation* translate_through = nullptr,
+                                                           int compression_level = -1,
+                                                           bool write_group_index = false);
 
 /**
  * Discards all alignments.
@@ -172,8 +178,14 @@ private:
 class VGAlignmentEmitter : public AlignmentEmitter {
 public:
     /// Create a VGAlignmentEmitter writing to the given file (or "-") in the given
-    /// non-HTS format ("JSON", "GAM").
-    VGAlignmentEmitter(const string& filename, const string& format, size_t max_threads);
+    /// non-HTS format ("JSON", "GAM"). GAM is compressed at the given
+    /// compression level (0-9, or -1 for the default). If write_group_index
+    /// is set and GAM is being written to a file, a sidecar GroupIndex is
+    /// written next to it when the emitter is destroyed. Since threads'
+    /// output is interleaved in an unknown order, this means reading back
+    /// and decompressing the whole file at destruction.
+    VGAlignmentEmitter(const string& filename, const string& format, size_t max_threads, int compression_level = -1,
+                       bool write_group_index = false);
     
     /// Finish and drstroy a VGAlignmentEmitter.
     ~VGAlignmentEmitter();
@@ -204,6 +216,15 @@ private:
     
     /// We also keep ProtobufEmitters, one per thread, if we are doing protobuf output.
     vector<unique_ptr<vg::io::ProtobufEmitter<Alignment>>> proto;
+    
+    /// The BGZF compression level to use for protobuf output.
+    int compression_level;
+    
+    /// The file we are writing, if it is a file.
+    string filename;
+    
+    /// Whether to write a sidecar GroupIndex for the file when done.
+    bool write_group_index;
 };
 
 /**
@@ -0,0 +1,117 @@
+#ifndef VG_IO_ALIGNMENT_PROJECTION_HPP_INCLUDED
+#define VG_IO_ALIGNMENT_PROJECTION_HPP_INCLUDED
+
+/**
+ * \file alignment_projection.hpp
+ * Tools for parsing only some of the fields of serialized Alignments, by
+ * walking the Protobuf wire format and skipping everything else.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "vg/vg.pb.h"
+#include "vg/io/message_iterator.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Fields of an Alignment that can be asked for when parsing only part of
+/// one. Combine them with |.
+enum AlignmentField : uint32_t {
+    ALIGNMENT_NAME = 1 << 0,
+    ALIGNMENT_SEQUENCE = 1 << 1,
+    ALIGNMENT_QUALITY = 1 << 2,
+    ALIGNMENT_MAPPING_QUALITY = 1 << 3,
+    ALIGNMENT_SCORE = 1 << 4,
+    ALIGNMENT_IS_SECONDARY = 1 << 5,
+    ALIGNMENT_IDENTITY = 1 << 6,
+    ALIGNMENT_SAMPLE_NAME = 1 << 7,
+    ALIGNMENT_READ_GROUP = 1 << 8,
+    /// Just the Position of each Mapping in the Path, and not the Edits.
+    ALIGNMENT_POSITIONS = 1 << 9,
+    /// The whole Path.
+    ALIGNMENT_PATH = 1 << 10
+};
+
+/**
+ * The commonly scanned fields of an Alignment, without any Protobuf
+ * machinery.
+ */
+struct AlignmentSummary {
+    string name;
+    int32_t mapping_quality = 0;
+    int32_t score = 0;
+    bool is_secondary = false;
+    double identity = 0;
+    /// The node ID of the position of each Mapping in the Path, in order,
+    /// or 0 for a Mapping without one.
+    vector<int64_t> node_ids;
+
+    /// Reset all the fields, keeping allocated memory.
+    void clear();
+};
+
+/**
+ * Simple conditions on an Alignment that can be checked by scanning its
+ * serialized data, without parsing it. Conditions left at their defaults
+ * always pass, and an Alignment must pass all the conditions to match.
+ */
+struct AlignmentPredicate {
+    /// Only match Alignments with at least this mapping quality.
+    int32_t min_mapping_quality = numeric_limits<int32_t>::min();
+    /// Only match Alignments with at least this score.
+    int32_t min_score = numeric_limits<int32_t>::min();
+    /// Match secondary Alignments.
+    bool keep_secondary = true;
+    /// Match primary Alignments.
+    bool keep_primary = true;
+    /// If min_node_id < max_node_id, only match Alignments with a Mapping on
+    /// a node with an ID in [min_node_id, max_node_id).
+    int64_t min_node_id = 0;
+    int64_t max_node_id = 0;
+    
+    /// Get the AlignmentField combination needed to check the predicate.
+    uint32_t fields() const;
+    
+    /// Check the predicate against the serialized Alignment in the given
+    /// buffer, looking only at the fields it needs. Data that can't be
+    /// scanned matches, so that the error comes out when it is parsed for
+    /// real.
+    bool matches(const char* data, size_t size) const;
+    
+    /// Get a copy of the predicate as a filter for
+    /// MessageIterator::set_message_filter() or for_each_parallel_filtered().
+    /// Messages in groups not tagged as Alignments always pass.
+    MessageFilter as_filter() const;
+};
+
+/// Parse the given fields (an AlignmentField combination) of the serialized
+/// Alignment in the given buffer into dest, which is cleared first. Other
+/// fields are skipped without being parsed, and left unset. Returns false if
+/// the data can't be parsed.
+bool parse_alignment_fields(const char* data, size_t size, uint32_t fields, Alignment& dest);
+
+/// Parse the given fields of the serialized Alignment in the given buffer
+/// into a summary, which is cleared first. Only the fields that the summary
+/// has are parsed. ALIGNMENT_POSITIONS or ALIGNMENT_PATH fill in the node
+/// IDs. Returns false if the data can't be parsed.
+bool parse_alignment_fields(const char* data, size_t size, uint32_t fields, AlignmentSummary& dest);
+
+/// Call the given lambda on a summary of each Alignment in the given stream
+/// of type-tagged messages, parsing only the given fields. Groups of other
+/// types are skipped. Throws if an Alignment can't be parsed.
+void for_each_alignment_summary(istream& in, uint32_t fields, const function<void(AlignmentSummary&)>& lambda);
+
+}
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef VG_IO_BGZF_BLOCK_HPP_INCLUDED
+#define VG_IO_BGZF_BLOCK_HPP_INCLUDED
+
+/**
+ * \file bgzf_block.hpp
+ * Helpers for working with individual BGZF blocks directly, without going
+ * through htslib's streaming BGZF reader. A BGZF block is a gzip member with
+ * a "BC" extra subfield giving its compressed size (BSIZE), and at most 64 KiB
+ * of uncompressed data, so each one can be inflated in a single call.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace vg {
+
+namespace io {
+
+/// Size of the fixed BGZF block header, including the BC extra subfield.
+const size_t BGZF_HEADER_SIZE = 18;
+
+/// Size of the gzip footer (CRC32 and ISIZE) at the end of each BGZF block.
+const size_t BGZF_FOOTER_SIZE = 8;
+
+/// A decompressed BGZF block, along with where it came from in the file.
+struct InflatedBlock {
+    /// File offset of the compressed block
+    int64_t address = 0;
+    /// Size of the compressed block in the file
+    size_t compressed_size = 0;
+    /// The uncompressed data
+    std::vector<char> data;
+};
+
+/// Parse the BGZF header at the start of the given buffer, which must hold at
+/// least BGZF_HEADER_SIZE bytes. Return the total compressed size of the
+/// block (BSIZE + 1), or 0 if the header is not a valid BGZF block header.
+size_t bgzf_block_size(const void* header);
+
+/// Get the uncompressed size (ISIZE) of the complete compressed BGZF block of
+/// the given total size, by reading its footer.
+size_t bgzf_block_uncompressed_size(const void* block, size_t block_size);
+
+/// Inflate the complete compressed BGZF block of the given total size into
+/// dest, which has room for dest_capacity bytes. Checks the CRC32 and ISIZE
+/// in the footer. Returns the number of uncompressed bytes produced, or -1 if
+/// the block is corrupt or does not fit. Safe to call from multiple threads
+/// at once.
+///
+/// Uses libdeflate if libvgio was built with VGIO_USE_LIBDEFLATE, and zlib
+/// otherwise.
+int64_t bgzf_inflate_block(const void* block, size_t block_size, void* dest, size_t dest_capacity);
+
+/// Return true if bgzf_inflate_block() is backed by libdeflate, and false if
+/// it is backed by zlib.
+bool bgzf_inflate_uses_libdeflate();
+
+/// Compress the given data into a complete BGZF block (header, deflate data,
+/// and footer) in dest, which has room for dest_capacity bytes. The level is a
+/// zlib-style compression level, with -1 meaning the default. Level 0 stores
+/// the data uncompressed, but still framed as a BGZF block. Returns the total
+/// size of the block, or -1 if it does not fit or compression fails. Safe to
+/// call from multiple threads at once.
+///
+/// Uses libdeflate if libvgio was built with VGIO_USE_LIBDEFLATE, and zlib
+/// otherwise.
+int64_t bgzf_deflate_block(const void* data, size_t length, void* dest, size_t dest_capacity, int level);
+
+}
+
+}
+
+#endif
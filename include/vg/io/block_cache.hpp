@@ -0,0 +1,124 @@
+#ifndef VG_IO_BLOCK_CACHE_HPP_INCLUDED
+#define VG_IO_BLOCK_CACHE_HPP_INCLUDED
+
+/**
+ * \file block_cache.hpp
+ * Defines a shared cache of decompressed BGZF blocks.
+ */
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "bgzf_block.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * A thread-safe least-recently-used cache of decompressed BGZF blocks, keyed
+ * by the file they come from and the file offset of the compressed block,
+ * and limited by the total number of uncompressed bytes it holds.
+ *
+ * Can be shared between several BlockedGzipInputStreams (and thus several
+ * MessageIterators), so that repeated seeks into hot blocks don't have to
+ * inflate them again. Streams on different files can share a cache without
+ * seeing each other's blocks.
+ */
+class BlockCache {
+public:
+
+    /// Identifies the file a block came from, by device and inode number.
+    struct FileKey {
+        uint64_t device = 0;
+        uint64_t inode = 0;
+
+        bool operator==(const FileKey& other) const;
+    };
+
+    /// Make a new cache that holds up to the given number of bytes of
+    /// decompressed data.
+    BlockCache(size_t max_bytes);
+
+    // Can't be copied or moved, because of the mutex.
+    BlockCache(const BlockCache& other) = delete;
+    BlockCache& operator=(const BlockCache& other) = delete;
+    BlockCache(BlockCache&& other) = delete;
+    BlockCache& operator=(BlockCache&& other) = delete;
+
+    /// Look up the block that starts at the given file offset in the given
+    /// file, and mark it as most recently used. Returns null if it is not
+    /// cached. The block must not be modified.
+    shared_ptr<InflatedBlock> find(const FileKey& file, int64_t address);
+
+    /// Add the given block from the given file to the cache, evicting least
+    /// recently used blocks to stay under the byte limit. The block must not
+    /// be modified afterward. Blocks bigger than the whole cache are not
+    /// stored.
+    void insert(const FileKey& file, const shared_ptr<InflatedBlock>& block);
+
+    /// Get the number of decompressed bytes currently cached.
+    size_t size_bytes() const;
+
+    /// Get the maximum number of decompressed bytes that will be cached.
+    size_t max_size_bytes() const;
+
+    /// Get the number of lookups that found their block.
+    size_t hits() const;
+
+    /// Get the number of lookups that did not find their block.
+    size_t misses() const;
+
+    /// Drop all cached blocks.
+    void clear();
+
+private:
+
+    /// Identifies a cached block
+    struct BlockKey {
+        FileKey file;
+        int64_t address;
+
+        bool operator==(const BlockKey& other) const;
+    };
+
+    /// Hash function for BlockKeys
+    struct BlockKeyHash {
+        size_t operator()(const BlockKey& key) const;
+    };
+
+    /// Protects everything else
+    mutable mutex cache_mutex;
+
+    /// The byte limit
+    size_t max_bytes;
+
+    /// The bytes currently held
+    size_t held_bytes;
+
+    /// Lookup statistics
+    size_t hit_count;
+    size_t miss_count;
+
+    /// Cached blocks and their keys, most recently used first
+    list<pair<BlockKey, shared_ptr<InflatedBlock>>> recency;
+
+    /// Where each cached block is in the recency list
+    unordered_map<BlockKey, list<pair<BlockKey, shared_ptr<InflatedBlock>>>::iterator, BlockKeyHash> index;
+
+    /// Drop least recently used blocks until we are under the byte limit.
+    /// Lock must be held.
+    void evict();
+
+};
+
+}
+
+}
+
+#endif
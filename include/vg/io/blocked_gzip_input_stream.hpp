@@ -5,10 +5,20 @@
 
 #include <htslib/bgzf.h>
 
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+
 namespace vg {
 
 namespace io {
 
+struct InflatedBlock;
+class ParallelBlockInflater;
+class BlockCache;
+
 
 /// Protobuf-style ZeroCopyInputStream that reads data from blocked gzip
 /// format, and allows interacting with virtual offsets.
@@ -25,6 +35,14 @@ public:
     /// in a BGZF. The stream must be at a BGZF block header, since the header
     /// info is peeked.
     BlockedGzipInputStream(std::istream& stream);
+    
+    /// Make a new stream reading from the file at the given path. If the file
+    /// is a regular BGZF file, it is memory-mapped, and compressed blocks are
+    /// inflated straight out of the mapping, bypassing C++ streams and hFILE
+    /// buffering, and seeks are just cursor moves. Other files are read
+    /// straight from a file descriptor with large buffers, bypassing C++
+    /// streams. Throws if the file cannot be opened.
+    BlockedGzipInputStream(const std::string& filename);
 
     /// Destroy the stream.
     virtual ~BlockedGzipInputStream();
@@ -43,7 +61,9 @@ public:
     /// points, and the size of the buffer where size points. Returns false on
     /// an unrecoverable error or EOF, and true if a buffer was gotten. The
     /// data pointer must be valid until the next read call or until the stream
-    /// is destroyed.
+    /// is destroyed. Backing up into the buffer and reading it again does
+    /// not invalidate it, so it can be held on to until the stream has to
+    /// move on to another block.
     virtual bool Next(const void** data, int* size);
     
     /// When called after Next(), mark the last count bytes of the buffer that
@@ -52,7 +72,9 @@ public:
     
     /// Skip ahead the given number of bytes. Return false if the end of the
     /// stream is reached, or an error occurs. If the end of the stream is hit,
-    /// advances to the end of the stream.
+    /// advances to the end of the stream. For BGZF data, whole blocks that
+    /// are skipped over are never decompressed; only the block where the skip
+    /// lands is.
     virtual bool Skip(int count);
     
     /// Get the number of bytes read since the stream was constructed.
@@ -74,16 +96,65 @@ public:
     /// if the backing stream is unseekable, or not blocked. Note that this
     /// will cause problems if something reading from this stream is still
     /// operating on outstanding buffers; Any CodedInputStreams reading from
-    /// this stream *must* be destroyed before this function is called.
+    /// this stream *must* be destroyed before this function is called. Seeks
+    /// within the block currently loaded do not reload it.
     virtual bool Seek(int64_t virtual_offset);
     
     /// Return true if the stream being read really is BGZF, and false if we
     /// are operating on a non-blocked GZIP or uncompressed file.
     virtual bool IsBGZF() const;
 
-    /// Turn on multithreaded decompression. Return true if successful and
-    /// false if the BGZF could not set up its thread pool.
-    virtual bool EnableMultiThreading(size_t thread_count);
+    /// Default limit on how many uncompressed bytes multithreaded
+    /// decompression reads ahead.
+    const static size_t DEFAULT_READ_AHEAD_BYTES = 16 * 1024 * 1024;
+    
+    /// Turn on multithreaded decompression. For BGZF data, blocks ahead of
+    /// the cursor are found from their headers and inflated on thread_count
+    /// threads, holding up to about read_ahead_bytes of decompressed data,
+    /// and are handed out in order. Virtual offsets stay exact. Other data is
+    /// decompressed by htslib's thread pool. Return true if successful and
+    /// false if the thread pool could not be set up.
+    virtual bool EnableMultiThreading(size_t thread_count, size_t read_ahead_bytes = DEFAULT_READ_AHEAD_BYTES);
+    
+    /// Ways in which BGZF blocks can be decompressed.
+    enum class InflateMode {
+        /// Let htslib read each block and inflate it through zlib's streaming
+        /// interface.
+        HTSLIB,
+        /// Read each compressed block ourselves and inflate it in a single
+        /// call, using libdeflate if libvgio was built with it and zlib
+        /// otherwise.
+        WHOLE_BLOCK
+    };
+    
+    /// Choose how BGZF blocks are decompressed from the next block read on.
+    /// Virtual offsets are unaffected. Non-BGZF input always goes through
+    /// htslib, and memory-mapped input and multithreaded decompression always
+    /// inflate whole blocks.
+    virtual void SetInflateMode(InflateMode mode);
+    
+    /// Get the way BGZF blocks are being decompressed.
+    virtual InflateMode GetInflateMode() const;
+    
+    /// Set the InflateMode that newly constructed streams start out with.
+    /// Defaults to WHOLE_BLOCK if libvgio was built with libdeflate, and
+    /// HTSLIB otherwise.
+    static void SetDefaultInflateMode(InflateMode mode);
+    
+    /// Get the InflateMode that newly constructed streams start out with.
+    static InflateMode GetDefaultInflateMode();
+    
+    /// Use the given cache of decompressed blocks, which may be shared with
+    /// other streams. Blocks found in the cache are not inflated again, and
+    /// blocks we inflate are added to it, under the identity of the file we
+    /// are reading. Only used for seekable BGZF data when multithreaded
+    /// decompression is off; pass null to stop using a cache. Returns false,
+    /// and uses no cache, if we can't tell what file we are reading, because
+    /// we aren't reading a file by name or through a file descriptor stream.
+    virtual bool SetBlockCache(const std::shared_ptr<BlockCache>& cache);
+    
+    /// Get the cache of decompressed blocks in use, or null if there is none.
+    virtual std::shared_ptr<BlockCache> GetBlockCache() const;
     
     /// Return true if the given istream looks like GZIP-compressed data (i.e.
     /// has the GZIP magic number as its first two bytes). Replicates some of
@@ -103,6 +174,93 @@ protected:
     /// Flag for whether our backing stream is tellable.
     bool know_offset;
     
+    /// How we decompress BGZF blocks.
+    InflateMode inflate_mode;
+    
+    /// If we are reading from a memory-mapped file, this is the start of the
+    /// mapping. Otherwise it is null and compressed data comes from the BGZF's
+    /// hFILE.
+    const char* mapped_data;
+    
+    /// The size of the memory-mapped file, if any.
+    size_t mapped_size;
+    
+    /// The file offset of the next compressed block to read from the mapping,
+    /// which stands in for the hFILE's position.
+    int64_t mapped_cursor;
+    
+    /// If we are decompressing blocks on multiple threads, this is the
+    /// pipeline doing it.
+    std::unique_ptr<ParallelBlockInflater> inflater;
+    
+    /// Holds the block from the inflater or the cache that we are currently
+    /// reading, so its buffer stays valid.
+    std::shared_ptr<InflatedBlock> current_block;
+    
+    /// The shared cache of decompressed blocks, if any.
+    std::shared_ptr<BlockCache> block_cache;
+    
+    /// Set if we know which file we are reading, so we can share blocks
+    /// through a cache.
+    bool know_file;
+    
+    /// The device number of the file we are reading, if known.
+    uint64_t file_device;
+    
+    /// The inode number of the file we are reading, if known.
+    uint64_t file_inode;
+    
+    /// Points to the uncompressed data of the current block, wherever it
+    /// lives.
+    const char* block_data;
+    
+    /// The file offset of the block whose data block_data holds, or -1 if it
+    /// does not hold a complete block.
+    int64_t block_data_address;
+    
+    /// The InflateMode that new streams start out with.
+    static std::atomic<InflateMode> default_inflate_mode;
+    
+    /// Load the next block into the BGZF's buffer, according to the inflate
+    /// mode. Has the same contract as bgzf_read_block(): returns 0 on success
+    /// or at EOF (in which case the block length is 0), and nonzero on error.
+    int read_block();
+    
+    /// Read and inflate the next BGZF block from the backing hFILE or the
+    /// memory mapping, without going through htslib's streaming
+    /// decompression. Skips empty blocks, like bgzf_read_block().
+    int read_whole_block();
+    
+    /// Implement Skip() by reading blocks with Next() and backing up.
+    bool skip_by_reading(int count);
+    
+    /// Implement Skip() by walking BGZF block headers and footers, and only
+    /// inflating the block where the skip lands.
+    bool skip_by_headers(int count);
+    
+    /// Get the next block from the multithreaded inflater and install it as
+    /// the current block. Skips empty blocks.
+    int read_inflated_block();
+    
+    /// Set up the BGZF's cursor fields for a freshly loaded block, the same
+    /// way bgzf_read_block() does.
+    void install_block(int64_t block_address, size_t compressed_size, size_t length);
+    
+    /// Get the next complete compressed BGZF block from the hFILE or the
+    /// mapping, and advance past it. Returns 1 and fills in the block's data
+    /// pointer, size, and file offset on success, 0 at EOF, and -1 (setting
+    /// the BGZF's errcode) on error. The data pointer is valid until the next
+    /// call.
+    int fetch_compressed_block(const char** block, size_t* block_size, int64_t* block_address);
+    
+    /// Get the file offset at which the next block will be read.
+    int64_t next_block_address() const;
+    
+    /// Move the hFILE or the mapping cursor so the next compressed block is
+    /// read from the given file offset. Returns false (setting the BGZF's
+    /// errcode) on error.
+    bool seek_source(int64_t block_address);
+    
 };
 
 }
@@ -4,12 +4,16 @@
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <htslib/bgzf.h>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace vg {
 
 namespace io {
 
+class ParallelBlockDeflater;
+
 
 /// Protobuf-style ZeroCopyOutputStream that writes data in blocked gzip
 /// format, and allows interacting with virtual offsets. Does NOT emit the BGZF
@@ -21,12 +25,25 @@ public:
     /// Make a new stream outputting to the given open BGZF file handle.
     /// The stream will own the BGZF file and close it when destructed.
     /// Note that with this constructor we have no access to the backing
-    /// hFILE*, so Flush() will not be able to flush it.
+    /// hFILE*, so Flush() will not be able to flush it. If the BGZF is
+    /// already using htslib's multithreading, every Tell() has to end the
+    /// current block and wait for everything to be written, so it is better
+    /// to use EnableMultiThreading() instead.
     BlockedGzipOutputStream(BGZF* bgzf_handle);
     
     /// Make a new stream outputting to the given C++ std::ostream, wrapping it
-    /// in a BGZF.
-    BlockedGzipOutputStream(std::ostream& stream);
+    /// in a BGZF. The compression level runs from 0 to 9, or is -1 for the
+    /// zlib default. Level 1 is fastest while still compressing, and level 0
+    /// stores data uncompressed but still framed in BGZF blocks, so virtual
+    /// offsets work as usual. Throws if the level is out of range.
+    BlockedGzipOutputStream(std::ostream& stream, int compression_level = -1);
+    
+    /// Make a new stream outputting to the file at the given path, creating
+    /// or truncating it, at the given compression level. Compressed data is
+    /// written straight to a file descriptor with large buffers, bypassing C++
+    /// streams, so EnableWriteBehind() is not available. Throws if the file
+    /// cannot be opened or the level is out of range.
+    BlockedGzipOutputStream(const std::string& filename, int compression_level = -1);
 
     /// Destroy the stream, finishing all writes if necessary.
     virtual ~BlockedGzipOutputStream();
@@ -46,7 +63,9 @@ public:
     /// an unrecoverable error, and true if a buffer was gotten. The stream is
     /// responsible for making sure data in the buffer makes it into the
     /// output. The data pointer must be valid until the next write call or
-    /// until the stream is destroyed.
+    /// until the stream is destroyed. Unless htslib's multithreading is in
+    /// use, the buffer is the unused remainder of the BGZF block being built,
+    /// so data written there is compressed without being copied first.
     virtual bool Next(void** data, int* size);
     
     /// When called after Next(), mark the last count bytes of the buffer that
@@ -87,6 +106,40 @@ public:
     /// offset to 0.
     virtual void StartFile();
     
+    /// Default limit on how much uncompressed data multithreaded compression
+    /// can have waiting to be compressed and written.
+    const static size_t DEFAULT_COMPRESSION_QUEUE_BYTES = 16 * 1024 * 1024;
+    
+    /// Turn on multithreaded compression. Data is collected into full-size
+    /// BGZF blocks, which are compressed on thread_count threads and written
+    /// in order, with up to about queued_bytes of uncompressed data in
+    /// flight. Virtual offsets from Tell() stay exact, but Tell() must wait
+    /// for the blocks already filled to be compressed. Return true if
+    /// successful and false if the threads could not be set up.
+    virtual bool EnableMultiThreading(size_t thread_count, size_t queued_bytes = DEFAULT_COMPRESSION_QUEUE_BYTES);
+    
+    /// Default limit on how much compressed data write-behind mode can have
+    /// waiting to be written to the backing stream.
+    const static size_t DEFAULT_WRITE_BEHIND_BYTES = 64 * 1024 * 1024;
+    
+    /// Turn on write-behind mode, where compressed data is handed to a
+    /// dedicated I/O thread to be written to the backing ostream, through a
+    /// queue holding up to max_queued_bytes. Writers only wait when the queue
+    /// is full, and Flush() only waits for the ostream when asked for a
+    /// barrier. Only available when constructed on an ostream. Return true if
+    /// successful, and false if not available or the thread could not be
+    /// started.
+    virtual bool EnableWriteBehind(size_t max_queued_bytes = DEFAULT_WRITE_BEHIND_BYTES);
+    
+    /// Get the number of compressed bytes waiting for the write-behind I/O
+    /// thread. If this stays near the queue limit, the backing stream is the
+    /// bottleneck.
+    virtual size_t GetWriteBehindBacklog() const;
+    
+    /// Get the number of times writing had to wait for the write-behind I/O
+    /// thread to make room in its queue.
+    virtual size_t GetWriteBehindStalls() const;
+    
     /// Make this BlockedGzipOutputStream write the BGZF-required empty end of
     /// file block, when it finishes writing to the BGZF. These blocks are
     /// permitted in the interior of files, but we don't want to add them all
@@ -101,15 +154,33 @@ public:
     /// BGZF or ostream) will have all data previously written to this stream
     /// in its buffers. Flushes backing BGZFs but not backing ostreams. Flushes
     /// any intermediate streams we created.
-    void Flush();
+    ///
+    /// In write-behind mode, data is only guaranteed to have been handed to
+    /// the I/O thread, unless barrier is set, in which case we wait for it to
+    /// reach the ostream and flush that too.
+    void Flush(bool barrier = false);
+    
+    /// End the BGZF block being filled, if anything is in it, so that the
+    /// next data written starts a new block, at a virtual offset with an
+    /// in-block offset of 0. Unlike Flush(), doesn't push anything to the
+    /// backing stream. Throws on failure.
+    void EndBlock();
     
 protected:
 
-    /// Actually dump the buffer data to the BGZF, if needed. Sadly, we can't
-    /// really be zero-copy because the BGZF library isn't.
-    /// Does *NOT* make the BGZF flush and finish its block.
+    /// Commit the data written to the buffer from the last Next() call, if
+    /// any, to the BGZF block being built. Sends the block off if it is full,
+    /// but does *NOT* otherwise make the BGZF flush and finish its block.
     void flush_self();
     
+    /// Return true if Next() can hand out space in the BGZF's own block
+    /// buffer, and false if data has to be copied in with bgzf_write().
+    bool writes_in_place() const;
+    
+    /// Send the block we are filling off to be compressed, when compressing
+    /// on multiple threads. Throws on failure.
+    void submit_pending_block();
+    
     /// Force the BGZF handle closed without letting the library write its EOF marker.
     /// TODO: This is necessarily a hack that depends strongly on htslib internals.
     /// Should not be called unless data has been flushed into the BGZF.
@@ -123,9 +194,13 @@ protected:
     /// flush it since the BGZF's flush doesn't do that.
     hFILE* wrapped_ostream;
     
-    /// This vector will own the memory we use as our void* buffer.
+    /// This vector will own the memory we use as our void* buffer, when we
+    /// can't write straight into a block.
     std::vector<char> buffer;
     
+    /// The size of the buffer last handed out by Next(), wherever it is
+    size_t handed_out;
+    
     /// The number of characters that have been backed up from the end of the buffer
     size_t backed_up;
     
@@ -137,6 +212,21 @@ protected:
     
     /// Flag for whether we are supposed to close out the BGZF file.
     bool end_file;
+    
+    /// If we are compressing blocks on multiple threads, this is the pipeline
+    /// doing it. The BGZF then just holds the hFILE.
+    std::unique_ptr<ParallelBlockDeflater> deflater;
+    
+    /// When compressing on multiple threads, this is the uncompressed block
+    /// being filled. It is always a full block in size.
+    std::vector<char> pending_block;
+    
+    /// How much of pending_block has been filled.
+    size_t pending_length;
+    
+    /// When compressing on multiple threads, this is the file offset where
+    /// the pipeline's first block went.
+    int64_t deflater_start_address;
 };
 
 }
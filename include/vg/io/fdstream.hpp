@@ -19,6 +19,7 @@
  *
  * Version: Jul 28, 2002
  * History:
+ *  Oct 16, 2026: expose file descriptors so they can be used directly
  *  Nov 10, 2022: add protection against secret MacOS write size limit
  *  Oct 17, 2022: add protection against partial writes
  *  Oct 05, 2020: add stream-wrapping stream and up putback, use unnamespaced void* read/write
@@ -37,6 +38,8 @@
 #include <cstdio>
 // for memmove():
 #include <cstring>
+// for INT_MAX:
+#include <climits>
 
 
 // low-level read and write functions
@@ -69,6 +72,10 @@ class fdoutbuf : public std::streambuf {
     // constructor
     fdoutbuf (int _fd) : fd(_fd) {
     }
+    // get the file descriptor written to
+    int file_descriptor () const {
+        return fd;
+    }
   protected:
     // write one character
     virtual int_type overflow (int_type c) {
@@ -147,6 +154,10 @@ class fdinbuf : public std::streambuf {
               buffer+pbSize,     // read position
               buffer+pbSize);    // end position
     }
+    // get the file descriptor read from
+    int file_descriptor () const {
+        return fd;
+    }
 
   protected:
     // insert new characters into the buffer
@@ -210,7 +221,7 @@ class fdistream : public std::istream {
 
 class streaminbuf : public std::streambuf {
   protected:
-    istream& other;    // file descriptor
+    std::istream& other;    // file descriptor
   protected:
     /* data buffer:
      * - at most, pbSize characters in putback area plus
@@ -227,7 +238,7 @@ class streaminbuf : public std::streambuf {
      * - no putback area
      * => force underflow()
      */
-    streaminbuf (istream& _other) : other(_other) {
+    streaminbuf (std::istream& _other) : other(_other) {
         setg (buffer+pbSize,     // beginning of putback area
               buffer+pbSize,     // read position
               buffer+pbSize);    // end position
@@ -284,7 +295,7 @@ class streamistream : public std::istream {
   protected:
     streaminbuf buf;
   public:
-    streamistream (istream& other) : std::istream(0), buf(other) {
+    streamistream (std::istream& other) : std::istream(0), buf(other) {
         rdbuf(&buf);
     }
 };
@@ -0,0 +1,102 @@
+#ifndef VG_IO_GROUP_INDEX_HPP_INCLUDED
+#define VG_IO_GROUP_INDEX_HPP_INCLUDED
+
+/**
+ * \file group_index.hpp
+ * Defines an index of the message groups in a type-tagged message file, which
+ * can be kept in a sidecar file next to it.
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Index of the groups in a type-tagged message file, giving the virtual offset,
+ * tag, and number of messages of each group, and the virtual offset past the
+ * last group. Lets readers find group k, count messages, or divide up the file,
+ * without decompressing it.
+ *
+ * Serialized compactly, with virtual offsets delta-encoded as varints and tags
+ * stored once.
+ */
+class GroupIndex {
+public:
+
+    /// Get the filename that the sidecar index for the given file goes in.
+    static string sidecar_filename(const string& filename);
+
+    /// Build an index for the given file by reading through it. Messages are
+    /// skipped over by their lengths, without being parsed or copied, but the
+    /// file does get decompressed. Throws if the file cannot be read.
+    static GroupIndex index_file(const string& filename);
+
+    /// Add a group at the end of the index. Groups must be added in file
+    /// order.
+    void add_group(const string& tag, int64_t virtual_offset, size_t message_count);
+
+    /// Set the virtual offset past the end of the last group.
+    void set_end(int64_t virtual_offset);
+
+    /// Get the number of groups.
+    size_t group_count() const;
+
+    /// Get the virtual offset of the given group.
+    int64_t group_vo(size_t group_number) const;
+
+    /// Get the tag of the given group.
+    const string& group_tag(size_t group_number) const;
+
+    /// Get the number of messages in the given group.
+    size_t group_messages(size_t group_number) const;
+
+    /// Get the virtual offset past the end of the last group.
+    int64_t end_vo() const;
+
+    /// Get the total number of messages in all groups.
+    size_t message_count() const;
+
+    /// Get the total number of messages in groups with the given tag.
+    size_t message_count(const string& tag) const;
+
+    /// Get the number of the last group that starts at or before the given
+    /// virtual offset, or group_count() if there is none.
+    size_t find_group(int64_t virtual_offset) const;
+
+    /// Write the index to the given stream. Throws on error.
+    void save(ostream& out) const;
+
+    /// Replace the index with one read from the given stream. Throws if the
+    /// data is not a valid index.
+    void load(istream& in);
+
+private:
+
+    /// The distinct tags used, in order of first use
+    vector<string> tags;
+
+    /// The virtual offset of each group
+    vector<int64_t> group_vos;
+
+    /// The index in tags of each group's tag
+    vector<uint32_t> group_tags;
+
+    /// The number of messages in each group
+    vector<uint64_t> group_sizes;
+
+    /// The virtual offset past the last group
+    int64_t end = 0;
+};
+
+}
+
+}
+
+#endif
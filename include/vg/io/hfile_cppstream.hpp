@@ -18,12 +18,35 @@ namespace vg {
 
 namespace io {
 
-/// Wrap a C++ output stream as an hFILE* that can be written by BGZF
+/// Wrap a C++ output stream as an hFILE* that can be written by BGZF. If the
+/// stream is an fdostream, writes go straight to its file descriptor.
 hFILE* hfile_wrap(std::ostream& output);
 
-/// Wrap a C++ input stream as an hFILE* that can be read by BGZF
+/// Wrap a C++ input stream as an hFILE* that can be read by BGZF. If the
+/// stream is an fdistream with nothing buffered, reads come straight from its
+/// file descriptor.
 hFILE* hfile_wrap(std::istream& input);
 
+/// Make an hFILE* from hfile_wrap(std::ostream&) write to its stream from a
+/// background thread, through a queue holding up to max_queued_bytes, so
+/// writing and flushing the hFILE don't wait on the stream. Return false if
+/// the hFILE isn't a wrapped output stream (including if it was wrapped
+/// straight to a file descriptor) or the thread can't be started.
+bool hfile_enable_write_behind(hFILE* wrapped, size_t max_queued_bytes);
+
+/// Flush the given hFILE* and, if it is writing in the background, wait for
+/// everything to reach its stream and flush that too. Returns 0 on success,
+/// or a negative number and sets errno on error.
+int hfile_sync(hFILE* wrapped);
+
+/// Get the number of bytes an hFILE* writing in the background has waiting to
+/// be written, or 0 if it isn't writing in the background.
+size_t hfile_write_behind_backlog(hFILE* wrapped);
+
+/// Get the number of times writing to an hFILE* writing in the background had
+/// to wait for the stream to catch up.
+size_t hfile_write_behind_stalls(hFILE* wrapped);
+
 }
 
 }
@@ -0,0 +1,44 @@
+/// \file hfile_fd.hpp
+/// hFILE* file descriptor backend
+/// Modeled on the fd backend in https://github.com/samtools/htslib/blob/master/hfile.c
+
+// We want to be able to read and write files by path or through file
+// descriptors without going through C++ streams, but still with control over
+// buffering and access hints.
+
+#ifndef VG_HFILE_FD_HPP_INCLUDED
+#define VG_HFILE_FD_HPP_INCLUDED
+
+#include <htslib/hfile.h>
+
+#include <string>
+
+namespace vg {
+
+namespace io {
+
+/// Default size of the buffer used by hFILEs on file descriptors. We move
+/// data in bigger chunks than htslib's default.
+const size_t DEFAULT_FD_BUFFER_SIZE = 1024 * 1024;
+
+/// Wrap an open file descriptor as an hFILE* that can be read or written by
+/// BGZF, depending on whether mode is "r" or "w". Seekable files are read
+/// and written with pread() and pwrite() from the descriptor's current
+/// offset, and are marked for sequential access. Pipes and terminals are read
+/// and written normally. If take_ownership is set, the descriptor is closed
+/// when the hFILE is; otherwise it is left at the position the hFILE reached.
+/// Returns null and sets errno on error.
+hFILE* hfile_wrap_fd(int fd, const char* mode, bool take_ownership = false,
+                     size_t buffer_size = DEFAULT_FD_BUFFER_SIZE);
+
+/// Open the file at the given path as an hFILE* on a file descriptor, for
+/// reading if mode is "r" or for writing (creating or truncating the file)
+/// if mode is "w". Returns null and sets errno on error.
+hFILE* hfile_open_path(const std::string& filename, const char* mode,
+                       size_t buffer_size = DEFAULT_FD_BUFFER_SIZE);
+
+}
+
+}
+
+#endif // VG_HFILE_FD_HPP_INCLUDED
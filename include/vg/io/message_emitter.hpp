@@ -19,6 +19,7 @@
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
 #include "blocked_gzip_output_stream.hpp"
+#include "group_index.hpp"
 
 namespace vg {
 
@@ -60,13 +61,21 @@ public:
 
     /// We refuse to serialize individual messages longer than this size.
     const static size_t MAX_MESSAGE_SIZE;
+    
+    /// By default, we start a new group rather than put more than this many
+    /// bytes of message data in a group.
+    const static size_t DEFAULT_MAX_GROUP_BYTES;
 
     /// Constructor. Write output to the given stream. If compress is true,
-    /// compress it as BGZF. Limit the maximum number of messages in a group to
-    /// max_group_size.
+    /// compress it as BGZF, at the given compression level (0-9, or -1 for
+    /// the default; see BlockedGzipOutputStream). Limit the maximum number of
+    /// messages in a group to max_group_size, and the message data in a group
+    /// to max_group_bytes, closing groups at whichever limit comes first. A
+    /// message bigger than max_group_bytes gets a group to itself.
     ///
     /// If not compressing, virtual offsets are just ordinary offsets. 
-    MessageEmitter(ostream& out, bool compress = false, size_t max_group_size = 1000);
+    MessageEmitter(ostream& out, bool compress = false, size_t max_group_size = 1000, int compression_level = -1,
+                   size_t max_group_bytes = DEFAULT_MAX_GROUP_BYTES);
     
     /// Destructor that finishes the file
     ~MessageEmitter();
@@ -91,6 +100,43 @@ public:
     /// To use when you have something you can't move.
     void write_copy(const string& tag, const string& message);
     
+    /// Make room to emit a message of the given size with the given type tag,
+    /// and return where the caller must put exactly message_size bytes of
+    /// message data. The space is only valid until the next call on this
+    /// object. Lets callers serialize straight into the group buffer, instead
+    /// of into a string that then has to be copied.
+    uint8_t* write_in_place(const string& tag, size_t message_size);
+    
+    /// Emit all the messages in the given buffer, which have already been
+    /// framed by frame_message(), with the given type tag. They are added to
+    /// groups just as if they were written one at a time, but the caller can
+    /// serialize them without holding any lock on this object.
+    void write_framed(const string& tag, const string& framed_messages);
+    
+    /// Emit a whole group of the given number of messages with the given tag,
+    /// where the messages have already been framed by frame_message(). Emits
+    /// any different or nonempty buffered group first. Leaves framed_messages
+    /// empty, but possibly holding onto memory for reuse.
+    void emit_framed_group(const string& tag, string& framed_messages, size_t message_count);
+    
+    /// Add the length of a message of the given size to the end of the given
+    /// buffer of framed messages, make room after it for the message, and
+    /// return where the message data must go.
+    static uint8_t* frame_message(string& framed_messages, size_t message_size);
+    
+    /// Compress BGZF output on the given number of threads. Returns false if
+    /// we are not compressing, or the threads could not be started. Virtual
+    /// offsets reported to group listeners stay exact, but finding them makes
+    /// the emitter wait for compression to catch up.
+    bool enable_multithreading(size_t thread_count);
+    
+    /// Start every group at the start of a BGZF block, so that each group's
+    /// virtual offset is just its block's address and can be sought to
+    /// without decompressing anything before it. Costs some compression when
+    /// groups are much smaller than a block. Returns false if we are not
+    /// compressing.
+    bool enable_block_aligned_groups();
+    
     /// Define a type for group emission event listeners.
     /// Arguments are: type tag, start virtual offset, and past-end virtual offset.
     using group_listener_t = function<void(const string&, int64_t, int64_t)>;
@@ -101,6 +147,12 @@ public:
     /// Anything the function uses by reference must outlive this object!
     void on_group(group_listener_t&& listener);
     
+    /// Keep a GroupIndex of the groups emitted from now on, and write it to
+    /// the given stream when the file is finished. The stream must outlive
+    /// this object. Offsets in the index are only useful if this emitter
+    /// controls the whole file.
+    void write_group_index(ostream& index_out);
+    
     /// Actually write out everything in the buffer.
     /// Doesn't actually flush the underlying streams to disk.
     /// Assumes that no more than one group's worth of messages are in the buffer.
@@ -110,17 +162,41 @@ public:
     /// After this has been called, a full BGZF block will be in the backing
     /// stream (passed to the constructor), but the backing stream won't
     /// necessarily be flushed.
-    void flush();
+    ///
+    /// In write-behind mode, the block is only guaranteed to be queued for
+    /// the I/O thread, unless barrier is set, in which case we wait for it to
+    /// reach the backing stream and flush that.
+    void flush(bool barrier = false);
+    
+    /// Write compressed data to the backing stream from a dedicated I/O
+    /// thread, through a queue holding up to max_queued_bytes, so that
+    /// flushing doesn't wait on the stream. Returns false if we are not
+    /// compressing or the thread could not be started.
+    bool enable_write_behind(size_t max_queued_bytes = BlockedGzipOutputStream::DEFAULT_WRITE_BEHIND_BYTES);
+    
+    /// Get the number of compressed bytes waiting for the write-behind I/O
+    /// thread, to see if the backing stream is holding us up.
+    size_t write_behind_backlog() const;
 
 private:
 
     /// This is our internal tag string for what is in our buffer.
     /// If it is empty, no group is buffered, because empty tags are prohibited.
     string group_tag;
-    /// This is our internal buffer
-    vector<string> group;
+    /// This is our internal buffer, holding the messages already framed with
+    /// their lengths, ready to go out after the group header
+    string group_data;
+    /// This is the number of messages in the buffer
+    size_t group_messages = 0;
     /// This is how big we let it get before we dump it
     size_t max_group_size;
+    /// This is the number of bytes of message data in the buffer, not
+    /// counting the lengths
+    size_t group_bytes = 0;
+    /// And this is how many bytes of message data we let it hold
+    size_t max_group_bytes;
+    /// Set if each group should start its own BGZF block
+    bool block_aligned_groups = false;
     /// This holds the BGZF output stream, if we are writing BGZF.
     /// Since Protobuf streams can't be copied or moved, we wrap ours in a uniqueptr_t so we can be moved.
     unique_ptr<BlockedGzipOutputStream> bgzip_out;
@@ -134,6 +210,14 @@ private:
     
     /// If someone wants to listen in on emitted groups, they can register a handler
     vector<group_listener_t> group_handlers;
+    
+    /// If we are indexing our groups, this is the index.
+    unique_ptr<GroupIndex> group_index;
+    /// And this is where it goes when we finish.
+    ostream* group_index_out = nullptr;
+    
+    /// Get the virtual offset that the next group would start at.
+    int64_t tell() const;
 
 };
 
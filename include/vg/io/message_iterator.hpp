@@ -11,12 +11,14 @@
 #include <istream>
 #include <fstream>
 #include <functional>
+#include <limits>
 #include <vector>
 #include <memory>
 
 #include <google/protobuf/io/coded_stream.h>
 
 #include "blocked_gzip_input_stream.hpp"
+#include "group_index.hpp"
 
 
 // protobuf scrapped the two-parameter version of this in 3.6.0
@@ -33,15 +35,61 @@ namespace io {
 using namespace std;
 
 
+/// A predicate on the serialized data of a message and the tag of the group it
+/// is in, used to throw out messages before anyone parses them. Since files
+/// can mix message types, filters should pass messages with tags they don't
+/// know how to look at.
+using MessageFilter = function<bool(const string& tag, const char* data, size_t size)>;
+
+/**
+ * A batch of message data pulled from a MessageIterator, stored back to back
+ * in one buffer, with a table of where each message starts. Clearing a batch
+ * keeps its memory, so a batch that is reused costs no allocations once it
+ * has grown to size.
+ */
+class MessageBatch {
+public:
+    
+    /// Get the number of messages in the batch.
+    size_t size() const;
+    
+    /// Return true if there are no messages in the batch.
+    bool empty() const;
+    
+    /// Get the total number of bytes of message data in the batch.
+    size_t bytes() const;
+    
+    /// Get the data of the message at the given index.
+    const char* data(size_t i) const;
+    
+    /// Get the size of the message at the given index.
+    size_t message_size(size_t i) const;
+    
+    /// Add a copy of the given message data to the end of the batch.
+    void push_back(const char* data, size_t size);
+    
+    /// Remove all messages from the batch, keeping the memory.
+    void clear();
+    
+private:
+    
+    /// All the message data, back to back
+    vector<char> arena;
+    
+    /// Where each message starts in the arena, plus the end of the last
+    /// message.
+    vector<size_t> offsets = {0};
+};
+
 /**
  * Iterator over messages in VG-format files. Yields pairs of string tag and
  * message data. Also supports seeking and telling at the group level in bgzip
  * files. Cannot be copied, but can be moved.
  *
- * TODO: Right now we always copy all messages into an internal buffer. We
- * should only do that if the message contents are actually accessed, with some
- * kind of lazy fake string that evaluates on string conversion. Then we could
- * more efficiently skip stuff with the wrong tag.
+ * Message data is only read out of the stream when it is asked for, so
+ * messages that are skipped after looking at their tag() cost nothing to
+ * decode. Use view() to look at message data without copying it into a
+ * string.
  */
 class MessageIterator {
 public:
@@ -49,6 +97,15 @@ public:
     /// We refuse to serialize individual messages longer than this size.
     const static size_t MAX_MESSAGE_SIZE = 1000000000;
     
+    /// Most threads to decompress on by default when also parsing.
+    const static size_t MAX_DEFAULT_DECOMPRESSION_THREADS = 8;
+    
+    /// Get how many threads to decompress on by default when messages are
+    /// being parsed on the given number of threads: half as many, but at
+    /// least 1 and at most MAX_DEFAULT_DECOMPRESSION_THREADS, so that
+    /// decompression and parsing together don't crowd out the cores.
+    static size_t decompression_threads_for(size_t parse_threads);
+    
     /// Sniffing function to identify if data in a C++ stream appears to be
     /// *uncompressed* type-tagged message data, and, if so, what the tag is.
     /// Returns the tag if it could be sniffed, or the empty string if the tag
@@ -82,6 +139,24 @@ public:
     /// If there is a tag but no messages in its group, the data pointer will be null.
     using TaggedMessage = pair<string, unique_ptr<string>>;
     
+    /// Represents a tag value and a view of some message data, which is only
+    /// valid until the iterator that produced it is advanced, sought, or
+    /// destroyed. If there is a tag but no messages in its group, data will
+    /// be null.
+    struct TaggedMessageView {
+        /// The tag for the group the message is in, or "" if it has none.
+        const string* tag = nullptr;
+        /// The message data, if any.
+        const char* data = nullptr;
+        /// The number of bytes of message data.
+        size_t size = 0;
+        
+        /// Copy the message data into a string.
+        inline string str() const {
+            return string(data, size);
+        }
+    };
+    
     ///////////
     // C++ Iterator Interface
     ///////////
@@ -127,6 +202,49 @@ public:
     /// Take the current item, which must exist, and advance the iterator to the next one.
     TaggedMessage take();
     
+    /// Get the tag of the current item, which must exist, without reading
+    /// its message data.
+    const string& tag() const;
+    
+    /// Get the number of messages in the group the current item, which must
+    /// exist, is in, not counting the tag. Tag-only groups have 0 messages,
+    /// but still produce an item.
+    size_t group_size() const;
+    
+    /// Get a view of the current item, which must exist. Message data is
+    /// pointed to where it was decompressed, unless it spans BGZF blocks, in
+    /// which case it is copied to a buffer that the iterator reuses.
+    TaggedMessageView view() const;
+    
+    /// Clear the given batch and fill it with the data of up to max_messages
+    /// messages (or any number, if 0), starting with the current item, and
+    /// stopping early rather than going over max_bytes of data (unless a
+    /// single message is bigger than that). Advances past the messages taken.
+    /// Tags are not recorded, and tag-only groups are passed over; use
+    /// set_tag_filter() to only get messages with certain tags. Returns the
+    /// number of messages in the batch, which is 0 only at the end.
+    size_t next_batch(MessageBatch& batch, size_t max_messages,
+                      size_t max_bytes = numeric_limits<size_t>::max());
+    
+    /// Skip the rest of the group the current item is in, without reading
+    /// the messages, and advance to the first item of the next group, or the
+    /// end.
+    void skip_group();
+    
+    /// Only produce items from groups whose tags pass the given filter.
+    /// Groups with no tag are checked as having the tag "". Groups that fail
+    /// are skipped without reading their messages. Applies to groups reached
+    /// after this is called; the current item is not affected. Pass an empty
+    /// function to stop filtering.
+    void set_tag_filter(const function<bool(const string&)>& filter);
+    
+    /// Only produce messages whose data passes the given filter. Messages
+    /// that fail are passed over, without being copied anywhere; tag-only
+    /// groups are not checked. Applies to messages reached after this is
+    /// called; the current item is not affected. Pass an empty function to
+    /// stop filtering.
+    void set_message_filter(const MessageFilter& filter);
+    
     ///////////
     // File position and seeking
     ///////////
@@ -144,11 +262,77 @@ public:
     /// Return false if seeking is unsupported or the seek fails.
     bool seek_group(int64_t virtual_offset);
     
+    ///////////
+    // Group index
+    ///////////
+    
+    /// Use the given index of the groups in the file, such as one written
+    /// by an emitter, to find groups by number.
+    void set_group_index(const shared_ptr<const GroupIndex>& index);
+    
+    /// Load and use the index of the groups in the file from the given
+    /// sidecar file (see GroupIndex::sidecar_filename()). Returns false, and
+    /// leaves any index already in use alone, if the file can't be opened or
+    /// is not a valid index.
+    bool load_group_index(const string& index_filename);
+    
+    /// Get the index of the groups in the file, or null if there isn't one.
+    const shared_ptr<const GroupIndex>& get_group_index() const;
+    
+    /// Seek to the start of the group with the given number in the index.
+    /// Return false if there is no index, there is no such group, or seeking
+    /// fails.
+    bool seek_group_number(size_t group_number);
+    
 private:
     
     /// Holds the most recently pulled-out message tag and value.
-    /// May get moved away.
-    TaggedMessage value;
+    /// May get moved away. The value is only filled in when asked for.
+    mutable TaggedMessage value;
+    
+    /// Set when value holds the current message, or null for a tag-only
+    /// group.
+    mutable bool value_ready = false;
+    
+    /// Set when the current message's data hasn't been read from the stream
+    /// yet. The stream is positioned right at its start.
+    mutable bool data_pending = false;
+    
+    /// The size of the current message's data.
+    mutable size_t data_size = 0;
+    
+    /// Where the current message's data is in the stream's buffer, once
+    /// read. Null for a tag-only group, or if the data is in spill_buffer.
+    mutable const char* data_start = nullptr;
+    
+    /// Set when the current message's data is in spill_buffer.
+    mutable bool data_spilled = false;
+    
+    /// Buffer to hold messages that span BGZF blocks, so they can be viewed
+    /// contiguously. Reused from message to message.
+    mutable string spill_buffer;
+    
+    /// If set, groups with tags that this rejects are skipped.
+    function<bool(const string&)> tag_filter;
+    
+    /// If set, messages with data that this rejects are skipped.
+    MessageFilter message_filter;
+    
+    /// The start of the buffer we last got from the stream.
+    mutable const char* buffer_start = nullptr;
+    
+    /// The virtual offset of buffer_start, as the stream reported it right
+    /// before handing the buffer over, or -1 if unavailable. A buffer never
+    /// spans blocks, so offsets in it can be worked out from this.
+    mutable int64_t buffer_vo = -1;
+    
+    /// The next unread byte of the buffer we last got from the stream.
+    mutable const char* buffer_cursor = nullptr;
+    
+    /// The end of the buffer we last got from the stream. We read straight
+    /// out of the stream's buffers, instead of setting up a
+    /// CodedInputStream for every message.
+    mutable const char* buffer_end = nullptr;
     
     /// Because the whole value pair may get moved away, we keep a previous copy of the tag and replace it.
     /// TODO: This is a bit of a hack.
@@ -174,9 +358,53 @@ private:
     /// Set this to true to print messages about what is being decoded.
     bool verbose = false;
     
+    /// The index of the groups in the file, if we have one.
+    shared_ptr<const GroupIndex> group_index;
+    
+    /// Move to the next item, whether or not it passes the message filter.
+    void next_item();
+    
+    /// Read the current message's data out of the stream, if it hasn't been
+    /// already, and point data_start at it or put it in spill_buffer.
+    void read_data() const;
+    
+    /// Fill in the value's message string from the message's data, if it
+    /// hasn't been already.
+    void fill_value() const;
+    
+    /// Skip the current message's data in the stream, if it hasn't been read,
+    /// and forget about the current message.
+    void discard_data();
+    
+    /// Skip the given number of length-prefixed messages in the stream,
+    /// without reading their data.
+    void skip_messages(size_t count);
+    
+    /// Make sure there is unread data in our buffer, getting more from the
+    /// stream if needed. Returns false at the end of the stream.
+    bool fill_buffer() const;
+    
+    /// Back the stream up over the unread part of our buffer, so it is where
+    /// we are, and forget the buffer.
+    void return_buffer() const;
+    
+    /// Get the stream's virtual offset at our position, or -1 if unavailable.
+    /// Doesn't move the stream.
+    int64_t tell_stream() const;
+    
+    /// Read a varint. Returns false if the stream ends first or it is invalid.
+    bool read_varint(uint64_t& dest) const;
+    
+    /// Read the given number of bytes to the given place. Returns false if the
+    /// stream ends first.
+    bool read_bytes(char* dest, size_t count) const;
+    
+    /// Skip the given number of bytes. Returns false if the stream ends first.
+    bool skip_bytes(size_t count) const;
+    
     /// Make sure the given Protobuf-library bool return value is true, and fail otherwise with a message.
     /// Reports the virtual offset of the invalid group and/or message
-    void handle(bool ok, int64_t group_virtual_offset = 0, int64_t message_virtual_offset = 0);
+    static void handle(bool ok, int64_t group_virtual_offset = 0, int64_t message_virtual_offset = 0);
 };
 
 }
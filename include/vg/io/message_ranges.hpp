@@ -0,0 +1,70 @@
+#ifndef VG_IO_MESSAGE_RANGES_HPP_INCLUDED
+#define VG_IO_MESSAGE_RANGES_HPP_INCLUDED
+
+/**
+ * \file message_ranges.hpp
+ * Tools for dividing a BGZF-compressed file of type-tagged, grouped messages
+ * into ranges of whole groups that can be read independently, in parallel.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "blocked_gzip_input_stream.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * A range of message groups in a file, between two group virtual offsets.
+ */
+struct MessageRange {
+    /// The virtual offset of the first group in the range.
+    int64_t start_vo = 0;
+    /// The virtual offset of the first group after the range, or -1 if the
+    /// range runs to the end of the file.
+    int64_t end_vo = -1;
+};
+
+/// Find the file offset of the first BGZF block that starts at or after the
+/// given file offset in the given file, by looking for a valid block header
+/// that is followed by another valid block header or the end of the file.
+/// Returns the file size if there is no such block. Throws if the file cannot
+/// be read.
+int64_t find_bgzf_block(const string& filename, int64_t offset);
+
+/// Find the virtual offset of the first message group that starts at or after
+/// the given virtual offset, which need not be at a group start. Candidate
+/// group starts must have a registered tag, and must frame their messages
+/// and the group after them (if any) correctly. Does not check more than
+/// about max_check_bytes of data after each candidate, so message data that
+/// happens to look like framing can still be mistaken for a group start; only
+/// reading from an earlier group start can be sure. Leaves the stream in an
+/// unspecified position. Returns -1 if no group starts after the given
+/// virtual offset, or if the stream cannot seek.
+int64_t find_group_start(BlockedGzipInputStream& in, int64_t virtual_offset,
+                         size_t max_check_bytes = 1024 * 1024);
+
+/// Divide the message groups in the given file into about range_count
+/// non-overlapping ranges, which together cover the whole file, by splitting
+/// the compressed file into about equal parts and finding the first group
+/// that starts in or after the BGZF block at each split. If the file has a
+/// sidecar GroupIndex that matches it, group starts are taken from that.
+/// Otherwise they are found by walking the group framing from the start of
+/// the file, which decompresses it but does not look at the messages. If the
+/// framing can't be followed, the rest of the file is left in the last range.
+/// Ranges that would be empty are left out. Files that are not seekable BGZF,
+/// or that do not start with a tagged group, are not split, and produce a
+/// single range. Returns no ranges for an empty file.
+/// Throws if the file cannot be opened.
+vector<MessageRange> split_message_file(const string& filename, size_t range_count);
+
+}
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef VG_IO_PARALLEL_BLOCK_DEFLATER_HPP_INCLUDED
+#define VG_IO_PARALLEL_BLOCK_DEFLATER_HPP_INCLUDED
+
+/**
+ * \file parallel_block_deflater.hpp
+ * Defines a write-behind pipeline that compresses BGZF blocks on a pool of
+ * threads and writes them out in order.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bgzf_block.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Compresses BGZF blocks behind a writer in parallel, and writes them out in
+ * the order they were submitted.
+ *
+ * Compressed blocks are passed, in order, to a write function that is only
+ * ever called from the thread calling submit(), compressed_size(), or
+ * flush(), so it can write to a non-thread-safe sink like an hFILE. The
+ * number of blocks in flight is bounded.
+ *
+ * Not thread-safe to call into.
+ */
+class ParallelBlockDeflater {
+public:
+
+    /// Type of a function that writes out a complete compressed block. It
+    /// must return true on success and false on error.
+    using write_function_t = function<bool(const char*, size_t)>;
+
+    /// Make a new pipeline writing blocks with the given write function, and
+    /// compressing them on the given number of threads at the given
+    /// zlib-style compression level. Holds no more than max_queued_blocks
+    /// blocks that have been submitted but not written.
+    ParallelBlockDeflater(const write_function_t& write, size_t thread_count, size_t max_queued_blocks, int level);
+
+    /// Stop all the worker threads and destroy the pipeline. Blocks not yet
+    /// written are dropped; call flush() first to keep them.
+    ~ParallelBlockDeflater();
+
+    // Can't be copied or moved, because threads point to us.
+    ParallelBlockDeflater(const ParallelBlockDeflater& other) = delete;
+    ParallelBlockDeflater& operator=(const ParallelBlockDeflater& other) = delete;
+    ParallelBlockDeflater(ParallelBlockDeflater&& other) = delete;
+    ParallelBlockDeflater& operator=(ParallelBlockDeflater&& other) = delete;
+
+    /// Get a buffer to fill with uncompressed data for the next block. Reuses
+    /// the buffers of blocks already written, if possible, so the size and
+    /// contents are arbitrary.
+    vector<char> get_buffer();
+
+    /// Queue the given uncompressed data, which must fit in a BGZF block, to
+    /// be compressed as a block of its own and written after everything
+    /// already submitted. Writes out any finished blocks, and waits for the
+    /// oldest block if too many are in flight. Returns false if a block could
+    /// not be compressed or written.
+    bool submit(vector<char>&& data);
+
+    /// Get the total compressed size of all blocks submitted so far, waiting
+    /// for them to be compressed but not written. Returns -1 if a block could
+    /// not be compressed or written.
+    int64_t compressed_size();
+
+    /// Wait for all submitted blocks to be compressed and written. Returns
+    /// false if a block could not be compressed or written.
+    bool flush();
+
+    /// Set the compression level for blocks submitted from now on.
+    void set_level(int level);
+
+private:
+
+    /// Represents a block in flight.
+    struct Slot {
+        /// The uncompressed data, which is kept for reuse
+        vector<char> data;
+        /// The compressed block
+        vector<char> compressed;
+        /// The compression level to use
+        int level = -1;
+        /// Set when the worker is done with the slot
+        bool done = false;
+        /// Set if the block could not be compressed
+        bool failed = false;
+    };
+
+    /// The function we call to write compressed blocks
+    write_function_t write;
+
+    /// The most blocks to have in flight
+    size_t max_queued_blocks;
+
+    /// The compression level for new blocks
+    int level;
+
+    /// The compressed bytes written so far
+    int64_t written_bytes;
+
+    /// Set when a block could not be compressed or written. We can't go on
+    /// after that.
+    bool failed;
+
+    /// Blocks submitted and not yet written, in order. Only touched by the
+    /// submitting thread.
+    deque<shared_ptr<Slot>> window;
+
+    /// Uncompressed buffers from written blocks, ready for reuse. Only
+    /// touched by the submitting thread.
+    vector<vector<char>> spare_buffers;
+
+    /// Slots waiting for a worker to pick them up, in order.
+    deque<shared_ptr<Slot>> work_queue;
+
+    /// Protects work_queue, stopping, and the done and failed flags on slots
+    mutex queue_mutex;
+
+    /// Notified when there is work for the workers, or they should stop
+    condition_variable work_ready;
+
+    /// Notified when a worker finishes a slot
+    condition_variable slot_done;
+
+    /// Set when the workers should exit
+    bool stopping;
+
+    /// The worker threads
+    vector<thread> workers;
+
+    /// Wait for the given slot to be compressed. Returns false if it failed.
+    bool wait_for(Slot& slot);
+
+    /// Write out the oldest block in the window, waiting for it if necessary.
+    /// Returns false on error.
+    bool write_front();
+
+    /// Write out blocks at the front of the window that are already done,
+    /// without waiting. Returns false on error.
+    bool write_finished();
+
+    /// Function run by each worker thread.
+    void worker_function();
+
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef VG_IO_PARALLEL_BLOCK_INFLATER_HPP_INCLUDED
+#define VG_IO_PARALLEL_BLOCK_INFLATER_HPP_INCLUDED
+
+/**
+ * \file parallel_block_inflater.hpp
+ * Defines a read-ahead pipeline that decompresses BGZF blocks on a pool of
+ * threads and delivers them in file order.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bgzf_block.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Decompresses the BGZF blocks ahead of a reader in parallel, and hands them
+ * back in file order.
+ *
+ * Compressed blocks are pulled, in order, from a fetch function that is only
+ * ever called from the thread calling next() or reset(), so it can read from
+ * a non-thread-safe source like an hFILE. They are then inflated by worker
+ * threads. The read-ahead window is bounded by the number of uncompressed
+ * bytes it holds, which is known from each block's footer before it is
+ * inflated.
+ *
+ * Not thread-safe to call into.
+ */
+class ParallelBlockInflater {
+public:
+
+    /// Type of a function that produces the next compressed block. It must
+    /// return 1 and fill in a pointer to the block data, the block size, and
+    /// the block's file offset on success, return 0 at EOF, and return -1 on
+    /// error. The block data need only stay valid until the next call.
+    using fetch_function_t = function<int(const char**, size_t*, int64_t*)>;
+
+    /// Make a new pipeline pulling blocks from the given fetch function,
+    /// starting at the given file offset, and inflating them on the given
+    /// number of threads. Holds no more than max_buffered_bytes of
+    /// uncompressed data ahead of the reader, except that at least one block
+    /// is always read ahead.
+    ParallelBlockInflater(const fetch_function_t& fetch, int64_t start_address, size_t thread_count,
+                          size_t max_buffered_bytes);
+
+    /// Stop all the worker threads and destroy the pipeline.
+    ~ParallelBlockInflater();
+
+    // Can't be copied or moved, because threads point to us.
+    ParallelBlockInflater(const ParallelBlockInflater& other) = delete;
+    ParallelBlockInflater& operator=(const ParallelBlockInflater& other) = delete;
+    ParallelBlockInflater(ParallelBlockInflater&& other) = delete;
+    ParallelBlockInflater& operator=(ParallelBlockInflater&& other) = delete;
+
+    /// Get the next block in file order, waiting for it to be inflated if
+    /// necessary. Empty blocks are delivered like any other. Returns 1 and
+    /// fills in the block on success, 0 at EOF, and -1 if the block could not
+    /// be fetched or inflated.
+    int next(shared_ptr<InflatedBlock>& block);
+
+    /// Throw away everything read ahead, and start again from the given file
+    /// offset. The fetch function must already be positioned there.
+    void reset(int64_t start_address);
+
+    /// Get the file offset of the next block that next() will deliver.
+    int64_t next_address() const;
+
+private:
+
+    /// Represents a block in the read-ahead window.
+    struct Slot {
+        /// The compressed data, which is freed once inflated
+        vector<char> compressed;
+        /// The uncompressed size the block claims to have
+        size_t expected_size = 0;
+        /// Where the inflated data goes
+        shared_ptr<InflatedBlock> block;
+        /// Set when the worker is done with the slot
+        bool done = false;
+        /// Set if the block could not be fetched or inflated
+        bool failed = false;
+    };
+
+    /// The function we call to get compressed blocks
+    fetch_function_t fetch;
+
+    /// The maximum uncompressed bytes to have in the window
+    size_t max_buffered_bytes;
+
+    /// The uncompressed bytes in the window right now
+    size_t buffered_bytes;
+
+    /// The offset of the next block to be delivered
+    int64_t delivery_address;
+
+    /// Set when the fetch function has reported EOF or an error, so we should
+    /// not fetch any more.
+    bool fetch_finished;
+
+    /// Set when fetching stopped because of an error rather than EOF.
+    bool fetch_failed;
+
+    /// Blocks in the read-ahead window, in file order. Only touched by the
+    /// reading thread.
+    deque<shared_ptr<Slot>> window;
+
+    /// Slots waiting for a worker to pick them up, in file order.
+    deque<shared_ptr<Slot>> work_queue;
+
+    /// Protects work_queue, stopping, and the done and failed flags on slots
+    mutex queue_mutex;
+
+    /// Notified when there is work for the workers, or they should stop
+    condition_variable work_ready;
+
+    /// Notified when a worker finishes a slot
+    condition_variable slot_done;
+
+    /// Set when the workers should exit
+    bool stopping;
+
+    /// The worker threads
+    vector<thread> workers;
+
+    /// Fetch more blocks into the window and the work queue until the window
+    /// is full or the fetch function runs out.
+    void fill_window();
+
+    /// Function run by each worker thread.
+    void worker_function();
+
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,510 @@
+#ifndef VG_IO_PARALLEL_PROTOBUF_ITERATOR_HPP_INCLUDED
+#define VG_IO_PARALLEL_PROTOBUF_ITERATOR_HPP_INCLUDED
+
+/**
+ * \file parallel_protobuf_iterator.hpp
+ * Defines a cursor for reading Protobuf messages from files in order, while
+ * parsing ahead on multiple threads.
+ */
+
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <istream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <omp.h>
+
+#include "message_iterator.hpp"
+#include "protobuf_iterator.hpp"
+#include "registry.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Iterator over the Protobuf messages of a type in a file, like
+ * ProtobufIterator, that produces messages in file order but parses them
+ * ahead of time, in batches, on a pool of worker threads. At most a bounded
+ * number of batches are read ahead of the consumer.
+ *
+ * Worker threads take turns reading batches of message data from the file,
+ * then parse them at the same time, and the batches are put back in order
+ * for the consumer. Errors are thrown to the consumer once it has seen all
+ * the batches before the one the error happened in.
+ *
+ * Cannot be copied or moved, since the worker threads point back at it.
+ */
+template <typename T>
+class ParallelProtobufIterator {
+public:
+
+    /// By default, read and parse this many messages at a time.
+    static const size_t DEFAULT_BATCH_SIZE = 256;
+
+    /// Make an iterator to read from the given stream, parsing on
+    /// thread_count threads (or as many as OpenMP would use if 0), and
+    /// reading up to max_batches_ahead batches of batch_size messages ahead
+    /// of the consumer (or 4 per thread if 0). Decompresses on
+    /// decompression_threads more threads, or by default on as many as
+    /// MessageIterator::decompression_threads_for() suggests.
+    ParallelProtobufIterator(istream& in, size_t thread_count = 0, size_t batch_size = DEFAULT_BATCH_SIZE,
+                             size_t max_batches_ahead = 0, size_t decompression_threads = 0);
+
+    /// Make an iterator to read from the given BlockedGzipInputStream, with
+    /// the same options. Decompression is left as the stream is set up.
+    ParallelProtobufIterator(unique_ptr<BlockedGzipInputStream>&& bgzf, size_t thread_count = 0,
+                             size_t batch_size = DEFAULT_BATCH_SIZE, size_t max_batches_ahead = 0);
+
+    /// Default constructor for an end iterator.
+    ParallelProtobufIterator() = default;
+
+    /// Stop the worker threads.
+    ~ParallelProtobufIterator();
+
+    // Prohibit copy and move
+    ParallelProtobufIterator(const ParallelProtobufIterator<T>& other) = delete;
+    ParallelProtobufIterator<T>& operator=(const ParallelProtobufIterator<T>& other) = delete;
+    ParallelProtobufIterator(ParallelProtobufIterator<T>&& other) = delete;
+    ParallelProtobufIterator<T>& operator=(ParallelProtobufIterator<T>&& other) = delete;
+
+    ///////////
+    // C++ Iterator Interface
+    ///////////
+
+    /// Get the current item. Caller may move it away.
+    /// Only legal to call if we are not an end iterator.
+    T& operator*();
+
+    /// Get the current item when we are const.
+    /// Only legal to call if we are not an end iterator.
+    const T& operator*() const;
+
+    /// In-place pre-increment to advance the iterator.
+    const ParallelProtobufIterator<T>& operator++();
+
+    /// Check if two iterators are equal. This only has two equality classes:
+    /// iterators that have hit the end, and iterators that haven't.
+    bool operator==(const ParallelProtobufIterator<T>& other) const;
+
+    /// Check if two iterators are not equal. This only has two equality
+    /// classes: iterators that have hit the end, and iterators that haven't.
+    bool operator!=(const ParallelProtobufIterator<T>& other) const;
+
+    ///////////
+    // has_current()/take() interface
+    ///////////
+
+    /// Return true if dereferencing the iterator will produce a valid value, and false otherwise.
+    bool has_current() const;
+
+    /// Advance the iterator to the next message, or the end if this was the last message.
+    /// Basically the same as ++.
+    void advance();
+
+    /// Take the current item, which must exist, and advance the iterator to the next one.
+    T take();
+
+    ///////////
+    // File position and seeking
+    ///////////
+
+    /// Return the virtual offset of the group the current message belongs to,
+    /// to seek back to. Returns -1 instead if the underlying file doesn't
+    /// support seek/tell. Returns the past-the-end virtual offset of the file
+    /// if EOF is reached.
+    int64_t tell_group() const;
+
+    /// Seek to the given virtual offset and start reading the group that is
+    /// there, throwing out everything parsed ahead. Return false if seeking
+    /// is unsupported or the seek fails, in which case iteration carries on
+    /// from where it was.
+    bool seek_group(int64_t virtual_offset);
+
+private:
+
+    /// A batch of messages, read in order and parsed by a worker.
+    struct Batch {
+        /// The parsed messages
+        vector<T> items;
+        /// The virtual offset of the group each message is in
+        vector<int64_t> group_vos;
+    };
+
+    /// The reader we share between the workers, which take turns with it.
+    unique_ptr<MessageIterator> message_it;
+
+    /// Protects message_it and the batch numbering.
+    mutex read_mutex;
+
+    /// The number of the next batch to read from message_it. Only changed
+    /// while holding both read_mutex and state_mutex, so either will do for
+    /// reading it.
+    size_t batches_started = 0;
+
+    /// The number of messages to read at a time
+    size_t batch_size = DEFAULT_BATCH_SIZE;
+
+    /// The number of batches we let be read but not consumed
+    size_t max_batches_ahead = 1;
+
+    /// The number of worker threads to run
+    size_t thread_count = 1;
+
+    /// Protects everything below here that is shared with the workers.
+    mutex state_mutex;
+
+    /// Wakes the consumer when a batch is ready.
+    condition_variable batch_ready;
+
+    /// Wakes the workers when the consumer takes a batch, or when they should
+    /// stop.
+    condition_variable space_ready;
+
+    /// Batches that have been parsed, by number, waiting for the consumer.
+    map<size_t, Batch> ready;
+
+    /// The number of the next batch the consumer needs.
+    size_t batches_consumed = 0;
+
+    /// The number of batches in the file, once we have reached the end, or
+    /// the number of the batch at which there was an error.
+    size_t batch_count = numeric_limits<size_t>::max();
+
+    /// The virtual offset past the end of the file, once known.
+    int64_t end_vo = -1;
+
+    /// The error that stopped reading, if any, to be thrown when the consumer
+    /// gets to batch_count.
+    exception_ptr error;
+
+    /// Set when the workers need to stop.
+    bool stopping = false;
+
+    /// The worker threads
+    vector<thread> workers;
+
+    /// The batch the consumer is working through, and its position in it.
+    Batch current;
+    size_t current_index = 0;
+
+    /// Set up the reader and start the workers, with the given options.
+    void start(size_t thread_count, size_t batch_size, size_t max_batches_ahead);
+
+    /// Start the worker threads, for the current read state.
+    void start_workers();
+
+    /// Stop the worker threads. Batches they were working on are finished
+    /// and kept.
+    void stop_workers();
+
+    /// Make sure current holds the next message, if there is one, waiting for
+    /// the workers if needed. Throws errors from the workers, in order.
+    void fill_current();
+
+    /// Function run by each worker thread.
+    void worker_function();
+
+    /// Read the next batch from the reader into the given batch, holding
+    /// the raw data in the given MessageBatch. Returns the batch number, or
+    /// the number of batches in the file if it is out of messages.
+    size_t read_batch(MessageBatch& raw, Batch& batch);
+};
+
+///////////
+// Template implementations
+///////////
+
+template<typename T>
+const size_t ParallelProtobufIterator<T>::DEFAULT_BATCH_SIZE;
+
+template<typename T>
+ParallelProtobufIterator<T>::ParallelProtobufIterator(istream& in, size_t thread_count, size_t batch_size,
+                                                      size_t max_batches_ahead, size_t decompression_threads) {
+    size_t threads = thread_count == 0 ? omp_get_max_threads() : thread_count;
+    if (decompression_threads == 0) {
+        decompression_threads = MessageIterator::decompression_threads_for(threads);
+    }
+    message_it.reset(new MessageIterator(in, false, decompression_threads));
+    start(threads, batch_size, max_batches_ahead);
+}
+
+template<typename T>
+ParallelProtobufIterator<T>::ParallelProtobufIterator(unique_ptr<BlockedGzipInputStream>&& bgzf, size_t thread_count,
+                                                      size_t batch_size, size_t max_batches_ahead) {
+    message_it.reset(new MessageIterator(std::move(bgzf)));
+    start(thread_count == 0 ? omp_get_max_threads() : thread_count, batch_size, max_batches_ahead);
+}
+
+template<typename T>
+ParallelProtobufIterator<T>::~ParallelProtobufIterator() {
+    stop_workers();
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::operator*() -> T& {
+    return current.items[current_index];
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::operator*() const -> const T& {
+    return current.items[current_index];
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::operator++() -> const ParallelProtobufIterator<T>& {
+    current_index++;
+    fill_current();
+    return *this;
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::operator==(const ParallelProtobufIterator<T>& other) const -> bool {
+    return has_current() == other.has_current();
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::operator!=(const ParallelProtobufIterator<T>& other) const -> bool {
+    return !(*this == other);
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::has_current() const -> bool {
+    return current_index < current.items.size();
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::advance() -> void {
+    ++(*this);
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::take() -> T {
+    auto temp = std::move(current.items[current_index]);
+    advance();
+    // Return by value, which gets moved.
+    return temp;
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::tell_group() const -> int64_t {
+    if (has_current()) {
+        return current.group_vos[current_index];
+    }
+    // Workers only leave the end offset once they are done with the reader.
+    return end_vo;
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::seek_group(int64_t virtual_offset) -> bool {
+    if (!message_it) {
+        // We are an end iterator
+        return false;
+    }
+
+    stop_workers();
+
+    if (!message_it->seek_group(virtual_offset)) {
+        // Carry on with what we have already read.
+        start_workers();
+        return false;
+    }
+
+    // Throw out everything we read ahead.
+    current = Batch();
+    current_index = 0;
+    ready.clear();
+    batches_started = 0;
+    batches_consumed = 0;
+    batch_count = numeric_limits<size_t>::max();
+    error = nullptr;
+    end_vo = -1;
+
+    start_workers();
+    fill_current();
+    return true;
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::start(size_t thread_count, size_t batch_size, size_t max_batches_ahead) -> void {
+    this->thread_count = max<size_t>(thread_count, 1);
+    this->batch_size = max<size_t>(batch_size, 1);
+    this->max_batches_ahead = max_batches_ahead == 0 ? 4 * this->thread_count : max_batches_ahead;
+
+    // Skip other kinds of groups without reading them.
+    message_it->set_tag_filter([](const string& tag) {
+        return Registry::check_protobuf_tag<T>(tag);
+    });
+
+    start_workers();
+    fill_current();
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::start_workers() -> void {
+    stopping = false;
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back(&ParallelProtobufIterator<T>::worker_function, this);
+    }
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::stop_workers() -> void {
+    {
+        lock_guard<mutex> lock(state_mutex);
+        stopping = true;
+    }
+    space_ready.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::fill_current() -> void {
+    if (current_index < current.items.size() || !message_it) {
+        return;
+    }
+
+    // Let go of the old batch's messages.
+    current = Batch();
+    current_index = 0;
+
+    unique_lock<mutex> lock(state_mutex);
+    batch_ready.wait(lock, [&]() {
+        return ready.count(batches_consumed) || batches_consumed >= batch_count;
+    });
+
+    auto found = ready.find(batches_consumed);
+    if (found == ready.end()) {
+        // We have reached the end, or an error.
+        if (error) {
+            // Make sure we only throw once
+            exception_ptr to_throw = error;
+            error = nullptr;
+            rethrow_exception(to_throw);
+        }
+        return;
+    }
+
+    current = std::move(found->second);
+    ready.erase(found);
+    batches_consumed++;
+    lock.unlock();
+    space_ready.notify_all();
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::worker_function() -> void {
+    // Keep our raw data buffer between batches.
+    MessageBatch raw;
+
+    while (true) {
+        {
+            // Wait until we can read ahead.
+            unique_lock<mutex> lock(state_mutex);
+            space_ready.wait(lock, [&]() {
+                return stopping || batches_started < batches_consumed + max_batches_ahead ||
+                    batches_started >= batch_count;
+            });
+            if (stopping || batches_started >= batch_count) {
+                return;
+            }
+        }
+
+        Batch batch;
+        size_t number;
+        try {
+            number = read_batch(raw, batch);
+        } catch (...) {
+            // Reading broke, so nobody can read any more.
+            lock_guard<mutex> lock(state_mutex);
+            batch_count = min(batch_count, batches_started);
+            error = current_exception();
+            batch_ready.notify_all();
+            space_ready.notify_all();
+            return;
+        }
+
+        if (batch.group_vos.empty()) {
+            // We are at the end of the file.
+            batch_ready.notify_all();
+            space_ready.notify_all();
+            return;
+        }
+
+        try {
+            batch.items.resize(raw.size());
+            for (size_t i = 0; i < raw.size(); i++) {
+                if (!ProtobufIterator<T>::parse_from_data(batch.items[i], raw.data(i), raw.message_size(i))) {
+                    throw runtime_error("[io::ParallelProtobufIterator] could not parse message");
+                }
+            }
+        } catch (...) {
+            // The consumer gets everything before this batch, then the error.
+            lock_guard<mutex> lock(state_mutex);
+            if (number < batch_count) {
+                batch_count = number;
+                error = current_exception();
+            }
+            batch_ready.notify_all();
+            space_ready.notify_all();
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if (number < batch_count) {
+                ready.emplace(number, std::move(batch));
+            }
+        }
+        batch_ready.notify_all();
+    }
+}
+
+template<typename T>
+auto ParallelProtobufIterator<T>::read_batch(MessageBatch& raw, Batch& batch) -> size_t {
+    raw.clear();
+    lock_guard<mutex> read_lock(read_mutex);
+
+    while (raw.size() < batch_size && message_it->has_current()) {
+        if (!Registry::check_protobuf_tag<T>(message_it->tag())) {
+            // This group isn't for us, and we may have landed in it before
+            // the filter could skip it.
+            message_it->skip_group();
+            continue;
+        }
+        auto message = message_it->view();
+        if (message.data != nullptr) {
+            raw.push_back(message.data, message.size);
+            batch.group_vos.push_back(message_it->tell_group());
+        }
+        message_it->advance();
+    }
+
+    lock_guard<mutex> state_lock(state_mutex);
+    size_t number = batches_started;
+    if (raw.empty()) {
+        // Nothing more to read, so this is how many batches there are.
+        batch_count = min(batch_count, number);
+        end_vo = message_it->tell_group();
+    } else {
+        batches_started++;
+    }
+    return number;
+}
+
+}
+
+}
+
+#endif
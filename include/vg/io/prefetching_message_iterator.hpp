@@ -0,0 +1,192 @@
+#ifndef VG_IO_PREFETCHING_MESSAGE_ITERATOR_HPP_INCLUDED
+#define VG_IO_PREFETCHING_MESSAGE_ITERATOR_HPP_INCLUDED
+
+/**
+ * \file prefetching_message_iterator.hpp
+ * Defines a cursor for reading type-tagged, grouped binary messages from files
+ * that reads ahead of the consumer on a background thread.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "message_iterator.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Iterator over messages in VG-format files, like MessageIterator, but which
+ * decompresses and frames messages ahead of the consumer on a background
+ * thread, so reading overlaps with whatever the consumer does with the
+ * messages. The amount of message data read ahead is bounded.
+ *
+ * Cannot be copied or moved, because the background thread points to it. Not
+ * thread-safe to call into.
+ */
+class PrefetchingMessageIterator {
+public:
+
+    /// Default limit on how much message data to read ahead.
+    const static size_t DEFAULT_PREFETCH_BYTES = 64 * 1024 * 1024;
+    
+    /// An executor runs the function it is given, eventually, on some thread
+    /// other than the caller's. The function may run for as long as the
+    /// iterator is reading ahead.
+    using Executor = function<void(const function<void()>&)>;
+
+    /// Constructor to wrap a stream. Reads up to about max_prefetch_bytes of
+    /// message data ahead. If thread_count is more than 1, decompression is
+    /// also done on that many threads.
+    PrefetchingMessageIterator(istream& in, size_t max_prefetch_bytes = DEFAULT_PREFETCH_BYTES,
+                               size_t thread_count = 0);
+
+    /// Constructor to wrap an existing BGZF.
+    PrefetchingMessageIterator(unique_ptr<BlockedGzipInputStream>&& bgzf,
+                               size_t max_prefetch_bytes = DEFAULT_PREFETCH_BYTES);
+    
+    /// Constructor to wrap an existing BGZF, reading ahead in a task run by
+    /// the given executor instead of on a dedicated thread.
+    PrefetchingMessageIterator(unique_ptr<BlockedGzipInputStream>&& bgzf, const Executor& executor,
+                               size_t max_prefetch_bytes = DEFAULT_PREFETCH_BYTES);
+
+    /// Stop reading ahead and destroy the iterator.
+    ~PrefetchingMessageIterator();
+
+    // Can't be copied or moved, because the thread points to us.
+    PrefetchingMessageIterator(const PrefetchingMessageIterator& other) = delete;
+    PrefetchingMessageIterator& operator=(const PrefetchingMessageIterator& other) = delete;
+    PrefetchingMessageIterator(PrefetchingMessageIterator&& other) = delete;
+    PrefetchingMessageIterator& operator=(PrefetchingMessageIterator&& other) = delete;
+
+    using TaggedMessage = MessageIterator::TaggedMessage;
+
+    /// Return true if dereferencing the iterator will produce a valid value,
+    /// and false otherwise. May wait for the background thread. Rethrows any
+    /// exception that reading ran into.
+    bool has_current();
+
+    /// Get the current item. Caller may move it away.
+    /// Only legal to call if has_current() is true.
+    TaggedMessage& operator*();
+
+    /// Advance the iterator to the next message, or the end if this was the
+    /// last message.
+    void advance();
+
+    /// Take the current item, which must exist, and advance the iterator to
+    /// the next one.
+    TaggedMessage take();
+
+    /// Return the virtual offset of the group being currently read, to seek
+    /// back to, as for MessageIterator::tell_group(). Returns -1 if the
+    /// underlying file doesn't support seek/tell, and the past-the-end
+    /// virtual offset of the file if EOF is reached.
+    int64_t tell_group();
+
+    /// Seek to the given virtual offset and start reading the group that is
+    /// there, throwing out everything read ahead. Return false if seeking is
+    /// unsupported or the seek fails.
+    bool seek_group(int64_t virtual_offset);
+
+    /// Only produce items from groups whose tags pass the given filter, as
+    /// for MessageIterator::set_tag_filter(). Groups already read ahead are
+    /// not affected.
+    void set_tag_filter(const function<bool(const string&)>& filter);
+
+private:
+
+    /// Represents a message that has been read ahead.
+    struct Prefetched {
+        /// The message, as the MessageIterator would give it to us
+        TaggedMessage message;
+        /// The virtual offset of the message's group
+        int64_t group_vo;
+    };
+
+    /// The iterator that does the actual reading. Only touched by the
+    /// background thread while it runs.
+    MessageIterator source;
+
+    /// The most message data to hold
+    size_t max_prefetch_bytes;
+
+    /// Messages handed over by the background thread and not yet picked up
+    /// by the consumer, in chunks.
+    deque<vector<Prefetched>> queue;
+
+    /// Bytes of message data in the queue
+    size_t queued_bytes;
+
+    /// Set when the background thread has reached the end or failed
+    bool finished;
+
+    /// Set when the background thread should stop
+    bool stopping;
+    
+    /// Set while the background thread is reading ahead
+    bool running;
+
+    /// Holds an exception the background thread hit, to be rethrown
+    exception_ptr error;
+
+    /// Where the end of the file is, once the background thread gets there.
+    int64_t end_vo;
+
+    /// Protects queue, queued_bytes, finished, stopping, running, error, and
+    /// end_vo
+    mutex queue_mutex;
+
+    /// Notified when the background thread hands over messages, finishes, or
+    /// stops running
+    condition_variable data_ready;
+
+    /// Notified when the consumer takes messages
+    condition_variable space_ready;
+
+    /// The executor to read ahead on, if any
+    Executor executor;
+
+    /// The background thread, if running and not using an executor
+    thread worker;
+
+    /// Messages the consumer has picked up, in order. The current item is at
+    /// the front.
+    deque<Prefetched> local;
+
+    /// Set when the consumer knows there are no more messages.
+    bool exhausted;
+
+    /// Start the background thread reading from where the source is. Does
+    /// not clear out the end or error state of the last run.
+    void start_worker();
+
+    /// Stop the background thread, leaving the source where it got to.
+    void stop_worker();
+
+    /// Make sure local has a current item, if there is one. Returns false at
+    /// the end.
+    bool fill_local();
+
+    /// Function run by the background thread. Reads ahead and then marks
+    /// the thread as no longer running.
+    void run_worker();
+
+    /// Read ahead until the end, an error, or we are asked to stop.
+    void worker_function();
+};
+
+}
+
+}
+
+#endif
@@ -51,10 +51,12 @@ template <typename T>
 class ProtobufEmitter {
 public:
     /// Constructor. Writes type-tagged Protobuf data to the given output
-    /// stream. If compress is true, data will be BGZF-compressed. The maximum
-    /// number of Protobuf messages in a tagged group is controlled by
-    /// max_group_size.
-    ProtobufEmitter(std::ostream& out, bool compress = true, size_t max_group_size = 1000);
+    /// stream. If compress is true, data will be BGZF-compressed at the given
+    /// compression level (0-9, or -1 for the default). The maximum number of
+    /// Protobuf messages in a tagged group is controlled by max_group_size,
+    /// and the maximum serialized size of their data by max_group_bytes.
+    ProtobufEmitter(std::ostream& out, bool compress = true, size_t max_group_size = 1000, int compression_level = -1,
+                    size_t max_group_bytes = MessageEmitter::DEFAULT_MAX_GROUP_BYTES);
     
     /// Destructor that finishes the file
     ~ProtobufEmitter();
@@ -79,6 +81,14 @@ public:
     /// To use when you have something you can't move.
     void write_copy(const T& item);
     
+    /// Compress BGZF output on the given number of threads. Returns false if
+    /// we are not compressing, or the threads could not be started.
+    bool enable_multithreading(size_t thread_count);
+    
+    /// Start every group at the start of a BGZF block. See
+    /// MessageEmitter::enable_block_aligned_groups().
+    bool enable_block_aligned_groups();
+    
     /// Define a type for group emission event listeners.
     /// The arguments are the start virtual offset and the past-end virtual offset.
     using group_listener_t = std::function<void(int64_t, int64_t)>;
@@ -96,6 +106,10 @@ public:
     /// Add an event listener that will be called every time a message is emitted.
     void on_message(message_listener_t&& listener);
     
+    /// Write a GroupIndex of the groups emitted to the given stream when the
+    /// file is finished. See MessageEmitter::write_group_index().
+    void write_group_index(ostream& index_out);
+    
     /// Actually write out everything in the buffer.
     /// Doesn't actually flush the underlying streams to disk.
     /// Assumes that no more than one group's worth of items are in the buffer.
@@ -103,8 +117,14 @@ public:
     
     /// Write out anything in the buffer, and flush the backing BGZF and the
     /// backing stream. After this function is called, a complete BGZF block
-    /// has been output (unless another thead has written something).
-    void flush();
+    /// has been output (unless another thead has written something). In
+    /// write-behind mode, the block may still be queued for the I/O thread
+    /// unless barrier is set.
+    void flush(bool barrier = false);
+    
+    /// Write compressed data to the backing stream from a dedicated I/O
+    /// thread. See MessageEmitter::enable_write_behind().
+    bool enable_write_behind(size_t max_queued_bytes = BlockedGzipOutputStream::DEFAULT_WRITE_BEHIND_BYTES);
     
 private:
 
@@ -125,6 +145,11 @@ private:
     /// These we invoke ourselves per message.
     vector<message_listener_t> message_handlers;
     
+    /// Serialize the given item, which must have just had its size computed
+    /// as the given size with ByteSizeLong(), framed with its length, onto
+    /// the end of the given buffer. Doesn't need out_mutex.
+    void serialize_framed(const T& item, size_t size, string& framed);
+    
     /// Make sure the given Protobuf-library bool return value is true, and fail otherwise with a message.
     void handle(bool ok);
 
@@ -141,7 +166,9 @@ std::function<void(const Item&)> emit_to(ostream& out);
 /////////
 
 template<typename T>
-ProtobufEmitter<T>::ProtobufEmitter(std::ostream& out, bool compress, size_t max_group_size) : message_emitter(out, compress, max_group_size),
+ProtobufEmitter<T>::ProtobufEmitter(std::ostream& out, bool compress, size_t max_group_size, int compression_level,
+                                    size_t max_group_bytes) :
+    message_emitter(out, compress, max_group_size, compression_level, max_group_bytes),
     tag(Registry::get_protobuf_tag<T>()) {
     // Make sure to write at least the tag to the file, to represent 0
     // instances of our type. When trying to load a list of our type from a
@@ -171,20 +198,7 @@ auto ProtobufEmitter<T>::write(T&& item) -> void {
     // Grab the item
     T to_encode = std::move(item);
     
-    // Encode it to a string
-    string encoded;
-    handle(to_encode.SerializeToString(&encoded));
-    
-    // Lock the backing emitter
-    lock_guard<mutex> lock(out_mutex);
-    
-    // Write it with the correct tag.
-    message_emitter.write(tag, std::move(encoded));
-    
-    for (auto& handler : message_handlers) {
-        // Fire the handlers in serial
-        handler(to_encode);
-    }
+    write_copy(to_encode);
 }
 
 template<typename T>
@@ -192,22 +206,22 @@ auto ProtobufEmitter<T>::write_many(vector<T>&& ordered_items) -> void {
     // Grab the items
     vector<T> to_encode = std::move(ordered_items);
     
-    // Encode them all to strings
-    vector<string> encoded(to_encode.size());
-    for (size_t i = 0; i < to_encode.size(); i++) {
-        handle(to_encode[i].SerializeToString(&encoded[i]));
+    // Serialize them all before locking
+    string framed;
+    for (auto& item : to_encode) {
+        serialize_framed(item, item.ByteSizeLong(), framed);
     }
     
     // Lock the backing emitter
     lock_guard<mutex> lock(out_mutex);
     
-    for (size_t i = 0; i < to_encode.size(); i++) {
-        // Write each message with the correct tag.
-        message_emitter.write(tag, std::move(encoded[i]));
-        
+    // Hand them all over with the correct tag.
+    message_emitter.write_framed(tag, framed);
+    
+    for (auto& item : to_encode) {
         for (auto& handler : message_handlers) {
             // Fire the handlers in serial
-            handler(to_encode[i]);
+            handler(item);
         }
     }
     
@@ -215,26 +229,53 @@ auto ProtobufEmitter<T>::write_many(vector<T>&& ordered_items) -> void {
 
 template<typename T>
 auto ProtobufEmitter<T>::write_copy(const T& item) -> void {
-    // Encode it to a string
-    string encoded;
-    handle(item.SerializeToString(&encoded));
+    // Size the item
+    size_t size = item.ByteSizeLong();
     
 #ifdef debug
-    cerr << "Write Protobuf to " << encoded.size() << " bytes" << endl;
+    cerr << "Write Protobuf to " << size << " bytes" << endl;
 #endif
 
-    // Lock the backing emitter
-    lock_guard<mutex> lock(out_mutex);
-    
-    // Write it with the correct tag.
-    message_emitter.write(tag, std::move(encoded));
+    // Serialize before locking, into a buffer each thread keeps around.
+    thread_local string framed;
+    framed.clear();
+    serialize_framed(item, size, framed);
+
+    {
+        // Lock the backing emitter
+        lock_guard<mutex> lock(out_mutex);
+        
+        // Hand it over with the correct tag.
+        message_emitter.write_framed(tag, framed);
+        
+        for (auto& handler : message_handlers) {
+            // Fire the handlers in serial
+            handler(item);
+        }
+    }
     
-    for (auto& handler : message_handlers) {
-        // Fire the handlers in serial
-        handler(item);
+    if (framed.capacity() > MessageEmitter::DEFAULT_MAX_GROUP_BYTES) {
+        // Don't hang on to the memory for a huge message.
+        string().swap(framed);
     }
 }
 
+template<typename T>
+auto ProtobufEmitter<T>::enable_multithreading(size_t thread_count) -> bool {
+    // Lock the backing emitter
+    lock_guard<mutex> lock(out_mutex);
+
+    return message_emitter.enable_multithreading(thread_count);
+}
+
+template<typename T>
+auto ProtobufEmitter<T>::enable_block_aligned_groups() -> bool {
+    // Lock the backing emitter
+    lock_guard<mutex> lock(out_mutex);
+
+    return message_emitter.enable_block_aligned_groups();
+}
+
 template<typename T>
 auto ProtobufEmitter<T>::on_group(group_listener_t&& listener) -> void {
     // Lock the handler list
@@ -263,6 +304,14 @@ auto ProtobufEmitter<T>::on_message(message_listener_t&& listener) -> void {
     message_handlers.emplace_back(std::move(listener));
 }
 
+template<typename T>
+auto ProtobufEmitter<T>::write_group_index(ostream& index_out) -> void {
+    // Lock the backing emitter
+    lock_guard<mutex> lock(out_mutex);
+    
+    message_emitter.write_group_index(index_out);
+}
+
 template<typename T>
 auto ProtobufEmitter<T>::emit_group() -> void {
     // Lock the backing emitter
@@ -272,13 +321,33 @@ auto ProtobufEmitter<T>::emit_group() -> void {
 }
 
 template<typename T>
-auto ProtobufEmitter<T>::flush() -> void {
+auto ProtobufEmitter<T>::flush(bool barrier) -> void {
     // Make sure to emit the group.
     emit_group();
     
     // Lock and flush the message emitter.
     lock_guard<mutex> lock(out_mutex);
-    message_emitter.flush();
+    message_emitter.flush(barrier);
+}
+
+template<typename T>
+auto ProtobufEmitter<T>::enable_write_behind(size_t max_queued_bytes) -> bool {
+    // Lock the backing emitter
+    lock_guard<mutex> lock(out_mutex);
+
+    return message_emitter.enable_write_behind(max_queued_bytes);
+}
+
+template<typename T>
+auto ProtobufEmitter<T>::serialize_framed(const T& item, size_t size, string& framed) -> void {
+    if (size > MessageEmitter::MAX_MESSAGE_SIZE) {
+        // Protobuf can't serialize this; don't let it try.
+        handle(false);
+    }
+    uint8_t* dest = MessageEmitter::frame_message(framed, size);
+    uint8_t* past_end = item.SerializeWithCachedSizesToArray(dest);
+    // Make sure the item didn't change size since we measured it.
+    handle(past_end == dest + size);
 }
 
 template<typename T>
@@ -15,6 +15,7 @@
 #include <functional>
 #include <vector>
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/message.h>
@@ -113,6 +114,23 @@ public:
      * Returns the result of the parse attempt (i.e. whether it succeeded).
      */
     static bool parse_from_string(T& dest, const string& data);
+    
+    /**
+     * Parse a Protobuf message that may be very large from a buffer of the
+     * given size.
+     *
+     * Returns the result of the parse attempt (i.e. whether it succeeded).
+     */
+    static bool parse_from_data(T& dest, const char* data, size_t size);
+    
+    /**
+     * Parse a Protobuf message that may be very large from a buffer of the
+     * given size, into a new message allocated on the given arena. The
+     * message goes away when the arena is reset or destroyed.
+     *
+     * Returns the parsed message, or nullptr if the parse failed.
+     */
+    static T* parse_from_data(google::protobuf::Arena& arena, const char* data, size_t size);
         
 private:
     
@@ -212,21 +230,19 @@ auto ProtobufIterator<T>::fill_value() -> void {
 #endif
     
     while (message_it.has_current()) {
-        // Grab the tag and message
-        auto& tag_and_message = *message_it;
-        auto& tag = tag_and_message.first;
-        auto& message = tag_and_message.second;
-        
-        // See if the tag is valid for what we want to parse.
-        // TODO: Do this in a way where we can check this only per-group!
-        if (!Registry::check_protobuf_tag<T>(tag)) {
+        // See if the tag is valid for what we want to parse. This doesn't
+        // need the message to be read.
+        if (!Registry::check_protobuf_tag<T>(message_it.tag())) {
             // The registry doesn't think this tag is legit for what we are parsing.
-            // Skip over it.
-            message_it.advance();
+            // Skip over the whole group.
+            message_it.skip_group();
             continue;
         }
         
-        if (message.get() == nullptr) {
+        // Look at the message where it sits
+        auto message = message_it.view();
+        
+        if (message.data == nullptr) {
             // This is a tag-only group. Skip over it.
             message_it.advance();
             continue;
@@ -235,12 +251,12 @@ auto ProtobufIterator<T>::fill_value() -> void {
         // Parse the value.
         
         // Now actually parse the message
-        if (!parse_from_string(value, *message)) {
+        if (!parse_from_data(value, message.data, message.size)) {
             throw runtime_error("[io::ProtobufIterator] could not parse message");
         }
         
 #ifdef debug   
-        cerr << "Got message from " << message->size() << " bytes" << endl;
+        cerr << "Got message from " << message.size << " bytes" << endl;
 #endif
 
         // Now the value is parsed. Don't clear it out.
@@ -253,6 +269,11 @@ auto ProtobufIterator<T>::fill_value() -> void {
 
 template<typename T>
 auto ProtobufIterator<T>::parse_from_string(T& dest, const string& data) -> bool {
+    return parse_from_data(dest, data.c_str(), data.size());
+}
+
+template<typename T>
+auto ProtobufIterator<T>::parse_from_data(T& dest, const char* data, size_t size) -> bool {
     static_assert(is_base_of<google::protobuf::Message, T>::value, "Can only parse Protobuf messages");
     
     // We can't use ParseFromString because we need to be able to read
@@ -262,8 +283,8 @@ auto ProtobufIterator<T>::parse_from_string(T& dest, const string& data) -> bool
     // CodedInputStream to tinker with it. See
     // <https://stackoverflow.com/a/35172491>
    
-    // Make an ArrayInputStream over the string data
-    google::protobuf::io::ArrayInputStream array_stream(data.c_str(), data.size());
+    // Make an ArrayInputStream over the data
+    google::protobuf::io::ArrayInputStream array_stream(data, size);
     
     // Make a CodedInputStream to decode form it
     google::protobuf::io::CodedInputStream coded_stream(&array_stream);
@@ -275,6 +296,13 @@ auto ProtobufIterator<T>::parse_from_string(T& dest, const string& data) -> bool
     return dest.ParseFromCodedStream(&coded_stream);
 }
 
+template<typename T>
+auto ProtobufIterator<T>::parse_from_data(google::protobuf::Arena& arena, const char* data, size_t size) -> T* {
+    // All the message's parts get allocated in the arena too.
+    T* dest = google::protobuf::Arena::CreateMessage<T>(&arena);
+    return parse_from_data(*dest, data, size) ? dest : nullptr;
+}
+
 
 }
 
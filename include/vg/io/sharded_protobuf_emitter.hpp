@@ -0,0 +1,616 @@
+#ifndef VG_IO_SHARDED_PROTOBUF_EMITTER_HPP_INCLUDED
+#define VG_IO_SHARDED_PROTOBUF_EMITTER_HPP_INCLUDED
+
+/**
+ * \file sharded_protobuf_emitter.hpp
+ * Defines an output cursor for writing Protobuf data to files from many
+ * threads at once.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "message_emitter.hpp"
+#include "registry.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/**
+ * Class that wraps an output stream and allows emitting Protobuf objects to
+ * it from many OpenMP threads, without the writing threads contending on a
+ * lock. Each thread serializes its objects into its own group buffer. Full
+ * groups are passed through a lock-free queue to a single writer thread,
+ * which owns the underlying MessageEmitter and does all the compression and
+ * I/O.
+ *
+ * Objects written by one thread appear in the file in the order written, but
+ * objects from different threads may be interleaved in any order, a group at
+ * a time. Objects passed to one write_many() call are never split up by
+ * objects from other threads.
+ *
+ * Group listeners are called on the writer thread, with correct virtual
+ * offsets. Message listeners are called on the writing threads, outside of
+ * any lock, and so must be thread-safe themselves.
+ *
+ * Each thread gets its own group buffer the first time it writes, whether it
+ * is an OpenMP thread or not, and no more than the max_threads passed to the
+ * constructor may write. Thread-safe to write to, but setup functions must be
+ * called before anything is written, and the destructor must not run while
+ * anyone is writing.
+ *
+ * Cannot be copied or moved.
+ */
+template <typename T>
+class ShardedProtobufEmitter {
+public:
+
+    /// By default, let the writing threads get this far ahead of the writer
+    /// thread before they have to wait.
+    static const size_t DEFAULT_MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+    /// Constructor. Writes type-tagged Protobuf data to the given output
+    /// stream, from up to max_threads threads. Other arguments are as for
+    /// ProtobufEmitter, and apply to each thread's groups. Up to
+    /// max_queued_bytes of message data can be waiting for the writer thread.
+    ShardedProtobufEmitter(std::ostream& out, size_t max_threads, bool compress = true, size_t max_group_size = 1000,
+                           int compression_level = -1, size_t max_group_bytes = MessageEmitter::DEFAULT_MAX_GROUP_BYTES,
+                           size_t max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES);
+
+    /// Destructor that writes out everything from all threads and finishes
+    /// the file.
+    ~ShardedProtobufEmitter();
+
+    // Prohibit copy and move, since the writer thread points back at us.
+    ShardedProtobufEmitter(const ShardedProtobufEmitter& other) = delete;
+    ShardedProtobufEmitter& operator=(const ShardedProtobufEmitter& other) = delete;
+    ShardedProtobufEmitter(ShardedProtobufEmitter&& other) = delete;
+    ShardedProtobufEmitter& operator=(ShardedProtobufEmitter&& other) = delete;
+
+    /// Emit the given item.
+    void write(T&& item);
+
+    /// Emit the given collection of items in order, with no items from other
+    /// threads between them.
+    void write_many(vector<T>&& ordered_items);
+
+    /// Emit a copy of the given item.
+    void write_copy(const T& item);
+
+    /// Compress BGZF output on the given number of threads, in addition to
+    /// the writer thread. Returns false if we are not compressing, or the
+    /// threads could not be started. Must be called before anything is
+    /// written.
+    bool enable_multithreading(size_t thread_count);
+
+    /// Define a type for group emission event listeners.
+    /// The arguments are the start virtual offset and the past-end virtual offset.
+    using group_listener_t = std::function<void(int64_t, int64_t)>;
+
+    /// Add an event listener that listens for emitted groups. The listener
+    /// will be called on the writer thread with the start virtual offset, and
+    /// the past-end virtual offset. Must be called before anything is written.
+    /// Anything the function uses by reference must outlive this object!
+    void on_group(group_listener_t&& listener);
+
+    /// Define a type for message emission event listeners.
+    using message_listener_t = std::function<void(const T&)>;
+
+    /// Add an event listener that will be called, on the thread that wrote it,
+    /// every time a message is emitted. Must be called before anything is
+    /// written.
+    void on_message(message_listener_t&& listener);
+
+    /// Write a GroupIndex of the groups emitted to the given stream when the
+    /// file is finished. See MessageEmitter::write_group_index(). Must be
+    /// called before anything is written.
+    void write_group_index(ostream& index_out);
+
+    /// Send out everything the calling thread has written, and wait for the
+    /// writer thread to write it and flush the backing BGZF and the backing
+    /// stream, as in MessageEmitter::flush(). Rethrows any error the writer
+    /// thread has run into.
+    void flush(bool barrier = false);
+
+private:
+
+    /// What the writer thread needs to do for a queue entry.
+    enum class Action {
+        EMIT,
+        FLUSH,
+        STOP
+    };
+
+    /// Entry in the queue to the writer thread.
+    struct Pending {
+        Action action = Action::EMIT;
+        /// Framed messages for the group to emit
+        string framed_messages;
+        /// Number of messages in the group
+        size_t message_count = 0;
+        /// Total size of the messages, not counting their lengths
+        size_t message_bytes = 0;
+        /// For flushes, whether to make a barrier
+        bool barrier = false;
+        /// For flushes, where to report back to when done
+        promise<void>* done = nullptr;
+        /// Next entry in the queue
+        atomic<Pending*> next;
+
+        Pending() : next(nullptr) {}
+    };
+
+    /// Group being filled by one thread.
+    struct Shard {
+        /// Framed messages, as MessageEmitter::frame_message() makes them
+        string framed_messages;
+        /// Number of messages in the group
+        size_t message_count = 0;
+        /// Total size of the messages, not counting their lengths
+        size_t message_bytes = 0;
+    };
+
+    /// The wrapped MessageEmitter, only used by the writer thread once it is
+    /// running.
+    MessageEmitter message_emitter;
+
+    /// The tag string to use
+    string tag;
+
+    /// The limit on messages per group
+    size_t max_group_size;
+
+    /// The limit on message bytes per group
+    size_t max_group_bytes;
+
+    /// The limit on message bytes waiting for the writer thread
+    size_t max_queued_bytes;
+
+    /// The group being filled by each thread
+    vector<Shard> shards;
+
+    /// Number that identifies this emitter to the threads that write to it,
+    /// so they can remember their shards.
+    uint64_t instance_id;
+
+    /// The shard that has been given to each thread that has written
+    unordered_map<thread::id, size_t> shard_owners;
+
+    /// Protects shard_owners
+    mutex shard_owners_mutex;
+
+    /// The group handler functions, which need to never move, since they are
+    /// captured by reference to listeners in our MessageEmitter.
+    list<group_listener_t> group_handlers;
+
+    /// The message handler functions, which we invoke ourselves.
+    vector<message_listener_t> message_handlers;
+
+    /// The most recently added queue entry, which writing threads swap new
+    /// entries in for. The queue is a linked list from queue_tail to here.
+    atomic<Pending*> queue_head;
+
+    /// The entry the writer thread has most recently taken from the queue,
+    /// which stays in the list to keep it from ever being empty.
+    Pending* queue_tail;
+
+    /// The number of message bytes waiting for the writer thread
+    atomic<size_t> queued_bytes;
+
+    /// Threads hold this when checking whether to sleep, and when waking
+    /// others, so that wakeups can't be missed.
+    mutex wait_mutex;
+
+    /// Notified when something is added to the queue
+    condition_variable writer_wake;
+
+    /// Notified when the writer thread gets the queued bytes down to
+    /// max_queued_bytes, or runs into an error.
+    condition_variable writer_caught_up;
+
+    /// Set when the writer thread has run into an error.
+    atomic<bool> writer_failed;
+
+    /// The error the writer thread has run into, readable once writer_failed
+    /// is set.
+    exception_ptr writer_error;
+
+    /// The thread that writes everything out
+    thread writer_thread;
+
+    /// Get the group being filled by the calling thread, giving the thread
+    /// one if it doesn't have one yet.
+    Shard& get_shard();
+
+    /// Serialize the given item into the given thread's group, handing the
+    /// group off first if it is full. If chain is not null, hand off groups
+    /// by adding them to the list between its entries instead of sending them.
+    void add_to_shard(Shard& shard, const T& item, pair<Pending*, Pending*>* chain = nullptr);
+
+    /// Take the given group and send it to the writer thread, or add it to the
+    /// given list if not null. Does nothing if the group is empty.
+    void hand_off(Shard& shard, pair<Pending*, Pending*>* chain = nullptr);
+
+    /// Add the list of entries from first to last to the queue for the writer
+    /// thread, without locking.
+    void enqueue(Pending* first, Pending* last);
+
+    /// Wait until the writer thread isn't too far behind, and throw its
+    /// error, if it has run into one.
+    void wait_for_writer();
+
+    /// Take the next entry from the queue, or return nullptr if nothing is
+    /// ready. The returned entry is still owned by the queue. Only the writer
+    /// thread may call this.
+    Pending* dequeue();
+
+    /// Throw the writer thread's error, if it has run into one.
+    void check_writer();
+
+    /// Record the exception being handled as the writer thread's error, and
+    /// wake anyone waiting on the writer thread. Only the writer thread may
+    /// call this.
+    void fail_writer();
+
+    /// Function run as the writer thread. Takes groups from the queue and
+    /// emits them until told to stop.
+    void writer_thread_function();
+
+    /// Make sure the given Protobuf-library bool return value is true, and fail otherwise with a message.
+    void handle(bool ok);
+
+};
+
+/////////
+// Template implementations
+/////////
+
+template<typename T>
+const size_t ShardedProtobufEmitter<T>::DEFAULT_MAX_QUEUED_BYTES;
+
+template<typename T>
+ShardedProtobufEmitter<T>::ShardedProtobufEmitter(std::ostream& out, size_t max_threads, bool compress, size_t max_group_size,
+                                                  int compression_level, size_t max_group_bytes, size_t max_queued_bytes) :
+    message_emitter(out, compress, max_group_size, compression_level, max_group_bytes),
+    tag(Registry::get_protobuf_tag<T>()),
+    max_group_size(max_group_size),
+    max_group_bytes(max_group_bytes),
+    max_queued_bytes(max_queued_bytes),
+    shards(max_threads),
+    queue_head(new Pending()),
+    queued_bytes(0),
+    writer_failed(false) {
+
+    queue_tail = queue_head.load();
+
+    static atomic<uint64_t> next_instance_id(1);
+    instance_id = next_instance_id.fetch_add(1);
+
+    // Make sure to write at least the tag to the file, to represent 0
+    // instances of our type.
+    message_emitter.write(tag);
+
+    writer_thread = thread(&ShardedProtobufEmitter<T>::writer_thread_function, this);
+}
+
+template<typename T>
+ShardedProtobufEmitter<T>::~ShardedProtobufEmitter() {
+#ifdef debug
+    cerr << "Destroying ShardedProtobufEmitter" << endl;
+#endif
+
+    if (!writer_failed.load()) {
+        // Send along what every thread has left. Nobody is writing anymore.
+        for (auto& shard : shards) {
+            hand_off(shard);
+        }
+    }
+
+    // Tell the writer thread to stop after everything else.
+    Pending* stop = new Pending();
+    stop->action = Action::STOP;
+    enqueue(stop, stop);
+    writer_thread.join();
+
+    // Clean up the last entry, which the writer thread was holding on to.
+    delete queue_tail;
+
+    // Our MessageEmitter then finishes the file when it is destroyed.
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::write(T&& item) -> void {
+    // We serialize straight from the item, so we don't need to move it.
+    write_copy(item);
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::write_many(vector<T>&& ordered_items) -> void {
+    vector<T> to_encode = std::move(ordered_items);
+    Shard& shard = get_shard();
+
+    // Collect all the groups so we can send them at once, so nothing can get
+    // between them.
+    pair<Pending*, Pending*> chain(nullptr, nullptr);
+    for (auto& item : to_encode) {
+        add_to_shard(shard, item, &chain);
+    }
+    hand_off(shard, &chain);
+    if (chain.first != nullptr) {
+        enqueue(chain.first, chain.second);
+        wait_for_writer();
+    }
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::write_copy(const T& item) -> void {
+    add_to_shard(get_shard(), item);
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::enable_multithreading(size_t thread_count) -> bool {
+    return message_emitter.enable_multithreading(thread_count);
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::on_group(group_listener_t&& listener) -> void {
+    // Take custody
+    group_handlers.emplace_back(std::move(listener));
+    auto& owned_listener = group_handlers.back();
+    message_emitter.on_group([&owned_listener](const string& tag, int64_t start_vo, int64_t past_end_vo) {
+        owned_listener(start_vo, past_end_vo);
+    });
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::on_message(message_listener_t&& listener) -> void {
+    message_handlers.emplace_back(std::move(listener));
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::write_group_index(ostream& index_out) -> void {
+    message_emitter.write_group_index(index_out);
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::flush(bool barrier) -> void {
+    hand_off(get_shard());
+
+    promise<void> done;
+    future<void> flushed = done.get_future();
+
+    Pending* request = new Pending();
+    request->action = Action::FLUSH;
+    request->barrier = barrier;
+    request->done = &done;
+    enqueue(request, request);
+
+    // Wait for the writer thread to get to it, and throw if it had problems.
+    flushed.get();
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::get_shard() -> Shard& {
+    // Each thread remembers its shard in the emitter it last wrote to, so
+    // usually we don't need to look it up.
+    static thread_local pair<uint64_t, size_t> last_shard(0, 0);
+    if (last_shard.first == instance_id) {
+        return shards[last_shard.second];
+    }
+
+    size_t shard_number;
+    {
+        lock_guard<mutex> lock(shard_owners_mutex);
+        auto found = shard_owners.find(this_thread::get_id());
+        if (found != shard_owners.end()) {
+            shard_number = found->second;
+        } else {
+            // This thread hasn't written before, so give it the next shard.
+            if (shard_owners.size() >= shards.size()) {
+                throw runtime_error("io::ShardedProtobufEmitter: more than the maximum of " + to_string(shards.size()) +
+                                    " threads are writing");
+            }
+            shard_number = shard_owners.size();
+            shard_owners.emplace(this_thread::get_id(), shard_number);
+        }
+    }
+    last_shard = make_pair(instance_id, shard_number);
+    return shards[shard_number];
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::add_to_shard(Shard& shard, const T& item, pair<Pending*, Pending*>* chain) -> void {
+    // Size the item, which also caches the sizes of its parts for serializing.
+    size_t size = item.ByteSizeLong();
+    if (size > MessageEmitter::MAX_MESSAGE_SIZE) {
+        // Protobuf can't serialize this; don't let it try.
+        handle(false);
+    }
+
+    if (shard.message_count > 0 &&
+        (shard.message_count >= max_group_size || shard.message_bytes + size > max_group_bytes)) {
+        // The group is full
+        hand_off(shard, chain);
+    }
+
+    uint8_t* dest = MessageEmitter::frame_message(shard.framed_messages, size);
+    uint8_t* past_end = item.SerializeWithCachedSizesToArray(dest);
+    // Make sure the item didn't change size since we measured it.
+    handle(past_end == dest + size);
+    shard.message_count++;
+    shard.message_bytes += size;
+
+    for (auto& handler : message_handlers) {
+        handler(item);
+    }
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::hand_off(Shard& shard, pair<Pending*, Pending*>* chain) -> void {
+    if (shard.message_count == 0) {
+        return;
+    }
+
+    Pending* group = new Pending();
+    group->framed_messages = std::move(shard.framed_messages);
+    group->message_count = shard.message_count;
+    group->message_bytes = shard.message_bytes;
+    shard.framed_messages.clear();
+    shard.message_count = 0;
+    shard.message_bytes = 0;
+
+    queued_bytes.fetch_add(group->message_bytes);
+
+    if (chain != nullptr) {
+        // Just add it to the list, to send later.
+        if (chain->first == nullptr) {
+            chain->first = group;
+        } else {
+            chain->second->next.store(group, memory_order_relaxed);
+        }
+        chain->second = group;
+    } else {
+        enqueue(group, group);
+        wait_for_writer();
+    }
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::enqueue(Pending* first, Pending* last) -> void {
+    // Link the list in after whatever was last, so the writer thread can find
+    // it. Until we link it, the writer thread just thinks the queue is empty.
+    last->next.store(nullptr, memory_order_relaxed);
+    Pending* previous = queue_head.exchange(last, memory_order_acq_rel);
+    previous->next.store(first, memory_order_release);
+
+    // Wake the writer thread if it is sleeping. Taking the lock makes sure it
+    // isn't between seeing an empty queue and going to sleep.
+    {
+        lock_guard<mutex> lock(wait_mutex);
+    }
+    writer_wake.notify_one();
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::dequeue() -> Pending* {
+    Pending* next = queue_tail->next.load(memory_order_acquire);
+    if (next == nullptr) {
+        // Nothing is ready
+        return nullptr;
+    }
+    // The old entry is done with, and the new one takes its place.
+    delete queue_tail;
+    queue_tail = next;
+    return next;
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::wait_for_writer() -> void {
+    // Everything counted as queued by us is really queued by now, so the
+    // writer thread can always catch up.
+    if (queued_bytes.load() > max_queued_bytes && !writer_failed.load()) {
+        unique_lock<mutex> lock(wait_mutex);
+        writer_caught_up.wait(lock, [&]() {
+            return queued_bytes.load() <= max_queued_bytes || writer_failed.load();
+        });
+    }
+    check_writer();
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::check_writer() -> void {
+    if (writer_failed.load()) {
+        rethrow_exception(writer_error);
+    }
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::fail_writer() -> void {
+    writer_error = current_exception();
+    writer_failed.store(true);
+    {
+        lock_guard<mutex> lock(wait_mutex);
+    }
+    writer_caught_up.notify_all();
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::writer_thread_function() -> void {
+    while (true) {
+        Pending* entry = dequeue();
+        if (entry == nullptr) {
+            // Wait for something to do.
+            unique_lock<mutex> lock(wait_mutex);
+            writer_wake.wait(lock, [&]() {
+                return queue_tail->next.load(memory_order_acquire) != nullptr;
+            });
+            continue;
+        }
+
+        switch (entry->action) {
+        case Action::STOP:
+            return;
+        case Action::EMIT:
+            if (!writer_failed.load()) {
+                try {
+                    message_emitter.emit_framed_group(tag, entry->framed_messages, entry->message_count);
+                } catch (...) {
+                    fail_writer();
+                }
+            }
+            // Free the message data now; the entry itself sticks around.
+            string().swap(entry->framed_messages);
+            {
+                size_t before = queued_bytes.fetch_sub(entry->message_bytes);
+                if (before > max_queued_bytes && before - entry->message_bytes <= max_queued_bytes) {
+                    // Writing threads may be waiting for us to get here.
+                    {
+                        lock_guard<mutex> lock(wait_mutex);
+                    }
+                    writer_caught_up.notify_all();
+                }
+            }
+            break;
+        case Action::FLUSH:
+            if (!writer_failed.load()) {
+                try {
+                    message_emitter.flush(entry->barrier);
+                } catch (...) {
+                    fail_writer();
+                }
+            }
+            if (writer_failed.load()) {
+                entry->done->set_exception(writer_error);
+            } else {
+                entry->done->set_value();
+            }
+            break;
+        }
+    }
+}
+
+template<typename T>
+auto ShardedProtobufEmitter<T>::handle(bool ok) -> void {
+    if (!ok) {
+        throw std::runtime_error("io::ShardedProtobufEmitter: could not write Protobuf");
+    }
+}
+
+}
+
+}
+
+#endif
@@ -11,10 +11,16 @@
 #include <functional>
 #include <vector>
 #include <list>
+#include <map>
+#include <memory>
 #include <limits>
+#include <exception>
+
+#include <omp.h>
 
 #include "registry.hpp"
 #include "message_iterator.hpp"
+#include "message_ranges.hpp"
 #include "protobuf_iterator.hpp"
 #include "protobuf_emitter.hpp"
 
@@ -29,6 +35,15 @@ size_t get_stream_length(std::istream& in);
 /// Get the current offset in the input stream, or std;:numeric_limits<size_t>::max() if unavailable.
 size_t get_stream_position(std::istream& in);
 
+/// Count the messages in the given stream of type-tagged message groups, by
+/// tag, without reading message data. Tags with only empty groups are
+/// reported with a count of 0, and untagged messages are counted under "".
+map<string, size_t> count_messages(std::istream& in);
+/// Count the messages in the given file of type-tagged message groups, by
+/// tag. If the file has an up-to-date sidecar GroupIndex, the counts come from
+/// that, and the file is barely read at all.
+map<string, size_t> count_messages(const string& filename);
+
 /// Write the EOF marker to the given stream, so that readers won't complain that it might be truncated when they read it in.
 /// Internal EOF markers MAY exist, but a file SHOULD have exactly one EOF marker at its end.
 /// Needs to know if the output stream is compressed or not. Note that uncompressed streams don't actually have nonempty EOF markers.
@@ -145,6 +160,88 @@ void for_each(std::istream& in,
 
 // Parallelized versions of for_each
 
+/// Parse the messages in the given batch, and call lambda2 on each pair of
+/// them, and lambda1 on an odd one at the end, if any. If use_arena is set,
+/// parse them all into a single Arena, which is freed when the batch is done,
+/// except for a first block of memory each thread reuses for every batch.
+/// Otherwise parse them into a reused pair of objects. If a filter is given,
+/// messages whose data it rejects are never parsed, and the pairs are made
+/// from the messages that are left.
+template <typename T>
+void for_each_in_batch(const MessageBatch& batch,
+                       const std::function<void(T&,T&)>& lambda2,
+                       const std::function<void(T&)>& lambda1,
+                       bool use_arena,
+                       const MessageFilter& filter = nullptr) {
+    auto handle = [](bool retval) -> void {
+        if (!retval) throw std::runtime_error("obsolete, invalid, or corrupt protobuf input");
+    };
+    
+    // Batches don't keep tags, but everything in them is of our type.
+    const string& tag = Registry::get_protobuf_tag<T>();
+    
+    // Find the index of the next message to parse, or the batch size if
+    // there are no more.
+    size_t cursor = 0;
+    auto next_wanted = [&]() -> size_t {
+        while (cursor < batch.size() && filter && !filter(tag, batch.data(cursor), batch.message_size(cursor))) {
+            cursor++;
+        }
+        return cursor < batch.size() ? cursor++ : batch.size();
+    };
+    
+    if (use_arena) {
+        // Each thread keeps a block of memory to start its batches' Arenas
+        // in, so a batch that fits needs no allocation at all. We take it
+        // while we use it, so a nested call on the same thread gets its own.
+        const size_t initial_block_size = 1024 * 1024;
+        thread_local unique_ptr<char[]> spare_block;
+        unique_ptr<char[]> initial_block = std::move(spare_block);
+        if (!initial_block) {
+            initial_block.reset(new char[initial_block_size]);
+        }
+        
+        google::protobuf::ArenaOptions options;
+        options.initial_block = initial_block.get();
+        options.initial_block_size = initial_block_size;
+        // Anything that doesn't fit goes in more blocks, starting at 64 KiB
+        // and growing up to the size of the first.
+        options.start_block_size = 64 * 1024;
+        options.max_block_size = initial_block_size;
+        {
+            // The Arena has to go away before its first block does.
+            google::protobuf::Arena arena(options);
+            for (size_t i = next_wanted(); i < batch.size(); i = next_wanted()) {
+                T* obj1 = ProtobufIterator<T>::parse_from_data(arena, batch.data(i), batch.message_size(i));
+                handle(obj1 != nullptr);
+                size_t j = next_wanted();
+                if (j < batch.size()) {
+                    T* obj2 = ProtobufIterator<T>::parse_from_data(arena, batch.data(j), batch.message_size(j));
+                    handle(obj2 != nullptr);
+                    lambda2(*obj1, *obj2);
+                } else { // odd last object
+                    lambda1(*obj1);
+                }
+            }
+        }
+        // The Arena is gone, so the block can be used again.
+        spare_block = std::move(initial_block);
+    } else {
+        T obj1, obj2;
+        for (size_t i = next_wanted(); i < batch.size(); i = next_wanted()) {
+            // parse protobuf objects and invoke lambda on the pair
+            handle(ProtobufIterator<T>::parse_from_data(obj1, batch.data(i), batch.message_size(i)));
+            size_t j = next_wanted();
+            if (j < batch.size()) {
+                handle(ProtobufIterator<T>::parse_from_data(obj2, batch.data(j), batch.message_size(j)));
+                lambda2(obj1, obj2);
+            } else { // odd last object
+                lambda1(obj1);
+            }
+        }
+    }
+}
+
 // First, an internal implementation underlying several variants below.
 // lambda2 is invoked on interleaved pairs of elements from the stream. The
 // elements of each pair are in order, but the overall order in which lambda2
@@ -154,6 +251,11 @@ void for_each(std::istream& in,
 // must be divisible by 2.
 // The progress function is invoked periodically with the input stream offset
 // and length, or std::numeric_limits<size_t>::max() if they are unavailable.
+// If use_arena is set, each batch is parsed into its own Arena (see
+// for_each_in_batch()). If a filter is given, it is run on each message's
+// data by the threads doing the parsing, and messages it rejects are dropped
+// unparsed. Since this happens batch by batch, pairs are only kept together
+// if both or neither pass, so the pair-based variants don't offer it.
 
 template <typename T>
 void for_each_parallel_impl(std::istream& in,
@@ -161,7 +263,9 @@ void for_each_parallel_impl(std::istream& in,
                             const std::function<void(T&)>& lambda1,
                             const std::function<bool(void)>& single_threaded_until_true,
                             size_t batch_size,
-                            const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+                            const std::function<void(size_t, size_t)>& progress = NO_PROGRESS,
+                            bool use_arena = false,
+                            const MessageFilter& filter = nullptr) {
 
     size_t stream_length = get_stream_length(in);
     if (stream_length == std::numeric_limits<size_t>::max()) {
@@ -183,53 +287,57 @@ void for_each_parallel_impl(std::istream& in,
 
     // this loop handles a chunked file with many pieces
     // such as we might write in a multithreaded process
-    #pragma omp parallel default(none) shared(in, lambda1, lambda2, progress, stream_length, batches_outstanding, max_batches_outstanding, single_threaded_until_true, cerr, batch_size)
+    #pragma omp parallel default(none) shared(in, lambda1, lambda2, progress, stream_length, batches_outstanding, max_batches_outstanding, single_threaded_until_true, cerr, batch_size, use_arena, filter)
     #pragma omp single
     {
-        auto handle = [](bool retval) -> void {
-            if (!retval) throw std::runtime_error("obsolete, invalid, or corrupt protobuf input");
-        };
-        
         // We do our own multi-threaded Protobuf decoding, but we batch up our
         // strings by pulling them from this iterator, which we also
-        // multi-thread for decompression.
-        MessageIterator message_it(in, false, 8);
-
-        std::vector<std::string> *batch = nullptr;
+        // multi-thread for decompression. The decompression threads sleep
+        // when they get far enough ahead, and there are fewer of them than
+        // parsing threads, so they can share cores with the parsing tasks.
+        MessageIterator message_it(in, false, MessageIterator::decompression_threads_for(omp_get_max_threads()));
+
+        if (message_it.has_current() && !Registry::check_protobuf_tag<T>(message_it.tag())) {
+            // If this happens on the very first message, we know this is the wrong kind of stream.
+            throw std::runtime_error("expected a stream of " + T::descriptor()->full_name() + " but found first message with tag " + message_it.tag());
+        }
         
-        bool first_message = true;
-
-        while (message_it.has_current()) {
-            // Until we run out of messages, grab them with their tags
-            auto tag_and_data = std::move(message_it.take());
-            
-            // Check the tag.
-            // TODO: we should only do this when it changes!
-            bool right_tag = Registry::check_protobuf_tag<T>(tag_and_data.first);
-            if (!right_tag) {
-                // This isn't the data we were expecting.
-                if (first_message) {
-                    // If this happens on the very first message, we know this is the wrong kind of stream.
-                    throw std::runtime_error("expected a stream of " + T::descriptor()->full_name() + " but found first message with tag " + tag_and_data.first);
-                } else {
-                    // On other mesages, just skip them if they aren't what we care about.
-                    first_message = false;
-                    continue;
+        // On other groups, just skip them if they aren't what we care about,
+        // without reading them.
+        message_it.set_tag_filter([](const string& tag) {
+            return Registry::check_protobuf_tag<T>(tag);
+        });
+        
+        // Batches that have been processed, ready to be filled again without
+        // allocating.
+        std::vector<MessageBatch*> spare_batches;
+        
+        // Get a batch to fill
+        auto get_batch = [&]() -> MessageBatch* {
+            MessageBatch* found = nullptr;
+#pragma omp critical (for_each_parallel_spare_batches)
+            {
+                if (!spare_batches.empty()) {
+                    found = spare_batches.back();
+                    spare_batches.pop_back();
                 }
             }
-            first_message = false;
-            
-            // If the tag checks out
-            
-            // Make sure we have a batch
-            if (batch == nullptr) {
-                batch = new vector<string>();
-            }
-            
-            if (tag_and_data.second.get() != nullptr) {
-                // Add the message to the batch, if it exists
-                batch->push_back(std::move(*tag_and_data.second));
-            }
+            return found == nullptr ? new MessageBatch() : found;
+        };
+        
+        // Put a batch back for reuse
+        auto recycle_batch = [&](MessageBatch* done) {
+#pragma omp critical (for_each_parallel_spare_batches)
+            spare_batches.push_back(done);
+        };
+
+        MessageBatch* batch = nullptr;
+
+        while (message_it.has_current()) {
+            // Until we run out of messages, grab them in batches, with all
+            // their data in one buffer.
+            batch = get_batch();
+            message_it.next_batch(*batch, batch_size);
             
             if (batch->size() == batch_size) {
 #ifdef debug
@@ -250,16 +358,8 @@ void for_each_parallel_impl(std::istream& in,
 #endif
                     
                     // process this batch in the current thread
-                    {
-                        T obj1, obj2;
-                        for (int i = 0; i<batch_size; i+=2) {
-                            // parse protobuf objects and invoke lambda on the pair
-                            handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                            handle(ProtobufIterator<T>::parse_from_string(obj2, batch->at(i+1)));
-                            lambda2(obj1,obj2);
-                        }
-                    } // scope obj1 & obj2
-                    delete batch;
+                    for_each_in_batch(*batch, lambda2, lambda1, use_arena, filter);
+                    recycle_batch(batch);
 #pragma omp atomic capture
                     b = --batches_outstanding;
                     
@@ -280,22 +380,14 @@ void for_each_parallel_impl(std::istream& in,
 #endif
                 
                     // spawn a task in another thread to process this batch
-#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, lambda2, handle, single_threaded_until_true, cerr, batch_size)
+#pragma omp task default(none) firstprivate(batch) shared(batches_outstanding, lambda1, lambda2, recycle_batch, single_threaded_until_true, cerr, batch_size, use_arena, filter)
                     {
 #ifdef debug
                         cerr << "Batch task is running" << endl;
 #endif
                         
-                        {
-                            T obj1, obj2;
-                            for (int i = 0; i<batch_size; i+=2) {
-                                // parse protobuf objects and invoke lambda on the pair
-                                handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                                handle(ProtobufIterator<T>::parse_from_string(obj2, batch->at(i+1)));
-                                lambda2(obj1,obj2);
-                            }
-                        } // scope obj1 & obj2
-                        delete batch;
+                        for_each_in_batch(*batch, lambda2, lambda1, use_arena, filter);
+                        recycle_batch(batch);
 #pragma omp atomic update
                         batches_outstanding--;
                     }
@@ -316,22 +408,13 @@ void for_each_parallel_impl(std::istream& in,
 #ifdef debug
             cerr << "Run final batch of size " << batch->size() << " in current thread" << endl;
 #endif
-            if (!batch->empty()) {
-                // We require the batch to not be empty (so we can subtract from the size).
-                T obj1, obj2;
-                int i = 0;
-                for (; i < batch->size()-1; i+=2) {
-                    handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                    handle(ProtobufIterator<T>::parse_from_string(obj2, batch->at(i+1)));
-                    lambda2(obj1, obj2);
-                }
-                if (i == batch->size()-1) { // odd last object
-                    handle(ProtobufIterator<T>::parse_from_string(obj1, batch->at(i)));
-                    lambda1(obj1);
-                }
-            }
+            for_each_in_batch(*batch, lambda2, lambda1, use_arena, filter);
             delete batch;
         }
+        
+        for (auto* spare : spare_batches) {
+            delete spare;
+        }
     }
 }
 
@@ -369,6 +452,145 @@ void for_each_parallel(std::istream& in,
     for_each_parallel_impl(in, lambda2, lambda1, NO_WAIT, batch_size, progress);
 }
 
+/// Parallel iteration over interleaved pairs of elements, like
+/// for_each_interleaved_pair_parallel(), but parsing each batch of elements
+/// into a single Protobuf Arena. This saves a lot of allocation for messages
+/// with many parts, like Alignments. Elements only live until the lambda
+/// returns; moving them out copies them.
+template <typename T>
+void for_each_interleaved_pair_parallel_in_arena(std::istream& in,
+                                                 const std::function<void(T&,T&)>& lambda2,
+                                                 size_t batch_size = 256,
+                                                 const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&)> err1 = [](T&){
+        throw std::runtime_error("io::for_each_interleaved_pair_parallel_in_arena: expected input stream of interleaved pairs, but it had odd number of elements");
+    };
+    for_each_parallel_impl(in, lambda2, err1, NO_WAIT, batch_size, progress, true);
+}
+
+/// Parallel iteration over individual elements, like for_each_parallel(), but
+/// parsing each batch of elements into a single Protobuf Arena. This saves a
+/// lot of allocation for messages with many parts, like Alignments. Elements
+/// only live until the lambda returns; moving them out copies them.
+template <typename T>
+void for_each_parallel_in_arena(std::istream& in,
+                                const std::function<void(T&)>& lambda1,
+                                size_t batch_size = 256,
+                                const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&,T&)> lambda2 = [&lambda1](T& o1, T& o2) { lambda1(o1); lambda1(o2); };
+    for_each_parallel_impl(in, lambda2, lambda1, NO_WAIT, batch_size, progress, true);
+}
+
+/// Parallel iteration over individual elements, like for_each_parallel(), but
+/// only parsing the elements whose serialized data passes the given filter.
+/// The filter runs on the worker threads, and should be much cheaper than
+/// parsing; see AlignmentPredicate for one that looks at Alignment fields
+/// without parsing them.
+template <typename T>
+void for_each_parallel_filtered(std::istream& in,
+                                const MessageFilter& filter,
+                                const std::function<void(T&)>& lambda1,
+                                size_t batch_size = 256,
+                                const std::function<void(size_t, size_t)>& progress = NO_PROGRESS) {
+    std::function<void(T&,T&)> lambda2 = [&lambda1](T& o1, T& o2) { lambda1(o1); lambda1(o2); };
+    for_each_parallel_impl(in, lambda2, lambda1, NO_WAIT, batch_size, progress, false, filter);
+}
+
+/// Call the given lambda on each message of the right type in the given range
+/// of the given file, as produced by split_message_file(). Messages in other
+/// groups are skipped. Throws if the range does not end at a group boundary.
+template <typename T>
+void for_each_in_range(const string& filename,
+                       const MessageRange& range,
+                       const std::function<void(T&)>& lambda) {
+
+    MessageIterator message_it(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+    if (range.start_vo != 0 && !message_it.seek_group(range.start_vo)) {
+        throw std::runtime_error("could not seek to message group at " + to_string(range.start_vo) + " in " + filename);
+    }
+
+    T item;
+    while (message_it.has_current()) {
+        if (range.end_vo != -1 && message_it.tell_group() >= range.end_vo) {
+            // We have reached the next range.
+            break;
+        }
+        if (!Registry::check_protobuf_tag<T>(message_it.tag())) {
+            // Skip groups of other things without reading them.
+            message_it.skip_group();
+            continue;
+        }
+        auto view = message_it.view();
+        if (view.data != nullptr) {
+            if (!ProtobufIterator<T>::parse_from_data(item, view.data, view.size)) {
+                throw std::runtime_error("obsolete, invalid, or corrupt protobuf input");
+            }
+            lambda(item);
+        }
+        message_it.advance();
+    }
+
+    if (range.end_vo != -1 && (!message_it.has_current() || message_it.tell_group() != range.end_vo)) {
+        // We must have resynchronized on something that wasn't really a group.
+        throw std::runtime_error("message range in " + filename + " did not end at a group boundary at " + to_string(range.end_vo));
+    }
+}
+
+/// Parallel iteration over each individual element of a BGZF file, given by
+/// name. Instead of decompressing and framing on one thread, the file is split
+/// into range_count ranges (by default, 4 per thread) at group boundaries, and
+/// each range is read independently. Unless the file has a current sidecar
+/// GroupIndex, finding the boundaries takes one pass through the file that
+/// decompresses it without parsing anything. The order in which lambda1 is invoked is
+/// undefined. Files that can't be split are read on one thread.
+template <typename T>
+void for_each_parallel_split(const string& filename,
+                             const std::function<void(T&)>& lambda1,
+                             size_t range_count = 0) {
+
+    if (range_count == 0) {
+        range_count = omp_get_max_threads() * 4;
+    }
+
+    vector<MessageRange> ranges = split_message_file(filename, range_count);
+    if (ranges.empty()) {
+        return;
+    }
+
+    {
+        // Make sure this is the right kind of file to begin with.
+        MessageIterator message_it(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+        if (message_it.has_current() && !Registry::check_protobuf_tag<T>(message_it.tag())) {
+            throw std::runtime_error("expected a stream of " + T::descriptor()->full_name() + " but found first message with tag " + message_it.tag());
+        }
+    }
+
+#ifdef debug
+    cerr << "Reading " << filename << " in " << ranges.size() << " ranges" << endl;
+#endif
+
+    // Exceptions can't leave a parallel region, so we hold the first one here.
+    std::exception_ptr problem;
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < ranges.size(); i++) {
+        try {
+            for_each_in_range(filename, ranges[i], lambda1);
+        } catch (...) {
+#pragma omp critical (for_each_parallel_split_problem)
+            {
+                if (!problem) {
+                    problem = std::current_exception();
+                }
+            }
+        }
+    }
+
+    if (problem) {
+        std::rethrow_exception(problem);
+    }
+}
+
 }
 
 }
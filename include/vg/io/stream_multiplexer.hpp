@@ -44,6 +44,15 @@ public:
      */
     ~StreamMultiplexer();
     
+    /**
+     * Write out everything that has been written for all threads, stop the
+     * writer thread, and flush the backing stream. Assumes a final breakpoint
+     * on all streams. When this returns, all the data is in the backing
+     * stream, and nothing more may be written through the multiplexer.
+     * Calling it again does nothing.
+     */
+    void finish();
+    
     // Do not allow the StreamMultiplexer itself to be copied or moved.
     // This is because it has to own streams.
     StreamMultiplexer(const StreamMultiplexer& other) = delete;
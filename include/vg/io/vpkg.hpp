@@ -544,7 +544,8 @@ private:
         if (it.has_current()) {
             // File is not empty
         
-            string current_tag = (*it).first;
+            // Look at just the tag, so we don't read a message we can't use.
+            string current_tag = it.tag();
                 
 #ifdef debug
             cerr << "Iterator found tag \"" << current_tag << "\"" << endl;
@@ -563,7 +564,7 @@ private:
             } else {
                 // Load with it and return a unique_ptr for the result.
                 return unique_ptr<Wanted>((Wanted*)(*loader)([&](const message_consumer_function_t& handle_message) {
-                    while (it.has_current() && (*it).first == current_tag) {
+                    while (it.has_current() && it.tag() == current_tag) {
                         // Feed in messages from the file until we run out or the tag changes
                         if ((*it).second.get() != nullptr) {
                             handle_message(*((*it).second));
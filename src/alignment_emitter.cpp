@@ -48,13 +48,14 @@ void AlignmentEmitter::emit_mapped_pair(vector<Alignment>&& alns1, vector<Alignm
 }
 
 unique_ptr<AlignmentEmitter> get_non_hts_alignment_emitter(const string& filename, const string& format,
-    const map<string, int64_t>& path_length, size_t max_threads, const HandleGraph* graph, const handlegraph::NamedNodeBackTranslation* translate_through) {
+    const map<string, int64_t>& path_length, size_t max_threads, const HandleGraph* graph, const handlegraph::NamedNodeBackTranslation* translate_through,
+    int compression_level, bool write_group_index) {
 
     // Make the backing, non-buffered emitter
     AlignmentEmitter* backing = nullptr;
     if (format == "GAM" || format == "JSON") {
         // Make an emitter that supports VG formats
-        backing = new VGAlignmentEmitter(filename, format, max_threads);
+        backing = new VGAlignmentEmitter(filename, format, max_threads, compression_level, write_group_index);
     } else if (format == "GAF") {
         backing = new GafAlignmentEmitter(filename, format, *graph, max_threads, translate_through);
     } else if (format == "TSV") {
@@ -141,9 +142,13 @@ void TSVAlignmentEmitter::emit(Alignment&& aln) {
         << aln.score() << "\n";
 }
 
-VGAlignmentEmitter::VGAlignmentEmitter(const string& filename, const string& format, size_t max_threads):
+VGAlignmentEmitter::VGAlignmentEmitter(const string& filename, const string& format, size_t max_threads, int compression_level,
+                                       bool write_group_index):
     out_file(filename == "-" ? nullptr : new ofstream(filename)),
-    multiplexer(out_file.get() != nullptr ? *out_file : cout, max_threads) {
+    multiplexer(out_file.get() != nullptr ? *out_file : cout, max_threads),
+    compression_level(compression_level),
+    filename(filename),
+    write_group_index(write_group_index && filename != "-" && format == "GAM") {
     
     // We only support GAM and JSON formats
     assert(format == "GAM" || format == "JSON");
@@ -171,7 +176,7 @@ VGAlignmentEmitter::VGAlignmentEmitter(const string& filename, const string& for
         proto.reserve(max_threads);
         for (size_t i = 0; i < max_threads; i++) {
             // Make an emitter for each thread.
-            proto.emplace_back(new vg::io::ProtobufEmitter<Alignment>(multiplexer.get_thread_stream(i)));
+            proto.emplace_back(new vg::io::ProtobufEmitter<Alignment>(multiplexer.get_thread_stream(i), true, 1000, compression_level));
         }
     }
     
@@ -197,6 +202,22 @@ VGAlignmentEmitter::~VGAlignmentEmitter() {
         }
     }
     
+    if (write_group_index) {
+        // The threads' output is interleaved in the file in an order we don't
+        // control, so the offsets the emitters saw mean nothing. Get
+        // everything into the file and index it from there. The writer
+        // thread has to be completely done before we read the file back.
+        multiplexer.finish();
+        out_file->flush();
+        
+        ofstream index_out(GroupIndex::sidecar_filename(filename));
+        if (!index_out) {
+            cerr << "[vg::VGAlignmentEmitter] failed to open " << GroupIndex::sidecar_filename(filename) << " for writing" << endl;
+            exit(1);
+        }
+        GroupIndex::index_file(filename).save(index_out);
+    }
+    
 #ifdef debug
     cerr << "Destroyed VGAlignmentEmitter" << endl;
 #endif
@@ -217,7 +238,7 @@ void VGAlignmentEmitter::emit_extra_message(const std::string& tag, std::string&
         proto[thread_number]->flush();
         {
             // Sneakily make a compressed message emitter on the same stream
-            vg::io::MessageEmitter emitter(multiplexer.get_thread_stream(thread_number), true);
+            vg::io::MessageEmitter emitter(multiplexer.get_thread_stream(thread_number), true, 1000, compression_level);
             // Move the data into it
             emitter.write(tag, std::move(data));
         }
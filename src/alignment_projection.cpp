@@ -0,0 +1,432 @@
+/**
+ * \file alignment_projection.cpp
+ * Implementations for parsing only some of the fields of serialized
+ * Alignments.
+ */
+
+#include "vg/io/alignment_projection.hpp"
+#include "vg/io/message_iterator.hpp"
+#include "vg/io/registry.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+// Field numbers from vg.proto that we look for.
+static const int ALIGNMENT_SEQUENCE_FIELD = 1;
+static const int ALIGNMENT_PATH_FIELD = 2;
+static const int ALIGNMENT_NAME_FIELD = 3;
+static const int ALIGNMENT_QUALITY_FIELD = 4;
+static const int ALIGNMENT_MAPPING_QUALITY_FIELD = 5;
+static const int ALIGNMENT_SCORE_FIELD = 6;
+static const int ALIGNMENT_SAMPLE_NAME_FIELD = 9;
+static const int ALIGNMENT_READ_GROUP_FIELD = 10;
+static const int ALIGNMENT_IS_SECONDARY_FIELD = 15;
+static const int ALIGNMENT_IDENTITY_FIELD = 16;
+static const int PATH_MAPPING_FIELD = 2;
+static const int MAPPING_POSITION_FIELD = 1;
+static const int POSITION_NODE_ID_FIELD = 1;
+
+void AlignmentSummary::clear() {
+    name.clear();
+    mapping_quality = 0;
+    score = 0;
+    is_secondary = false;
+    identity = 0;
+    node_ids.clear();
+}
+
+/// Read just the node ID out of a serialized Position. Leaves node_id alone
+/// if the Position doesn't have one.
+static bool read_node_id(CodedInputStream& in, int64_t& node_id) {
+    uint32_t tag;
+    while ((tag = in.ReadTag()) != 0) {
+        if (tag == WireFormatLite::MakeTag(POSITION_NODE_ID_FIELD, WireFormatLite::WIRETYPE_VARINT)) {
+            uint64_t value;
+            if (!in.ReadVarint64(&value)) {
+                return false;
+            }
+            node_id = (int64_t) value;
+        } else if (!WireFormatLite::SkipField(&in, tag)) {
+            return false;
+        }
+    }
+    return in.ConsumedEntireMessage();
+}
+
+/// Sink for fields parsed by walk_alignment() that fills in an Alignment.
+struct AlignmentFieldSink {
+    Alignment& dest;
+
+    string* string_field(int field_number) {
+        switch (field_number) {
+        case ALIGNMENT_NAME_FIELD:
+            return dest.mutable_name();
+        case ALIGNMENT_SEQUENCE_FIELD:
+            return dest.mutable_sequence();
+        case ALIGNMENT_QUALITY_FIELD:
+            return dest.mutable_quality();
+        case ALIGNMENT_SAMPLE_NAME_FIELD:
+            return dest.mutable_sample_name();
+        case ALIGNMENT_READ_GROUP_FIELD:
+            return dest.mutable_read_group();
+        default:
+            return nullptr;
+        }
+    }
+    void set_mapping_quality(int32_t value) {
+        dest.set_mapping_quality(value);
+    }
+    void set_score(int32_t value) {
+        dest.set_score(value);
+    }
+    void set_is_secondary(bool value) {
+        dest.set_is_secondary(value);
+    }
+    void set_identity(double value) {
+        dest.set_identity(value);
+    }
+    bool parse_path(CodedInputStream& in) {
+        return dest.mutable_path()->MergeFromCodedStream(&in);
+    }
+    void add_mapping() {
+        dest.mutable_path()->add_mapping();
+    }
+    bool parse_position(CodedInputStream& in) {
+        Path* path = dest.mutable_path();
+        return path->mutable_mapping(path->mapping_size() - 1)->mutable_position()->MergeFromCodedStream(&in);
+    }
+};
+
+/// Sink for fields parsed by walk_alignment() that fills in an
+/// AlignmentSummary.
+struct SummaryFieldSink {
+    AlignmentSummary& dest;
+
+    string* string_field(int field_number) {
+        return field_number == ALIGNMENT_NAME_FIELD ? &dest.name : nullptr;
+    }
+    void set_mapping_quality(int32_t value) {
+        dest.mapping_quality = value;
+    }
+    void set_score(int32_t value) {
+        dest.score = value;
+    }
+    void set_is_secondary(bool value) {
+        dest.is_secondary = value;
+    }
+    void set_identity(double value) {
+        dest.identity = value;
+    }
+    bool parse_path(CodedInputStream& in) {
+        // We only keep the node IDs, so we don't need the Edits.
+        return walk_mappings(in);
+    }
+    void add_mapping() {
+        dest.node_ids.push_back(0);
+    }
+    bool parse_position(CodedInputStream& in) {
+        return read_node_id(in, dest.node_ids.back());
+    }
+
+    /// Walk a serialized Path, filling in just the node IDs.
+    bool walk_mappings(CodedInputStream& in);
+};
+
+/// Sink for fields parsed by walk_alignment() that just keeps what an
+/// AlignmentPredicate needs, without allocating anything.
+struct PredicateFieldSink {
+    const AlignmentPredicate& predicate;
+    int32_t mapping_quality = 0;
+    int32_t score = 0;
+    bool is_secondary = false;
+    /// Set when a Mapping is seen on a node in the predicate's range.
+    bool touches_range = false;
+
+    string* string_field(int field_number) {
+        return nullptr;
+    }
+    void set_mapping_quality(int32_t value) {
+        mapping_quality = value;
+    }
+    void set_score(int32_t value) {
+        score = value;
+    }
+    void set_is_secondary(bool value) {
+        is_secondary = value;
+    }
+    void set_identity(double value) {
+        // Not used
+    }
+    bool parse_path(CodedInputStream& in) {
+        return walk_mappings(in);
+    }
+    void add_mapping() {
+        // Nothing to keep per Mapping
+    }
+    bool parse_position(CodedInputStream& in) {
+        int64_t node_id = 0;
+        if (!read_node_id(in, node_id)) {
+            return false;
+        }
+        if (node_id >= predicate.min_node_id && node_id < predicate.max_node_id) {
+            touches_range = true;
+        }
+        return true;
+    }
+
+    /// Walk a serialized Path, looking at just the node IDs.
+    bool walk_mappings(CodedInputStream& in);
+};
+
+/// Call the given function on the length-delimited submessage at the
+/// stream's current position, with the stream limited to it. Returns false
+/// if the submessage can't be read or the function returns false.
+template<typename Function>
+static bool in_submessage(CodedInputStream& in, const Function& function) {
+    uint32_t length;
+    if (!in.ReadVarint32(&length)) {
+        return false;
+    }
+    int remaining = in.BytesUntilLimit();
+    if (remaining >= 0 && length > (uint32_t) remaining) {
+        // The submessage is truncated, and the limit would just be clamped.
+        return false;
+    }
+    auto limit = in.PushLimit(length);
+    bool ok = function() && in.BytesUntilLimit() == 0;
+    in.PopLimit(limit);
+    return ok;
+}
+
+/// Walk a serialized Path, starting a mapping for each Mapping and passing
+/// its Position, if any, to the sink.
+template<typename Sink>
+static bool walk_path_positions(CodedInputStream& in, Sink& sink) {
+    const uint32_t mapping_tag = WireFormatLite::MakeTag(PATH_MAPPING_FIELD, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    const uint32_t position_tag = WireFormatLite::MakeTag(MAPPING_POSITION_FIELD, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    uint32_t tag;
+    while ((tag = in.ReadTag()) != 0) {
+        if (tag == mapping_tag) {
+            sink.add_mapping();
+            bool ok = in_submessage(in, [&]() {
+                uint32_t mapping_field_tag;
+                while ((mapping_field_tag = in.ReadTag()) != 0) {
+                    if (mapping_field_tag == position_tag) {
+                        if (!in_submessage(in, [&]() { return sink.parse_position(in); })) {
+                            return false;
+                        }
+                    } else if (!WireFormatLite::SkipField(&in, mapping_field_tag)) {
+                        // Edits get skipped by length here.
+                        return false;
+                    }
+                }
+                return in.ConsumedEntireMessage();
+            });
+            if (!ok) {
+                return false;
+            }
+        } else if (!WireFormatLite::SkipField(&in, tag)) {
+            return false;
+        }
+    }
+    return in.ConsumedEntireMessage();
+}
+
+bool SummaryFieldSink::walk_mappings(CodedInputStream& in) {
+    return walk_path_positions(in, *this);
+}
+
+bool PredicateFieldSink::walk_mappings(CodedInputStream& in) {
+    return walk_path_positions(in, *this);
+}
+
+/// Walk a serialized Alignment, passing the requested fields to the sink and
+/// skipping the rest by their wire type and length.
+template<typename Sink>
+static bool walk_alignment(const char* data, size_t size, uint32_t fields, Sink& sink) {
+    CodedInputStream in((const uint8_t*) data, size);
+    // Allow messages as big as the message files can hold.
+    in.SetTotalBytesLimit(MessageIterator::MAX_MESSAGE_SIZE * 2);
+
+    uint32_t tag;
+    while ((tag = in.ReadTag()) != 0) {
+        int field_number = WireFormatLite::GetTagFieldNumber(tag);
+        auto wire_type = WireFormatLite::GetTagWireType(tag);
+        bool ok = true;
+        bool handled = true;
+        switch (field_number) {
+        case ALIGNMENT_NAME_FIELD:
+        case ALIGNMENT_SEQUENCE_FIELD:
+        case ALIGNMENT_QUALITY_FIELD:
+        case ALIGNMENT_SAMPLE_NAME_FIELD:
+        case ALIGNMENT_READ_GROUP_FIELD:
+            {
+                uint32_t wanted = field_number == ALIGNMENT_NAME_FIELD ? ALIGNMENT_NAME :
+                    field_number == ALIGNMENT_SEQUENCE_FIELD ? ALIGNMENT_SEQUENCE :
+                    field_number == ALIGNMENT_QUALITY_FIELD ? ALIGNMENT_QUALITY :
+                    field_number == ALIGNMENT_SAMPLE_NAME_FIELD ? ALIGNMENT_SAMPLE_NAME : ALIGNMENT_READ_GROUP;
+                string* dest = (fields & wanted) ? sink.string_field(field_number) : nullptr;
+                if (dest != nullptr && wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                    ok = WireFormatLite::ReadBytes(&in, dest);
+                } else {
+                    handled = false;
+                }
+            }
+            break;
+        case ALIGNMENT_MAPPING_QUALITY_FIELD:
+        case ALIGNMENT_SCORE_FIELD:
+            if ((fields & (field_number == ALIGNMENT_SCORE_FIELD ? ALIGNMENT_SCORE : ALIGNMENT_MAPPING_QUALITY)) &&
+                wire_type == WireFormatLite::WIRETYPE_VARINT) {
+                uint32_t value;
+                ok = in.ReadVarint32(&value);
+                if (field_number == ALIGNMENT_SCORE_FIELD) {
+                    sink.set_score((int32_t) value);
+                } else {
+                    sink.set_mapping_quality((int32_t) value);
+                }
+            } else {
+                handled = false;
+            }
+            break;
+        case ALIGNMENT_IS_SECONDARY_FIELD:
+            if ((fields & ALIGNMENT_IS_SECONDARY) && wire_type == WireFormatLite::WIRETYPE_VARINT) {
+                uint64_t value;
+                ok = in.ReadVarint64(&value);
+                sink.set_is_secondary(value != 0);
+            } else {
+                handled = false;
+            }
+            break;
+        case ALIGNMENT_IDENTITY_FIELD:
+            if ((fields & ALIGNMENT_IDENTITY) && wire_type == WireFormatLite::WIRETYPE_FIXED64) {
+                uint64_t bits;
+                ok = in.ReadLittleEndian64(&bits);
+                double value;
+                memcpy(&value, &bits, sizeof(value));
+                sink.set_identity(value);
+            } else {
+                handled = false;
+            }
+            break;
+        case ALIGNMENT_PATH_FIELD:
+            if ((fields & ALIGNMENT_PATH) && wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                ok = in_submessage(in, [&]() { return sink.parse_path(in); });
+            } else if ((fields & ALIGNMENT_POSITIONS) && wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                ok = in_submessage(in, [&]() { return walk_path_positions(in, sink); });
+            } else {
+                handled = false;
+            }
+            break;
+        default:
+            handled = false;
+            break;
+        }
+        if (!handled) {
+            // Skip the field without looking at it.
+            ok = WireFormatLite::SkipField(&in, tag);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return in.ConsumedEntireMessage();
+}
+
+bool parse_alignment_fields(const char* data, size_t size, uint32_t fields, Alignment& dest) {
+    dest.Clear();
+    AlignmentFieldSink sink{dest};
+    return walk_alignment(data, size, fields, sink);
+}
+
+bool parse_alignment_fields(const char* data, size_t size, uint32_t fields, AlignmentSummary& dest) {
+    dest.clear();
+    SummaryFieldSink sink{dest};
+    return walk_alignment(data, size, fields, sink);
+}
+
+uint32_t AlignmentPredicate::fields() const {
+    uint32_t needed = 0;
+    if (min_mapping_quality != numeric_limits<int32_t>::min()) {
+        needed |= ALIGNMENT_MAPPING_QUALITY;
+    }
+    if (min_score != numeric_limits<int32_t>::min()) {
+        needed |= ALIGNMENT_SCORE;
+    }
+    if (!keep_secondary || !keep_primary) {
+        needed |= ALIGNMENT_IS_SECONDARY;
+    }
+    if (min_node_id < max_node_id) {
+        needed |= ALIGNMENT_POSITIONS;
+    }
+    return needed;
+}
+
+bool AlignmentPredicate::matches(const char* data, size_t size) const {
+    uint32_t needed = fields();
+    if (needed == 0) {
+        // Everything matches, so don't even look.
+        return true;
+    }
+    
+    PredicateFieldSink sink{*this};
+    if (!walk_alignment(data, size, needed, sink)) {
+        // Let the real parse complain.
+        return true;
+    }
+    
+    return sink.mapping_quality >= min_mapping_quality &&
+        sink.score >= min_score &&
+        (sink.is_secondary ? keep_secondary : keep_primary) &&
+        (min_node_id >= max_node_id || sink.touches_range);
+}
+
+MessageFilter AlignmentPredicate::as_filter() const {
+    AlignmentPredicate copy = *this;
+    return [copy](const string& tag, const char* data, size_t size) {
+        // Other kinds of messages, like the extra messages that emitters can
+        // put in GAM files, aren't for us to judge.
+        return !Registry::check_protobuf_tag<Alignment>(tag) || copy.matches(data, size);
+    };
+}
+
+void for_each_alignment_summary(istream& in, uint32_t fields, const function<void(AlignmentSummary&)>& lambda) {
+    MessageIterator it(in);
+    // Skip groups of other things without reading them.
+    it.set_tag_filter([](const string& tag) {
+        return Registry::check_protobuf_tag<Alignment>(tag);
+    });
+
+    AlignmentSummary summary;
+    while (it.has_current()) {
+        if (!Registry::check_protobuf_tag<Alignment>(it.tag())) {
+            // The first group may not have been filtered.
+            it.skip_group();
+            continue;
+        }
+        auto message = it.view();
+        if (message.data != nullptr) {
+            if (!parse_alignment_fields(message.data, message.size, fields, summary)) {
+                throw runtime_error("[io::for_each_alignment_summary] could not parse Alignment at group " +
+                                    to_string(it.tell_group()));
+            }
+            lambda(summary);
+        }
+        it.advance();
+    }
+}
+
+}
+
+}
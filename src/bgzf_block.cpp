@@ -0,0 +1,327 @@
+/**
+ * \file bgzf_block.cpp
+ * Implementations for whole-block BGZF parsing, inflation, and deflation.
+ */
+
+#include "vg/io/bgzf_block.hpp"
+
+#include <algorithm>
+#include <memory>
+
+#ifdef VGIO_USE_LIBDEFLATE
+#include <libdeflate.h>
+#else
+#include <zlib.h>
+#endif
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Read a little-endian 16-bit integer
+static inline uint32_t unpack_uint16(const unsigned char* data) {
+    return (uint32_t) data[0] | ((uint32_t) data[1] << 8);
+}
+
+/// Read a little-endian 32-bit integer
+static inline uint32_t unpack_uint32(const unsigned char* data) {
+    return (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+/// Write a little-endian 16-bit integer
+static inline void pack_uint16(unsigned char* data, uint32_t value) {
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+}
+
+/// Write a little-endian 32-bit integer
+static inline void pack_uint32(unsigned char* data, uint32_t value) {
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = (value >> 24) & 0xFF;
+}
+
+/// The fixed part of a BGZF block header. The last two bytes get the block
+/// size minus 1.
+static const unsigned char BGZF_HEADER_TEMPLATE[BGZF_HEADER_SIZE] = {
+    // gzip magic, deflate, FEXTRA flag
+    31, 139, 8, 4,
+    // No modification time, no extra flags, unknown OS
+    0, 0, 0, 0, 0, 255,
+    // 6 bytes of extra field, holding a BC subfield of 2 bytes
+    6, 0, 'B', 'C', 2, 0,
+    // Block size placeholder
+    0, 0
+};
+
+/// Fill in the header and footer around deflate data of the given size that
+/// is already at BGZF_HEADER_SIZE in dest. Returns the total block size.
+static int64_t frame_block(unsigned char* dest, size_t deflated_size, uint32_t crc, size_t length) {
+    size_t block_size = BGZF_HEADER_SIZE + deflated_size + BGZF_FOOTER_SIZE;
+    copy(BGZF_HEADER_TEMPLATE, BGZF_HEADER_TEMPLATE + BGZF_HEADER_SIZE, dest);
+    pack_uint16(dest + 16, block_size - 1);
+    pack_uint32(dest + block_size - BGZF_FOOTER_SIZE, crc);
+    pack_uint32(dest + block_size - 4, length);
+    return block_size;
+}
+
+/// Frame the given data as a single stored (uncompressed) deflate block
+/// inside a BGZF block. Returns the total block size, or -1 if it does not
+/// fit.
+static int64_t store_block(const void* data, size_t length, void* dest, size_t dest_capacity, uint32_t crc) {
+    // A stored block has a 1-byte block header (final block, no compression),
+    // then the length and its one's complement.
+    const size_t STORED_HEADER_SIZE = 5;
+    if (length > 0xFFFF || BGZF_HEADER_SIZE + STORED_HEADER_SIZE + length + BGZF_FOOTER_SIZE > dest_capacity) {
+        return -1;
+    }
+    unsigned char* bytes = (unsigned char*) dest;
+    unsigned char* stored = bytes + BGZF_HEADER_SIZE;
+    stored[0] = 1;
+    pack_uint16(stored + 1, length);
+    pack_uint16(stored + 3, ~length & 0xFFFF);
+    copy((const unsigned char*) data, (const unsigned char*) data + length, stored + STORED_HEADER_SIZE);
+    return frame_block(bytes, STORED_HEADER_SIZE + length, crc, length);
+}
+
+size_t bgzf_block_size(const void* header) {
+    const unsigned char* bytes = (const unsigned char*) header;
+
+    // We need the gzip magic number, deflate compression, the FEXTRA flag, an
+    // extra field of 6 bytes, and a BC subfield of 2 bytes as the only thing
+    // in it. This is the same check htslib does.
+    if (bytes[0] != 31 || bytes[1] != 139 || bytes[2] != 8 || (bytes[3] & 4) == 0 ||
+        unpack_uint16(bytes + 10) != 6 || bytes[12] != 'B' || bytes[13] != 'C' ||
+        unpack_uint16(bytes + 14) != 2) {
+        return 0;
+    }
+
+    // The BC subfield holds the block size minus 1.
+    size_t block_size = unpack_uint16(bytes + 16) + 1;
+    if (block_size < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+        // Can't possibly hold a deflate stream and a footer.
+        return 0;
+    }
+    return block_size;
+}
+
+size_t bgzf_block_uncompressed_size(const void* block, size_t block_size) {
+    return unpack_uint32((const unsigned char*) block + block_size - 4);
+}
+
+#ifdef VGIO_USE_LIBDEFLATE
+
+/// Deleter for thread-local libdeflate decompressors
+struct LibdeflateDecompressorDeleter {
+    void operator()(libdeflate_decompressor* decompressor) const {
+        libdeflate_free_decompressor(decompressor);
+    }
+};
+
+int64_t bgzf_inflate_block(const void* block, size_t block_size, void* dest, size_t dest_capacity) {
+    // libdeflate decompressors can't be shared between threads, but are
+    // expensive enough to make that we want to keep one per thread.
+    thread_local unique_ptr<libdeflate_decompressor, LibdeflateDecompressorDeleter> decompressor;
+    if (!decompressor) {
+        decompressor.reset(libdeflate_alloc_decompressor());
+        if (!decompressor) {
+            return -1;
+        }
+    }
+
+    const unsigned char* bytes = (const unsigned char*) block;
+    const unsigned char* footer = bytes + block_size - BGZF_FOOTER_SIZE;
+    size_t expected_size = unpack_uint32(footer + 4);
+    if (expected_size > dest_capacity) {
+        return -1;
+    }
+
+    size_t inflated_size = 0;
+    if (libdeflate_deflate_decompress(decompressor.get(), bytes + BGZF_HEADER_SIZE,
+                                      block_size - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE,
+                                      dest, expected_size, &inflated_size) != LIBDEFLATE_SUCCESS) {
+        return -1;
+    }
+
+    if (inflated_size != expected_size || libdeflate_crc32(0, dest, inflated_size) != unpack_uint32(footer)) {
+        return -1;
+    }
+
+    return inflated_size;
+}
+
+bool bgzf_inflate_uses_libdeflate() {
+    return true;
+}
+
+/// Deleter for thread-local libdeflate compressors
+struct LibdeflateCompressorDeleter {
+    void operator()(libdeflate_compressor* compressor) const {
+        libdeflate_free_compressor(compressor);
+    }
+};
+
+int64_t bgzf_deflate_block(const void* data, size_t length, void* dest, size_t dest_capacity, int level) {
+    if (level == 0) {
+        // Not all libdeflate versions can do level 0, and there's nothing to
+        // do anyway.
+        return store_block(data, length, dest, dest_capacity, libdeflate_crc32(0, data, length));
+    }
+    if (level < 0) {
+        // Use zlib's default level
+        level = 6;
+    }
+
+    // Compressors are specific to a level, so keep one per thread and remake
+    // it if the level changes.
+    thread_local unique_ptr<libdeflate_compressor, LibdeflateCompressorDeleter> compressor;
+    thread_local int compressor_level = -1;
+    if (!compressor || compressor_level != level) {
+        compressor.reset(libdeflate_alloc_compressor(level));
+        compressor_level = level;
+        if (!compressor) {
+            return -1;
+        }
+    }
+
+    if (dest_capacity < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+        return -1;
+    }
+    unsigned char* bytes = (unsigned char*) dest;
+    size_t deflated_size = libdeflate_deflate_compress(compressor.get(), data, length, bytes + BGZF_HEADER_SIZE,
+                                                       dest_capacity - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE);
+    if (deflated_size == 0) {
+        // It didn't fit
+        return -1;
+    }
+
+    return frame_block(bytes, deflated_size, libdeflate_crc32(0, data, length), length);
+}
+
+#else
+
+/// Holder for a thread-local raw-deflate zlib stream
+struct ZlibInflater {
+    z_stream stream;
+    bool ready;
+
+    ZlibInflater() : stream(), ready(false) {
+        // Negative window bits means raw deflate data with no zlib or gzip wrapper.
+        ready = (inflateInit2(&stream, -15) == Z_OK);
+    }
+
+    ~ZlibInflater() {
+        if (ready) {
+            inflateEnd(&stream);
+        }
+    }
+};
+
+int64_t bgzf_inflate_block(const void* block, size_t block_size, void* dest, size_t dest_capacity) {
+    // Keep one stream per thread so we only pay for setup once.
+    thread_local ZlibInflater inflater;
+    if (!inflater.ready || inflateReset(&inflater.stream) != Z_OK) {
+        return -1;
+    }
+
+    const unsigned char* bytes = (const unsigned char*) block;
+    const unsigned char* footer = bytes + block_size - BGZF_FOOTER_SIZE;
+    size_t expected_size = unpack_uint32(footer + 4);
+    if (expected_size > dest_capacity) {
+        return -1;
+    }
+
+    // Inflate the whole block in one call. zlib refuses a null output
+    // buffer even when there is nothing to write, as for the EOF block.
+    Bytef nowhere;
+    inflater.stream.next_in = (Bytef*) (bytes + BGZF_HEADER_SIZE);
+    inflater.stream.avail_in = block_size - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    inflater.stream.next_out = dest == nullptr ? &nowhere : (Bytef*) dest;
+    inflater.stream.avail_out = dest_capacity;
+    if (inflate(&inflater.stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+
+    size_t inflated_size = inflater.stream.total_out;
+    if (inflated_size != expected_size || crc32(crc32(0L, Z_NULL, 0), (const Bytef*) dest, inflated_size) != unpack_uint32(footer)) {
+        return -1;
+    }
+
+    return inflated_size;
+}
+
+bool bgzf_inflate_uses_libdeflate() {
+    return false;
+}
+
+/// Holder for a thread-local raw-deflate zlib stream at a particular level
+struct ZlibDeflater {
+    z_stream stream;
+    bool ready;
+    int level;
+
+    ZlibDeflater() : stream(), ready(false), level(0) {
+        // Nothing to do until we know the level
+    }
+
+    /// Make sure the stream is set up for the given level and ready for a new
+    /// block. Returns false if that can't be done.
+    bool reset(int new_level) {
+        if (ready && level == new_level) {
+            return deflateReset(&stream) == Z_OK;
+        }
+        if (ready) {
+            deflateEnd(&stream);
+        }
+        // Negative window bits means raw deflate data with no zlib or gzip
+        // wrapper. These are the settings htslib uses.
+        ready = (deflateInit2(&stream, new_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+        level = new_level;
+        return ready;
+    }
+
+    ~ZlibDeflater() {
+        if (ready) {
+            deflateEnd(&stream);
+        }
+    }
+};
+
+int64_t bgzf_deflate_block(const void* data, size_t length, void* dest, size_t dest_capacity, int level) {
+    if (level == 0) {
+        // There's nothing to compress, so skip zlib and just copy.
+        return store_block(data, length, dest, dest_capacity, crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data, length));
+    }
+
+    // Keep one stream per thread so we only pay for setup once.
+    thread_local ZlibDeflater deflater;
+    if (!deflater.reset(level)) {
+        return -1;
+    }
+
+    if (dest_capacity < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+        return -1;
+    }
+    unsigned char* bytes = (unsigned char*) dest;
+
+    // Deflate the whole block in one call
+    deflater.stream.next_in = (Bytef*) data;
+    deflater.stream.avail_in = length;
+    deflater.stream.next_out = (Bytef*) (bytes + BGZF_HEADER_SIZE);
+    deflater.stream.avail_out = dest_capacity - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    if (deflate(&deflater.stream, Z_FINISH) != Z_STREAM_END) {
+        // It didn't fit, or something went wrong.
+        return -1;
+    }
+
+    return frame_block(bytes, deflater.stream.total_out, crc32(crc32(0L, Z_NULL, 0), (const Bytef*) data, length), length);
+}
+
+#endif
+
+}
+
+}
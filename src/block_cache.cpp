@@ -0,0 +1,115 @@
+/**
+ * \file block_cache.cpp
+ * Implementations for the shared decompressed BGZF block cache.
+ */
+
+#include "vg/io/block_cache.hpp"
+
+#include <functional>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+bool BlockCache::FileKey::operator==(const FileKey& other) const {
+    return device == other.device && inode == other.inode;
+}
+
+bool BlockCache::BlockKey::operator==(const BlockKey& other) const {
+    return file == other.file && address == other.address;
+}
+
+size_t BlockCache::BlockKeyHash::operator()(const BlockKey& key) const {
+    // Mix the parts together, boost::hash_combine style.
+    size_t hash = std::hash<int64_t>()(key.address);
+    hash ^= std::hash<uint64_t>()(key.file.inode) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= std::hash<uint64_t>()(key.file.device) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+BlockCache::BlockCache(size_t max_bytes) : max_bytes(max_bytes), held_bytes(0), hit_count(0), miss_count(0) {
+    // Nothing to do
+}
+
+shared_ptr<InflatedBlock> BlockCache::find(const FileKey& file, int64_t address) {
+    lock_guard<mutex> lock(cache_mutex);
+
+    auto found = index.find(BlockKey {file, address});
+    if (found == index.end()) {
+        miss_count++;
+        return nullptr;
+    }
+
+    hit_count++;
+    // Move it to the front of the recency list. Iterators stay valid.
+    recency.splice(recency.begin(), recency, found->second);
+    return found->second->second;
+}
+
+void BlockCache::insert(const FileKey& file, const shared_ptr<InflatedBlock>& block) {
+    if (block->data.size() > max_bytes) {
+        // This would evict everything else and then itself.
+        return;
+    }
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    BlockKey key {file, block->address};
+    auto found = index.find(key);
+    if (found != index.end()) {
+        // Someone else cached this block already. Replace it with ours, since
+        // it is just as good and is what our caller is using.
+        held_bytes -= found->second->second->data.size();
+        recency.erase(found->second);
+        index.erase(found);
+    }
+
+    recency.emplace_front(key, block);
+    index.emplace(key, recency.begin());
+    held_bytes += block->data.size();
+
+    evict();
+}
+
+size_t BlockCache::size_bytes() const {
+    lock_guard<mutex> lock(cache_mutex);
+    return held_bytes;
+}
+
+size_t BlockCache::max_size_bytes() const {
+    return max_bytes;
+}
+
+size_t BlockCache::hits() const {
+    lock_guard<mutex> lock(cache_mutex);
+    return hit_count;
+}
+
+size_t BlockCache::misses() const {
+    lock_guard<mutex> lock(cache_mutex);
+    return miss_count;
+}
+
+void BlockCache::clear() {
+    lock_guard<mutex> lock(cache_mutex);
+    recency.clear();
+    index.clear();
+    held_bytes = 0;
+}
+
+void BlockCache::evict() {
+    while (held_bytes > max_bytes && !recency.empty()) {
+        // Readers may still be holding on to the block; it will be freed
+        // when they let go.
+        auto& victim = recency.back();
+        held_bytes -= victim.second->data.size();
+        index.erase(victim.first);
+        recency.pop_back();
+    }
+}
+
+}
+
+}
@@ -1,9 +1,21 @@
 #include "vg/io/blocked_gzip_input_stream.hpp"
+#include "vg/io/bgzf_block.hpp"
+#include "vg/io/parallel_block_inflater.hpp"
+#include "vg/io/block_cache.hpp"
+#include "vg/io/fdstream.hpp"
 #include "vg/io/hfile_cppstream.hpp"
+#include "vg/io/hfile_fd.hpp"
 #include "vg/io/hfile_internal.hpp"
 
 #include <htslib/bgzf.h>
+#include <algorithm>
 #include <iostream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace vg {
 
@@ -11,8 +23,20 @@ namespace io {
 
 using namespace std;
 
+// Provide the static values a compilation unit to live in.
+const size_t BlockedGzipInputStream::DEFAULT_READ_AHEAD_BYTES;
+
+#ifdef VGIO_USE_LIBDEFLATE
+// When we have libdeflate, it is much faster than htslib's zlib inflate.
+atomic<BlockedGzipInputStream::InflateMode> BlockedGzipInputStream::default_inflate_mode(BlockedGzipInputStream::InflateMode::WHOLE_BLOCK);
+#else
+atomic<BlockedGzipInputStream::InflateMode> BlockedGzipInputStream::default_inflate_mode(BlockedGzipInputStream::InflateMode::HTSLIB);
+#endif
+
 BlockedGzipInputStream::BlockedGzipInputStream(std::istream& stream) : handle(nullptr), byte_count(0),
-    know_offset(false) {
+    know_offset(false), inflate_mode(default_inflate_mode.load()), mapped_data(nullptr),
+    mapped_size(0), mapped_cursor(0), know_file(false), file_device(0), file_inode(0), block_data(nullptr),
+    block_data_address(-1) {
     
     // See where the stream is
     stream.clear();
@@ -30,6 +54,7 @@ BlockedGzipInputStream::BlockedGzipInputStream(std::istream& stream) : handle(nu
     if (handle == nullptr) {
         throw runtime_error("Unable to set up BGZF library on wrapped stream");
     }
+    block_data = (const char*) handle->uncompressed_block;
     
     if (file_start >= 0 && good && (bgzf_compression(handle) == 2 || bgzf_compression(handle) == 0)) {
         // The stream we are wrapping is seekable, and the data is block-compressed or uncompressed
@@ -44,11 +69,85 @@ BlockedGzipInputStream::BlockedGzipInputStream(std::istream& stream) : handle(nu
         // Remember the virtual offsets will be valid
         know_offset = true;
     }
+    
+    fdinbuf* fd_buffer = dynamic_cast<fdinbuf*>(stream.rdbuf());
+    struct stat file_info;
+    if (fd_buffer != nullptr && fstat(fd_buffer->file_descriptor(), &file_info) == 0 && S_ISREG(file_info.st_mode)) {
+        // We are reading a real file we can identify.
+        know_file = true;
+        file_device = file_info.st_dev;
+        file_inode = file_info.st_ino;
+    }
+}
+
+BlockedGzipInputStream::BlockedGzipInputStream(const std::string& filename) : handle(nullptr), byte_count(0),
+    know_offset(false), inflate_mode(default_inflate_mode.load()), mapped_data(nullptr),
+    mapped_size(0), mapped_cursor(0), know_file(false), file_device(0), file_inode(0), block_data(nullptr),
+    block_data_address(-1) {
+    
+    // Open the file on a file descriptor, bypassing C++ streams. We open it
+    // only once, so that the BGZF reader and the memory mapping are
+    // guaranteed to see the same file.
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw runtime_error("Unable to open " + filename);
+    }
+    
+    struct stat file_info;
+    bool is_regular = fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode);
+    
+    // The hFILE owns the descriptor from here on, and keeps it open until the
+    // BGZF is closed.
+    hFILE* wrapped = hfile_wrap_fd(fd, "r", true);
+    if (wrapped == nullptr) {
+        close(fd);
+        throw runtime_error("Unable to open " + filename);
+    }
+    
+    // Let htslib sniff the compression type.
+    handle = bgzf_hopen(wrapped, "r");
+    if (handle == nullptr) {
+        hclose_abruptly(wrapped);
+        throw runtime_error("Unable to open " + filename + " with BGZF library");
+    }
+    block_data = (const char*) handle->uncompressed_block;
+    
+    if (is_regular) {
+        // This is a real file, so we are at offset 0 and can seek around.
+        if (bgzf_compression(handle) == 2 || bgzf_compression(handle) == 0) {
+            // And the virtual offsets mean something.
+            know_offset = true;
+        }
+        
+        know_file = true;
+        file_device = file_info.st_dev;
+        file_inode = file_info.st_ino;
+        
+        if (IsBGZF() && file_info.st_size > 0) {
+            // We can read the blocks straight out of memory.
+            void* mapping = mmap(nullptr, file_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                // Most reads are front to back.
+                madvise(mapping, file_info.st_size, MADV_SEQUENTIAL);
+                mapped_data = (const char*) mapping;
+                mapped_size = file_info.st_size;
+            }
+            // If the mapping fails we can still read through the hFILE.
+        }
+    }
 }
 
 BlockedGzipInputStream::~BlockedGzipInputStream() {
+    // Stop any decompression threads
+    inflater.reset();
+    
     // Close the BGZF
     bgzf_close(handle);
+    
+    if (mapped_data != nullptr) {
+        // Drop the memory mapping
+        munmap((void*) mapped_data, mapped_size);
+    }
 }
 
 bool BlockedGzipInputStream::Next(const void** data, int* size) {
@@ -60,8 +159,8 @@ bool BlockedGzipInputStream::Next(const void** data, int* size) {
         // care, because if we back up by X bytes we always re-read the last X
         // bytes of the block.
     
-        // Return the unread part of the BGZF file's buffer
-        *data = (void*)((char*)handle->uncompressed_block + handle->block_offset);
+        // Return the unread part of the block's buffer
+        *data = (void*)(block_data + handle->block_offset);
         *size = handle->block_length - handle->block_offset;
         
         // Send the offset to the end of the block again
@@ -97,7 +196,7 @@ bool BlockedGzipInputStream::Next(const void** data, int* size) {
 #endif
         
         // Make the BGZF read the next block
-        if (bgzf_read_block(handle) != 0) {
+        if (read_block() != 0) {
             // We have encountered an error
             
 #ifdef debug
@@ -142,7 +241,7 @@ bool BlockedGzipInputStream::Next(const void** data, int* size) {
         }
         
         // Send out the address and size, accounting for seek offset
-        *data = (void*)((char*)handle->uncompressed_block + handle->block_offset);
+        *data = (void*)(block_data + handle->block_offset);
         *size = handle->block_length - handle->block_offset;
         
         // Record the bytes read
@@ -174,8 +273,18 @@ void BlockedGzipInputStream::BackUp(int count) {
 }
 
 bool BlockedGzipInputStream::Skip(int count) {
-    // We just implement this in terms of next and back up. There's not really
-    // a more efficient way, since we can't do relative seeks.
+    if (inflater || handle->mt != nullptr || !IsBGZF()) {
+        // Either decompression is already happening ahead of us, so skipping
+        // through the decompressed blocks is cheap, or we can't tell where
+        // the blocks are without decompressing.
+        return skip_by_reading(count);
+    }
+    
+    return skip_by_headers(count);
+}
+
+bool BlockedGzipInputStream::skip_by_reading(int count) {
+    // We just implement this in terms of next and back up.
     
     // We have to support this happening immediately after a seek.
     
@@ -204,6 +313,100 @@ bool BlockedGzipInputStream::Skip(int count) {
     
 }
 
+bool BlockedGzipInputStream::skip_by_headers(int count) {
+    if (count <= 0) {
+        return true;
+    }
+    
+    if (handle->block_length != 0 && handle->block_offset < handle->block_length) {
+        // Use up whatever is left of the current block first. It has already
+        // been counted in byte_count.
+        int used = std::min(count, handle->block_length - handle->block_offset);
+        handle->block_offset += used;
+        handle->uncompressed_address += used;
+        count -= used;
+    }
+    
+    // If we just did a seek, we are supposed to start this far into the first block.
+    int start_offset = (handle->block_length == 0) ? handle->block_offset : 0;
+    
+    while (count > 0) {
+        if (handle->errcode) {
+            // Don't read past an error.
+            return false;
+        }
+        
+        // Get the next block without inflating it
+        const char* compressed;
+        size_t block_size;
+        int64_t block_address;
+        int status = fetch_compressed_block(&compressed, &block_size, &block_address);
+        if (status == 0) {
+            // We hit EOF
+            handle->block_length = 0;
+            return false;
+        } else if (status < 0) {
+            return false;
+        }
+        
+        // The footer tells us how much data the block holds.
+        int block_length = bgzf_block_uncompressed_size(compressed, block_size);
+        if (block_length > BGZF_MAX_BLOCK_SIZE) {
+            handle->errcode |= BGZF_ERR_HEADER;
+            return false;
+        }
+        if (block_length == 0) {
+            // Empty blocks don't count.
+            continue;
+        }
+        if (start_offset > block_length) {
+            // We can't fulfill the most recent seek.
+            handle->errcode |= BGZF_ERR_MISUSE;
+            return false;
+        }
+        
+        // Count it as read
+        int available = block_length - start_offset;
+        byte_count += available;
+        
+        if (count >= available) {
+            // Skip the whole block. Leave the BGZF looking like we read to
+            // the end of it, so the next read goes to the next block.
+#ifdef debug
+            cerr << "Skip " << available << " bytes in block at " << block_address << " without inflating" << endl;
+#endif
+            handle->block_address = block_address;
+            handle->block_length = block_length;
+            handle->block_clength = block_size;
+            handle->block_offset = block_length;
+            handle->uncompressed_address += available;
+            // But we don't actually have its data.
+            block_data_address = -1;
+            count -= available;
+        } else {
+            // The skip lands in this block, so we need its data.
+            int64_t inflated = bgzf_inflate_block(compressed, block_size, handle->uncompressed_block, BGZF_MAX_BLOCK_SIZE);
+            if (inflated != block_length) {
+                handle->errcode |= BGZF_ERR_ZLIB;
+                return false;
+            }
+            block_data = (const char*) handle->uncompressed_block;
+            install_block(block_address, block_size, block_length);
+            handle->block_offset = start_offset + count;
+            handle->uncompressed_address += count;
+#ifdef debug
+            cerr << "Skip lands at " << handle->block_offset << " in block at " << block_address << endl;
+#endif
+            count = 0;
+        }
+        
+        // Later blocks start at the start.
+        start_offset = 0;
+    }
+    
+    return true;
+}
+
 int64_t BlockedGzipInputStream::ByteCount() const {
     return byte_count;
 }
@@ -220,7 +423,7 @@ int64_t BlockedGzipInputStream::Tell() const {
             
             // We don't have bgzf_htell so we fake it.
             // We also manually shift the block address to the right place 
-            return htell(handle->fp) << 16;
+            return next_block_address() << 16;
             
         } else {
             // Since we use the BGZF's internal cursor correctly, we can rely on its tell function.
@@ -239,10 +442,47 @@ bool BlockedGzipInputStream::Seek(int64_t virtual_offset) {
         return false;
     }
     
+    if (IsBGZF() && handle->block_length != 0 && (virtual_offset >> 16) == handle->block_address &&
+        handle->block_address == block_data_address && (virtual_offset & 0xFFFF) <= handle->block_length) {
+        // We are seeking within the block we already have, and the next read
+        // after it will be of the block after it, so there's no need to load
+        // it again. Just move the cursor.
+#ifdef debug
+        cerr << "Seek to " << (virtual_offset & 0xFFFF) << " in already-loaded block at " << handle->block_address << endl;
+#endif
+        handle->block_offset = virtual_offset & 0xFFFF;
+        return true;
+    }
+    
+    if (mapped_data != nullptr) {
+        // We can seek just by moving our cursor and setting up the BGZF the
+        // way bgzf_seek() would.
+        int64_t block_address = virtual_offset >> 16;
+        if (block_address > (int64_t) mapped_size) {
+            std::cerr << "error[vg::BlockedGzipInputStream]: cannot seek to block at " << block_address
+                      << " past end of " << mapped_size << " byte file" << std::endl;
+            return false;
+        }
+        mapped_cursor = block_address;
+        handle->block_address = block_address;
+        handle->block_offset = virtual_offset & 0xFFFF;
+        // This means we need to read the block when we read next.
+        handle->block_length = 0;
+        if (inflater) {
+            // Throw out the read-ahead and start from here.
+            inflater->reset(block_address);
+        }
+        return true;
+    }
+    
     // Do the seek.
     // This will set handle->block_length to 0, so we know we need to read the block when we read next.
     if(bgzf_seek(handle, virtual_offset, SEEK_SET) == 0) {
         // The seek succeeded
+        if (inflater) {
+            // Throw out the read-ahead and start from here.
+            inflater->reset(virtual_offset >> 16);
+        }
         return true;
     } else {
         // The seek failed
@@ -261,8 +501,318 @@ bool BlockedGzipInputStream::IsBGZF() const {
     return handle->is_compressed && !handle->is_gzip;
 }
 
-bool BlockedGzipInputStream::EnableMultiThreading(size_t thread_count) {
-    return bgzf_mt(handle, thread_count, 256) == 0;
+bool BlockedGzipInputStream::EnableMultiThreading(size_t thread_count, size_t read_ahead_bytes) {
+    if (inflater) {
+        // Already done
+        return true;
+    }
+    
+    if (mapped_data != nullptr || IsBGZF()) {
+        // We can find the blocks ourselves and inflate them in parallel,
+        // keeping track of exactly where each one came from.
+        
+        // Work out where the next block to read is, before the inflater starts reading.
+        int64_t start_address = next_block_address();
+        
+        try {
+            inflater.reset(new ParallelBlockInflater([this](const char** block, size_t* block_size, int64_t* block_address) {
+                return fetch_compressed_block(block, block_size, block_address);
+            }, start_address, thread_count, read_ahead_bytes));
+        } catch (std::system_error& e) {
+            // We couldn't start the threads.
+            inflater.reset();
+            return false;
+        }
+        return true;
+    }
+    
+    // Otherwise, htslib has to deal with the decompression.
+    // Allow about as much read-ahead as we would have, in blocks.
+    size_t read_ahead_blocks = std::max<size_t>(1, read_ahead_bytes / BGZF_MAX_BLOCK_SIZE);
+    return bgzf_mt(handle, thread_count, read_ahead_blocks) == 0;
+}
+
+void BlockedGzipInputStream::SetInflateMode(InflateMode mode) {
+    inflate_mode = mode;
+}
+
+auto BlockedGzipInputStream::GetInflateMode() const -> InflateMode {
+    return inflate_mode;
+}
+
+void BlockedGzipInputStream::SetDefaultInflateMode(InflateMode mode) {
+    default_inflate_mode.store(mode);
+}
+
+auto BlockedGzipInputStream::GetDefaultInflateMode() -> InflateMode {
+    return default_inflate_mode.load();
+}
+
+bool BlockedGzipInputStream::SetBlockCache(const shared_ptr<BlockCache>& cache) {
+    if (cache && !know_file) {
+        // We could be mistaken for some other file's stream.
+        block_cache.reset();
+        return false;
+    }
+    block_cache = cache;
+    return true;
+}
+
+shared_ptr<BlockCache> BlockedGzipInputStream::GetBlockCache() const {
+    return block_cache;
+}
+
+int BlockedGzipInputStream::read_block() {
+    if (inflater) {
+        // Blocks are being decompressed in parallel.
+        return read_inflated_block();
+    }
+    
+    // Otherwise the block will be in the BGZF's buffer. But htslib's threads
+    // can swap the buffer out from under us, so we have to look each time.
+    block_data = (const char*) handle->uncompressed_block;
+    
+    bool use_cache = block_cache && know_offset;
+    if (mapped_data != nullptr || ((inflate_mode == InflateMode::WHOLE_BLOCK || use_cache) && handle->mt == nullptr && IsBGZF())) {
+        // We can do the read ourselves and inflate the whole block at once.
+        // We have to if the data is in a mapping that htslib doesn't know
+        // about, or if blocks need to go in and out of the cache.
+        return read_whole_block();
+    }
+    
+    // Otherwise let htslib handle it, since it knows about GZIP members,
+    // uncompressed data, and its own thread pool.
+    int status = bgzf_read_block(handle);
+    block_data = (const char*) handle->uncompressed_block;
+    block_data_address = (status == 0 && handle->block_length != 0) ? handle->block_address : -1;
+    return status;
+}
+
+int BlockedGzipInputStream::read_inflated_block() {
+    if (handle->errcode) {
+        // Don't read past an error.
+        return -1;
+    }
+    
+    while (true) {
+        shared_ptr<InflatedBlock> block;
+        int status = inflater->next(block);
+        if (status == 0) {
+            // We hit EOF
+            handle->block_length = 0;
+            return 0;
+        } else if (status < 0) {
+            handle->errcode |= BGZF_ERR_ZLIB;
+            return -1;
+        }
+        
+        handle->last_block_eof = block->data.empty();
+        if (block->data.empty()) {
+            // Skip empty blocks, like htslib does.
+            continue;
+        }
+        
+        // Hold on to the block so its buffer is valid while we are reading from it.
+        current_block = std::move(block);
+        block_data = current_block->data.data();
+        install_block(current_block->address, current_block->compressed_size, current_block->data.size());
+        return 0;
+    }
+}
+
+void BlockedGzipInputStream::install_block(int64_t block_address, size_t compressed_size, size_t length) {
+    if (handle->block_length != 0) {
+        // Don't reset the offset if this read follows a seek.
+        handle->block_offset = 0;
+    }
+    handle->block_address = block_address;
+    handle->block_length = length;
+    handle->block_clength = compressed_size;
+    block_data_address = block_address;
+}
+
+int BlockedGzipInputStream::fetch_compressed_block(const char** block, size_t* block_size, int64_t* block_address) {
+    if (mapped_data != nullptr) {
+        // Find the block in the mapping
+        *block_address = mapped_cursor;
+        if (mapped_cursor == (int64_t) mapped_size) {
+            // We hit EOF cleanly
+            return 0;
+        }
+        if (mapped_size - mapped_cursor < BGZF_HEADER_SIZE) {
+            handle->errcode |= BGZF_ERR_HEADER;
+            return -1;
+        }
+        *block = mapped_data + mapped_cursor;
+        *block_size = bgzf_block_size(*block);
+        if (*block_size == 0) {
+            // This isn't a BGZF block header
+            handle->errcode |= BGZF_ERR_HEADER;
+            return -1;
+        }
+        if (*block_size > mapped_size - mapped_cursor) {
+            // The block is truncated
+            handle->errcode |= BGZF_ERR_IO;
+            return -1;
+        }
+        mapped_cursor += *block_size;
+        return 1;
+    }
+    
+    // Otherwise, read it from the hFILE. We can use the BGZF's compressed
+    // block buffer as scratch space, since htslib isn't doing any reading
+    // with it.
+    char* compressed = (char*) handle->compressed_block;
+    *block = compressed;
+    
+    // Remember where the block starts
+    *block_address = htell(handle->fp);
+    
+    // Read the header
+    ssize_t count = hread(handle->fp, compressed, BGZF_HEADER_SIZE);
+    if (count == 0) {
+        // We hit EOF cleanly
+        return 0;
+    }
+    if (count != BGZF_HEADER_SIZE) {
+        handle->errcode |= BGZF_ERR_HEADER;
+        return -1;
+    }
+    
+    *block_size = bgzf_block_size(compressed);
+    if (*block_size == 0) {
+        // This isn't a BGZF block header
+        handle->errcode |= BGZF_ERR_HEADER;
+        return -1;
+    }
+    
+    // Read the rest of the block
+    size_t remaining = *block_size - BGZF_HEADER_SIZE;
+    count = hread(handle->fp, compressed + BGZF_HEADER_SIZE, remaining);
+    if (count < 0 || (size_t) count != remaining) {
+        handle->errcode |= BGZF_ERR_IO;
+        return -1;
+    }
+    
+    return 1;
+}
+
+int BlockedGzipInputStream::read_whole_block() {
+    if (handle->errcode) {
+        // Don't read past an error.
+        return -1;
+    }
+    
+    bool use_cache = block_cache && know_offset;
+    BlockCache::FileKey file {file_device, file_inode};
+    
+    while (true) {
+        if (use_cache) {
+            // Maybe someone already inflated the next block.
+            int64_t next_address = next_block_address();
+            shared_ptr<InflatedBlock> cached = block_cache->find(file, next_address);
+            if (cached) {
+#ifdef debug
+                cerr << "Whole-block read found " << cached->data.size() << " bytes at " << next_address << " in cache" << endl;
+#endif
+                // Carry on from after it, as if we had read it.
+                if (!seek_source(next_address + cached->compressed_size)) {
+                    return -1;
+                }
+                // Only non-empty blocks are cached.
+                handle->last_block_eof = false;
+                current_block = std::move(cached);
+                block_data = current_block->data.data();
+                install_block(current_block->address, current_block->compressed_size, current_block->data.size());
+                return 0;
+            }
+        }
+    
+        const char* compressed;
+        size_t block_size;
+        int64_t block_address;
+        
+        int status = fetch_compressed_block(&compressed, &block_size, &block_address);
+        if (status == 0) {
+            // We hit EOF
+#ifdef debug
+            cerr << "Whole-block read hit EOF at " << block_address << endl;
+#endif
+            handle->block_length = 0;
+            return 0;
+        } else if (status < 0) {
+            return -1;
+        }
+        
+        // Work out where to put the data. Usually it goes in the BGZF's
+        // buffer.
+        char* dest = (char*) handle->uncompressed_block;
+        size_t dest_capacity = BGZF_MAX_BLOCK_SIZE;
+        shared_ptr<InflatedBlock> owned;
+        if (use_cache) {
+            size_t expected_size = bgzf_block_uncompressed_size(compressed, block_size);
+            if (expected_size > 0 && expected_size <= BGZF_MAX_BLOCK_SIZE) {
+                // But if it is going in the cache it needs a buffer of its own.
+                owned = make_shared<InflatedBlock>();
+                owned->address = block_address;
+                owned->compressed_size = block_size;
+                owned->data.resize(expected_size);
+                dest = owned->data.data();
+                dest_capacity = expected_size;
+            }
+        }
+        
+        // Inflate it all in one go
+        int64_t inflated = bgzf_inflate_block(compressed, block_size, dest, dest_capacity);
+        if (inflated < 0) {
+            handle->errcode |= BGZF_ERR_ZLIB;
+            return -1;
+        }
+        
+#ifdef debug
+        cerr << "Whole-block read inflated " << block_size << " bytes at " << block_address << " to " << inflated << " bytes" << endl;
+#endif
+        
+        handle->last_block_eof = (inflated == 0);
+        if (inflated == 0) {
+            // This is an empty block (like an EOF marker in the middle of the
+            // file). Skip it, like htslib does.
+            continue;
+        }
+        
+        if (owned) {
+            // Share it with everyone else reading the file.
+            block_cache->insert(file, owned);
+            current_block = std::move(owned);
+        }
+        
+        block_data = dest;
+        install_block(block_address, block_size, inflated);
+        return 0;
+    }
+}
+
+int64_t BlockedGzipInputStream::next_block_address() const {
+    if (inflater) {
+        // The inflater has read ahead, so it has to tell us.
+        return inflater->next_address();
+    }
+    if (mapped_data != nullptr) {
+        return mapped_cursor;
+    }
+    return htell(handle->fp);
+}
+
+bool BlockedGzipInputStream::seek_source(int64_t block_address) {
+    if (mapped_data != nullptr) {
+        mapped_cursor = block_address;
+        return true;
+    }
+    if (hseek(handle->fp, block_address, SEEK_SET) < 0) {
+        handle->errcode |= BGZF_ERR_IO;
+        return false;
+    }
+    return true;
 }
 
 bool BlockedGzipInputStream::SmellsLikeGzip(std::istream& in) {
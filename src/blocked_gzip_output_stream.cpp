@@ -1,8 +1,12 @@
 #include "vg/io/blocked_gzip_output_stream.hpp"
+#include "vg/io/parallel_block_deflater.hpp"
 #include "vg/io/hfile_cppstream.hpp"
+#include "vg/io/hfile_fd.hpp"
 #include "vg/io/hfile_internal.hpp"
 
 #include <htslib/bgzf.h>
+#include <algorithm>
+#include <system_error>
 
 namespace vg {
 
@@ -10,15 +14,29 @@ namespace io {
 
 using namespace std;
 
-BlockedGzipOutputStream::BlockedGzipOutputStream(BGZF* bgzf_handle) :
-    handle(bgzf_handle), wrapped_ostream(nullptr), 
-    buffer(), backed_up(0), byte_count(0),
-    know_offset(false), end_file(false) {
+// Provide the static values a compilation unit to live in.
+const size_t BlockedGzipOutputStream::DEFAULT_COMPRESSION_QUEUE_BYTES;
+const size_t BlockedGzipOutputStream::DEFAULT_WRITE_BEHIND_BYTES;
+
+/// Work out the htslib mode string for writing at the given compression
+/// level, or throw if the level is out of range.
+static string bgzf_write_mode(int compression_level) {
+    if (compression_level < -1 || compression_level > 9) {
+        throw runtime_error("Invalid BGZF compression level " + to_string(compression_level));
+    }
     
-    if (handle->mt) {
-        // I don't want to deal with BGZF multithreading, because I'm going to be hacking its internals
-        throw runtime_error("Multithreaded BGZF is not supported");
+    // A digit sets the level.
+    string mode = "w";
+    if (compression_level >= 0) {
+        mode.push_back('0' + compression_level);
     }
+    return mode;
+}
+
+BlockedGzipOutputStream::BlockedGzipOutputStream(BGZF* bgzf_handle) :
+    handle(bgzf_handle), wrapped_ostream(nullptr), 
+    buffer(), handed_out(0), backed_up(0), byte_count(0),
+    know_offset(false), end_file(false), pending_length(0), deflater_start_address(0) {
     
     // Force the BGZF to start a new block by flushing the old one, if it exists.
     if (bgzf_flush(handle) != 0) {
@@ -41,18 +59,26 @@ BlockedGzipOutputStream::BlockedGzipOutputStream(BGZF* bgzf_handle) :
     }
 }
 
-BlockedGzipOutputStream::BlockedGzipOutputStream(std::ostream& stream) :
+BlockedGzipOutputStream::BlockedGzipOutputStream(std::ostream& stream, int compression_level) :
     handle(nullptr),  wrapped_ostream(hfile_wrap(stream)),
-    buffer(), backed_up(0), byte_count(0),
-    know_offset(false), end_file(false) {
+    buffer(), handed_out(0), backed_up(0), byte_count(0),
+    know_offset(false), end_file(false), pending_length(0), deflater_start_address(0) {
     
     // Make sure we could wrap the stream in an hFILE*
     if (wrapped_ostream == nullptr) {
         throw runtime_error("Unable to wrap stream");
     }
     
+    string mode;
+    try {
+        mode = bgzf_write_mode(compression_level);
+    } catch (runtime_error& e) {
+        hclose_abruptly(wrapped_ostream);
+        throw;
+    }
+    
     // Give ownership of it to a BGZF that writes, which we in turn own.
-    handle = bgzf_hopen(wrapped_ostream, "w");
+    handle = bgzf_hopen(wrapped_ostream, mode.c_str());
     if (handle == nullptr) {
         throw runtime_error("Unable to set up BGZF library on wrapped stream");
     }
@@ -74,6 +100,35 @@ BlockedGzipOutputStream::BlockedGzipOutputStream(std::ostream& stream) :
     }
 }
 
+BlockedGzipOutputStream::BlockedGzipOutputStream(const std::string& filename, int compression_level) :
+    handle(nullptr),  wrapped_ostream(nullptr),
+    buffer(), handed_out(0), backed_up(0), byte_count(0),
+    know_offset(false), end_file(false), pending_length(0), deflater_start_address(0) {
+    
+    string mode = bgzf_write_mode(compression_level);
+    
+    // Open the file on a file descriptor, bypassing C++ streams.
+    wrapped_ostream = hfile_open_path(filename, "w");
+    if (wrapped_ostream == nullptr) {
+        throw runtime_error("Unable to open " + filename);
+    }
+    
+    // Give ownership of it to a BGZF that writes, which we in turn own.
+    handle = bgzf_hopen(wrapped_ostream, mode.c_str());
+    if (handle == nullptr) {
+        hclose_abruptly(wrapped_ostream);
+        throw runtime_error("Unable to set up BGZF library on " + filename);
+    }
+    
+    auto file_start = (*(wrapped_ostream->backend->seek))(wrapped_ostream, 0, SEEK_CUR);
+    if (file_start >= 0) {
+        // This is a real file, which we just truncated, rather than something
+        // like /dev/stdout.
+        handle->block_address = file_start;
+        know_offset = true;
+    }
+}
+
 BlockedGzipOutputStream::~BlockedGzipOutputStream() {
 
 #ifdef debug
@@ -83,6 +138,9 @@ BlockedGzipOutputStream::~BlockedGzipOutputStream() {
     // Make sure to finish writing before destructing.
     Flush();
     
+    // Stop any compression threads
+    deflater.reset();
+    
     if (end_file) {
         // Close the file with an EOF block.
 #ifdef debug
@@ -107,23 +165,34 @@ BlockedGzipOutputStream::~BlockedGzipOutputStream() {
 
 bool BlockedGzipOutputStream::Next(void** data, int* size) {
     try {
-        // Dump data if we have it, but stay in the current BGZF block.
+        // Commit data if we have it, but stay in the current BGZF block.
         flush_self();
         
-        // Allocate some space in the buffer
-        buffer.resize(4096);
+        if (deflater) {
+            // Hand out the rest of the block we are filling for the compression threads.
+            *data = (void*)(pending_block.data() + pending_length);
+            *size = BGZF_BLOCK_SIZE - pending_length;
+        } else if (writes_in_place()) {
+            // Hand out the rest of the BGZF's own block buffer, so data is
+            // written right where it will be compressed from. flush_self()
+            // never leaves it full.
+            *data = (void*)((char*) handle->uncompressed_block + handle->block_offset);
+            *size = BGZF_BLOCK_SIZE - handle->block_offset;
+        } else {
+            // Allocate some space in the buffer, to copy in with bgzf_write().
+            buffer.resize(4096);
+            *data = (void*)&buffer[0];
+            *size = buffer.size();
+        }
         
 #ifdef debug
-        cerr << "Allocate buffer of " << buffer.size() << " bytes " << endl;
+        cerr << "Hand out buffer of " << *size << " bytes " << endl;
 #endif
         
         // None of it is backed up
+        handed_out = *size;
         backed_up = 0;
         
-        // Tell the caller where to write
-        *data = (void*)&buffer[0];
-        *size = buffer.size();
-        
         // It worked
         return true;
         
@@ -134,10 +203,10 @@ bool BlockedGzipOutputStream::Next(void** data, int* size) {
 
 void BlockedGzipOutputStream::BackUp(int count) {
     backed_up += count;
-    assert(backed_up <= buffer.size());
+    assert(backed_up <= handed_out);
     
 #ifdef debug
-    cerr << "Back up " << count << " bytes to " << (buffer.size() - backed_up) << " still written" << endl;
+    cerr << "Back up " << count << " bytes to " << (handed_out - backed_up) << " still written" << endl;
 #endif
 }
 
@@ -165,6 +234,26 @@ int64_t BlockedGzipOutputStream::Tell() {
         // Make sure all data has been sent to BGZF, but stay in the current block
         flush_self();
         
+        if (deflater) {
+            // The block we are filling goes after everything submitted, so
+            // we need to know how big that all is compressed.
+            int64_t compressed_size = deflater->compressed_size();
+            if (compressed_size < 0) {
+                throw runtime_error("IO error compressing data in BlockedGzipOutputStream");
+            }
+            return ((deflater_start_address + compressed_size) << 16) | pending_length;
+        }
+        
+        if (handle->mt != nullptr) {
+            // htslib's threads move the block address around behind our back.
+            // The only way to get a real position is to finish the block and
+            // wait for everything to be written.
+            if (bgzf_flush(handle) != 0) {
+                throw runtime_error("IO error flushing BGZF in BlockedGzipOutputStream");
+            }
+            handle->block_address = htell(handle->fp);
+        }
+        
         // See where we are now. No de-aliasing is necessary; the BGZF never
         // leaves the cursor past the end of the block when writing, so we
         // always have the cannonical virtual offset.
@@ -190,12 +279,74 @@ void BlockedGzipOutputStream::EndFile() {
     end_file = true;
 }
 
-void BlockedGzipOutputStream::Flush() {
+bool BlockedGzipOutputStream::EnableMultiThreading(size_t thread_count, size_t queued_bytes) {
+    if (deflater || handle->mt != nullptr) {
+        // Already done, by us or by htslib
+        return true;
+    }
+    
+    if (!handle->is_compressed) {
+        // There's nothing to do in parallel.
+        return false;
+    }
+    
+    // Get everything already written out of the BGZF and end its block, so
+    // our blocks come after it.
+    flush_self();
+    if (bgzf_flush(handle) != 0) {
+        throw runtime_error("IO error flushing BGZF in BlockedGzipOutputStream");
+    }
+    deflater_start_address = handle->block_address;
+    
+    size_t max_queued_blocks = std::max<size_t>(1, queued_bytes / BGZF_BLOCK_SIZE);
+    try {
+        // Blocks go straight to the hFILE, which only we are writing to now.
+        deflater.reset(new ParallelBlockDeflater([this](const char* block, size_t block_size) {
+            return hwrite(handle->fp, block, block_size) == (ssize_t) block_size;
+        }, thread_count, max_queued_blocks, handle->compress_level));
+    } catch (std::system_error& e) {
+        // We couldn't start the threads.
+        deflater.reset();
+        return false;
+    }
+    
+    pending_block.resize(BGZF_BLOCK_SIZE);
+    pending_length = 0;
+    return true;
+}
+
+bool BlockedGzipOutputStream::EnableWriteBehind(size_t max_queued_bytes) {
+    if (wrapped_ostream == nullptr) {
+        // We don't own the hFILE, so we can't change how it writes.
+        return false;
+    }
+    return hfile_enable_write_behind(wrapped_ostream, max_queued_bytes);
+}
+
+size_t BlockedGzipOutputStream::GetWriteBehindBacklog() const {
+    return wrapped_ostream == nullptr ? 0 : hfile_write_behind_backlog(wrapped_ostream);
+}
+
+size_t BlockedGzipOutputStream::GetWriteBehindStalls() const {
+    return wrapped_ostream == nullptr ? 0 : hfile_write_behind_stalls(wrapped_ostream);
+}
+
+void BlockedGzipOutputStream::Flush(bool barrier) {
     // Send all our data to the BGZF
     flush_self();
 
-    // Actually flush the backing BGZF and end the current block.
-    if (bgzf_flush(handle) != 0) {
+    if (deflater) {
+        // End the current block and wait for everything to be written.
+        if (pending_length > 0) {
+            submit_pending_block();
+        }
+        if (!deflater->flush()) {
+            throw runtime_error("IO error writing compressed data in BlockedGzipOutputStream");
+        }
+        // Keep the BGZF's idea of where it is up to date.
+        handle->block_address = deflater_start_address + deflater->compressed_size();
+    } else if (bgzf_flush(handle) != 0) {
+        // Actually flush the backing BGZF and end the current block.
         // We failed to flush
         throw runtime_error("IO error flushing BGZF in BlockedGzipOutputStream");
     }
@@ -203,36 +354,94 @@ void BlockedGzipOutputStream::Flush() {
     if (wrapped_ostream != nullptr) {
         // We have an hFILE* connecting the bgzf to the user-visible output stream.
         // Right now some of our data is probably in its buffer. Flush it.
-        if (hflush(wrapped_ostream) != 0) {
+        // In write-behind mode, that just queues it, unless we sync.
+        if ((barrier ? hfile_sync(wrapped_ostream) : hflush(wrapped_ostream)) != 0) {
             // We failed to flush
             throw runtime_error("IO error flushing hFILE* in BlockedGzipOutputStream");
         } 
     }
 }
 
+void BlockedGzipOutputStream::EndBlock() {
+    // Send all our data to the block being filled
+    flush_self();
+    
+    if (deflater) {
+        if (pending_length > 0) {
+            submit_pending_block();
+        }
+    } else if (handle->block_offset > 0 && bgzf_flush(handle) != 0) {
+        // Compressing and writing out the block failed.
+        throw runtime_error("IO error ending block in BlockedGzipOutputStream");
+    }
+}
+
 void BlockedGzipOutputStream::flush_self() {
     // How many bytes are left to write?
-    auto outstanding = buffer.size() - backed_up;
+    auto outstanding = handed_out - backed_up;
     if (outstanding > 0) {
 #ifdef debug
         cerr << "Flush " << outstanding << " bytes to BGZF" << endl;
 #endif
     
-        // Save the buffer
-        auto written = bgzf_write(handle, (void*)&buffer[0], outstanding);
-        
-        if (written != outstanding) {
-            // This only happens when there is an error
-            throw runtime_error("IO error writing data in BlockedGzipOutputStream");
+        if (deflater) {
+            // The data is already in the block we are filling. Like the BGZF,
+            // never leave a full block unsent, so virtual offsets are
+            // canonical.
+            pending_length += outstanding;
+            if (pending_length == BGZF_BLOCK_SIZE) {
+                submit_pending_block();
+            }
+        } else if (writes_in_place()) {
+            // The data is already in the BGZF's block. Just claim it.
+            handle->block_offset += outstanding;
+            if (handle->block_offset == BGZF_BLOCK_SIZE) {
+                // Compress and write the full block, like bgzf_write() would.
+                if (bgzf_flush(handle) != 0) {
+                    throw runtime_error("IO error writing data in BlockedGzipOutputStream");
+                }
+            }
+        } else {
+            // Save the buffer
+            auto written = bgzf_write(handle, (void*)&buffer[0], outstanding);
+            
+            if (written != outstanding) {
+                // This only happens when there is an error
+                throw runtime_error("IO error writing data in BlockedGzipOutputStream");
+            }
+            
+            // Make sure we don't try and write the same data twice by scrapping the buffer.
+            buffer.resize(0);
         }
         
         // Record the actual write
-        byte_count += written;
-        
-        // Make sure we don't try and write the same data twice by scrapping the buffer.
-        buffer.resize(0);
-        backed_up = 0;
+        byte_count += outstanding;
+    }
+    
+    // Nothing is handed out anymore.
+    handed_out = 0;
+    backed_up = 0;
+}
+
+bool BlockedGzipOutputStream::writes_in_place() const {
+    // With htslib's threads, the block buffer gets swapped out when it fills,
+    // and we can't ask for that without waiting for everything. Uncompressed
+    // BGZFs don't buffer at all.
+    return handle->mt == nullptr && handle->is_compressed;
+}
+
+void BlockedGzipOutputStream::submit_pending_block() {
+#ifdef debug
+    cerr << "Submit block of " << pending_length << " bytes for compression" << endl;
+#endif
+    pending_block.resize(pending_length);
+    if (!deflater->submit(std::move(pending_block))) {
+        throw runtime_error("IO error compressing data in BlockedGzipOutputStream");
     }
+    // Start a new block, reusing memory if we can.
+    pending_block = deflater->get_buffer();
+    pending_block.resize(BGZF_BLOCK_SIZE);
+    pending_length = 0;
 }
 
 void BlockedGzipOutputStream::force_close() {
@@ -0,0 +1,226 @@
+/**
+ * \file group_index.cpp
+ * Implementations for the GroupIndex of message groups in a file.
+ */
+
+#include "vg/io/group_index.hpp"
+#include "vg/io/message_iterator.hpp"
+#include "vg/io/registry.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Magic number at the start of a serialized index
+static const string GROUP_INDEX_MAGIC = "VGI";
+
+/// Version of the serialized index format that we write
+static const uint64_t GROUP_INDEX_VERSION = 1;
+
+/// Most distinct tags we will believe a serialized index has
+static const uint64_t GROUP_INDEX_MAX_TAGS = 65536;
+
+string GroupIndex::sidecar_filename(const string& filename) {
+    return filename + ".vgi";
+}
+
+GroupIndex GroupIndex::index_file(const string& filename) {
+    GroupIndex index;
+
+    MessageIterator it(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+
+    while (it.has_current()) {
+        // Skip each group by message lengths, never looking at the messages.
+        index.add_group(it.tag(), it.tell_group(), it.group_size());
+        it.skip_group();
+    }
+    index.set_end(it.tell_group());
+
+    return index;
+}
+
+void GroupIndex::add_group(const string& tag, int64_t virtual_offset, size_t message_count) {
+    if (!group_vos.empty() && virtual_offset <= group_vos.back()) {
+        throw runtime_error("Group at " + to_string(virtual_offset) + " added to index out of order");
+    }
+
+    // Find or assign the tag number. There are only ever a few tags.
+    auto found = find(tags.begin(), tags.end(), tag);
+    if (found == tags.end()) {
+        tags.push_back(tag);
+        found = tags.end() - 1;
+    }
+
+    group_vos.push_back(virtual_offset);
+    group_tags.push_back(found - tags.begin());
+    group_sizes.push_back(message_count);
+    end = max(end, virtual_offset);
+}
+
+void GroupIndex::set_end(int64_t virtual_offset) {
+    end = virtual_offset;
+}
+
+size_t GroupIndex::group_count() const {
+    return group_vos.size();
+}
+
+int64_t GroupIndex::group_vo(size_t group_number) const {
+    return group_vos.at(group_number);
+}
+
+const string& GroupIndex::group_tag(size_t group_number) const {
+    return tags.at(group_tags.at(group_number));
+}
+
+size_t GroupIndex::group_messages(size_t group_number) const {
+    return group_sizes.at(group_number);
+}
+
+int64_t GroupIndex::end_vo() const {
+    return end;
+}
+
+size_t GroupIndex::message_count() const {
+    size_t total = 0;
+    for (auto& size : group_sizes) {
+        total += size;
+    }
+    return total;
+}
+
+size_t GroupIndex::message_count(const string& tag) const {
+    auto found = find(tags.begin(), tags.end(), tag);
+    if (found == tags.end()) {
+        return 0;
+    }
+    uint32_t tag_number = found - tags.begin();
+    size_t total = 0;
+    for (size_t i = 0; i < group_sizes.size(); i++) {
+        if (group_tags[i] == tag_number) {
+            total += group_sizes[i];
+        }
+    }
+    return total;
+}
+
+size_t GroupIndex::find_group(int64_t virtual_offset) const {
+    auto found = upper_bound(group_vos.begin(), group_vos.end(), virtual_offset);
+    if (found == group_vos.begin()) {
+        return group_vos.size();
+    }
+    return (found - group_vos.begin()) - 1;
+}
+
+void GroupIndex::save(ostream& out) const {
+    {
+        ::google::protobuf::io::OstreamOutputStream raw_out(&out);
+        ::google::protobuf::io::CodedOutputStream coded_out(&raw_out);
+
+        coded_out.WriteRaw(GROUP_INDEX_MAGIC.data(), GROUP_INDEX_MAGIC.size());
+        coded_out.WriteVarint64(GROUP_INDEX_VERSION);
+
+        coded_out.WriteVarint64(tags.size());
+        for (auto& tag : tags) {
+            coded_out.WriteVarint32(tag.size());
+            coded_out.WriteString(tag);
+        }
+
+        coded_out.WriteVarint64(group_vos.size());
+        int64_t previous = 0;
+        for (size_t i = 0; i < group_vos.size(); i++) {
+            // Groups are in order, so we store the distance from the last one.
+            coded_out.WriteVarint64(group_vos[i] - previous);
+            previous = group_vos[i];
+            coded_out.WriteVarint32(group_tags[i]);
+            coded_out.WriteVarint64(group_sizes[i]);
+        }
+        coded_out.WriteVarint64(max(end, previous) - previous);
+
+        if (coded_out.HadError()) {
+            throw runtime_error("Could not write group index");
+        }
+    }
+    if (!out) {
+        throw runtime_error("Could not write group index");
+    }
+}
+
+void GroupIndex::load(istream& in) {
+    ::google::protobuf::io::IstreamInputStream raw_in(&in);
+    ::google::protobuf::io::CodedInputStream coded_in(&raw_in);
+    coded_in.SetTotalBytesLimit(numeric_limits<int>::max());
+
+    auto handle = [](bool ok) {
+        if (!ok) {
+            throw runtime_error("Group index is corrupt or truncated");
+        }
+    };
+
+    string magic;
+    handle(coded_in.ReadString(&magic, GROUP_INDEX_MAGIC.size()));
+    if (magic != GROUP_INDEX_MAGIC) {
+        throw runtime_error("Data is not a group index");
+    }
+    ::google::protobuf::uint64 version;
+    handle(coded_in.ReadVarint64(&version));
+    if (version != GROUP_INDEX_VERSION) {
+        throw runtime_error("Group index version " + to_string(version) + " is not supported");
+    }
+
+    // Don't trust the counts enough to allocate space for them up front; a
+    // corrupt index could ask for anything.
+    ::google::protobuf::uint64 tag_count;
+    handle(coded_in.ReadVarint64(&tag_count));
+    handle(tag_count <= GROUP_INDEX_MAX_TAGS);
+    vector<string> new_tags;
+    for (::google::protobuf::uint64 i = 0; i < tag_count; i++) {
+        uint32_t tag_size;
+        handle(coded_in.ReadVarint32(&tag_size));
+        handle(tag_size <= Registry::MAX_TAG_LENGTH);
+        new_tags.emplace_back();
+        handle(coded_in.ReadString(&new_tags.back(), tag_size));
+    }
+
+    // Each group takes at least 3 bytes.
+    ::google::protobuf::uint64 group_count;
+    handle(coded_in.ReadVarint64(&group_count));
+    handle(group_count <= numeric_limits<int>::max() / 3);
+    vector<int64_t> new_vos;
+    vector<uint32_t> new_group_tags;
+    vector<uint64_t> new_sizes;
+    int64_t previous = 0;
+    for (::google::protobuf::uint64 i = 0; i < group_count; i++) {
+        ::google::protobuf::uint64 delta;
+        uint32_t tag_number;
+        ::google::protobuf::uint64 size;
+        handle(coded_in.ReadVarint64(&delta));
+        handle(coded_in.ReadVarint32(&tag_number));
+        handle(coded_in.ReadVarint64(&size));
+        handle(tag_number < new_tags.size());
+        previous += delta;
+        new_vos.push_back(previous);
+        new_group_tags.push_back(tag_number);
+        new_sizes.push_back(size);
+    }
+    ::google::protobuf::uint64 end_delta;
+    handle(coded_in.ReadVarint64(&end_delta));
+
+    tags = std::move(new_tags);
+    group_vos = std::move(new_vos);
+    group_tags = std::move(new_group_tags);
+    group_sizes = std::move(new_sizes);
+    end = previous + end_delta;
+}
+
+}
+
+}
@@ -1,9 +1,17 @@
 #include "vg/io/hfile_cppstream.hpp"
+#include "vg/io/hfile_fd.hpp"
 #include "vg/io/hfile_internal.hpp"
+#include "vg/io/fdstream.hpp"
 
 #include <errno.h>
 
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 namespace vg {
 
@@ -11,6 +19,176 @@ namespace io {
 
 using namespace std;
 
+/**
+ * Writes data to an ostream from a background thread, through a queue with a
+ * limited number of bytes in it.
+ */
+class WriteBehindWriter {
+public:
+    /// Start a thread writing to the given stream. Throws std::system_error
+    /// if the thread can't be started.
+    WriteBehindWriter(ostream& output, size_t max_queued_bytes);
+    
+    /// Write out everything queued and stop the thread.
+    ~WriteBehindWriter();
+    
+    /// Queue a copy of the given data to be written, waiting for room if the
+    /// queue is full. Returns false if an earlier write failed.
+    bool write(const void* data, size_t nbytes);
+    
+    /// Wait for everything queued to be written, and flush the stream.
+    /// Returns false if any write or the flush failed.
+    bool sync();
+    
+    /// Return false if any write has failed so far.
+    bool ok() const;
+    
+    /// Get the number of bytes queued or being written.
+    size_t backlog() const;
+    
+    /// Get the number of times a write had to wait for the queue to drain.
+    size_t stalls() const;
+    
+private:
+    /// The stream we write to. Only the writer thread touches it, except in
+    /// sync() when the writer is idle.
+    ostream& output;
+    /// The most bytes to queue up
+    size_t max_queued_bytes;
+    /// Chunks of data waiting to be written
+    deque<vector<char>> queue;
+    /// Bytes waiting to be written or being written
+    size_t queued_bytes;
+    /// Set while the writer thread is writing a chunk
+    bool writing;
+    /// Set if a write fails
+    bool failed;
+    /// Set when the writer thread should finish up and exit
+    bool stopping;
+    /// Number of times a write had to wait for room
+    size_t stall_count;
+    /// Protects everything else
+    mutable mutex queue_mutex;
+    /// Notified when there is something to write, or we are stopping
+    condition_variable data_ready;
+    /// Notified when a chunk has been written
+    condition_variable chunk_done;
+    /// The thread doing the writing
+    thread writer;
+    
+    /// Function run by the writer thread.
+    void writer_function();
+};
+
+WriteBehindWriter::WriteBehindWriter(ostream& output, size_t max_queued_bytes) : output(output),
+    max_queued_bytes(max_queued_bytes), queued_bytes(0), writing(false), failed(false), stopping(false),
+    stall_count(0), writer(&WriteBehindWriter::writer_function, this) {
+    // Nothing to do! Writer thread is now running!
+}
+
+WriteBehindWriter::~WriteBehindWriter() {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    data_ready.notify_one();
+    writer.join();
+}
+
+bool WriteBehindWriter::write(const void* data, size_t nbytes) {
+    unique_lock<mutex> lock(queue_mutex);
+    
+    if (queued_bytes > 0 && queued_bytes + nbytes > max_queued_bytes) {
+        // The disk can't keep up. Wait for room, but always let at least one
+        // chunk in, however big.
+        stall_count++;
+        chunk_done.wait(lock, [&]() {
+            return failed || queued_bytes == 0 || queued_bytes + nbytes <= max_queued_bytes;
+        });
+    }
+    
+    if (failed) {
+        return false;
+    }
+    
+    queue.emplace_back((const char*) data, (const char*) data + nbytes);
+    queued_bytes += nbytes;
+    lock.unlock();
+    data_ready.notify_one();
+    
+    return true;
+}
+
+bool WriteBehindWriter::sync() {
+    unique_lock<mutex> lock(queue_mutex);
+    chunk_done.wait(lock, [&]() {
+        return failed || (queue.empty() && !writing);
+    });
+    if (failed) {
+        return false;
+    }
+    
+    // The writer is idle, and won't start again while we hold the lock.
+    output.clear();
+    output.flush();
+    if (!output.good()) {
+        failed = true;
+    }
+    return !failed;
+}
+
+bool WriteBehindWriter::ok() const {
+    lock_guard<mutex> lock(queue_mutex);
+    return !failed;
+}
+
+size_t WriteBehindWriter::backlog() const {
+    lock_guard<mutex> lock(queue_mutex);
+    return queued_bytes;
+}
+
+size_t WriteBehindWriter::stalls() const {
+    lock_guard<mutex> lock(queue_mutex);
+    return stall_count;
+}
+
+void WriteBehindWriter::writer_function() {
+    unique_lock<mutex> lock(queue_mutex);
+    while (true) {
+        data_ready.wait(lock, [&]() {
+            return stopping || !queue.empty();
+        });
+        if (queue.empty()) {
+            // We must be stopping, and everything is written.
+            return;
+        }
+        
+        vector<char> chunk = std::move(queue.front());
+        queue.pop_front();
+        writing = true;
+        
+        // Write outside the lock. Once something has failed, we just drop
+        // data.
+        bool write_failed = failed;
+        lock.unlock();
+        if (!write_failed) {
+            output.clear();
+            output.write(chunk.data(), chunk.size());
+            write_failed = !output.good();
+        }
+        lock.lock();
+        
+#ifdef debug
+        cerr << "Write-behind thread wrote " << chunk.size() << " bytes" << endl;
+#endif
+        
+        writing = false;
+        failed = failed || write_failed;
+        queued_bytes -= chunk.size();
+        chunk_done.notify_all();
+    }
+}
+
 /// Define a c-style-inheritance derived struct that holds the hFILE and the
 /// stream pointers. Either stream pointer may be null (if we are in the other
 /// mode), or both can be non-null and point to the same iostream object.
@@ -18,6 +196,8 @@ typedef struct {
     hFILE base;
     istream* input;
     ostream* output;
+    /// If set, writes to output go through this background writer.
+    WriteBehindWriter* writer;
 } hFILE_cppstream;
 
 
@@ -73,6 +253,15 @@ static ssize_t cppstream_write(hFILE *fpv, const void *buffer, size_t nbytes) {
         return -1;
     }
     
+    if (fp->writer != nullptr) {
+        // Hand the data off to be written in the background.
+        if (!fp->writer->write(buffer, nbytes)) {
+            errno = EIO;
+            return -1;
+        }
+        return nbytes;
+    }
+    
     // Write the data and record how much we put
     fp->output->clear();
     // Note that the stream always takes all the bytes
@@ -104,6 +293,13 @@ static off_t cppstream_seek(hFILE *fpv, off_t offset, int whence) {
     // Cast the hFILE to the derived class
     hFILE_cppstream* fp = (hFILE_cppstream*) fpv;
     
+    if (fp->writer != nullptr && !fp->writer->sync()) {
+        // We can't touch the stream while the writer might be, and we can't
+        // seek if it is broken.
+        errno = EIO;
+        return -1;
+    }
+    
     // How are we seeking?
     ios_base::seekdir way;
     switch (whence) {
@@ -188,6 +384,16 @@ static int cppstream_flush(hFILE *fpv) {
 
     // Cast the hFILE to the derived class
     hFILE_cppstream* fp = (hFILE_cppstream*) fpv;
+    
+    if (fp->writer != nullptr) {
+        // All the data has been handed off, which is all a flush promises
+        // here. Report any errors the writer has had so far.
+        if (!fp->writer->ok()) {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
 
     if (fp->output != nullptr) {
         // We have an output stream to flush
@@ -216,11 +422,22 @@ static int cppstream_close(hFILE *fpv) {
     // Cast the hFILE to the derived class
     hFILE_cppstream* fp = (hFILE_cppstream*) fpv;
     
+    int status = 0;
+    if (fp->writer != nullptr) {
+        // Make sure everything gets written before the stream can go away.
+        if (!fp->writer->sync()) {
+            errno = EIO;
+            status = -1;
+        }
+        delete fp->writer;
+        fp->writer = nullptr;
+    }
+    
     // Just null out the stream fields. They will be closed when destroyed, and we don't own them. 
     fp->input = nullptr;
     fp->output = nullptr;
     
-    return 0;
+    return status;
     
 }
 
@@ -234,6 +451,13 @@ static const struct hFILE_backend cppstream_backend = {
 };
 
 hFILE* hfile_wrap(std::istream& input) {
+    fdinbuf* fd_buffer = dynamic_cast<fdinbuf*>(input.rdbuf());
+    if (fd_buffer != nullptr && fd_buffer->in_avail() == 0) {
+        // The stream is just a thin layer over a file descriptor, and it
+        // hasn't read ahead of where we want to start, so skip it.
+        return hfile_wrap_fd(fd_buffer->file_descriptor(), "r");
+    }
+
     /// Make the base struct, making sure it knows how big we are
     hFILE_cppstream* fp = (hFILE_cppstream*) hfile_init(sizeof(hFILE_cppstream), "r", 0);
     
@@ -245,6 +469,7 @@ hFILE* hfile_wrap(std::istream& input) {
     // Do our initialization
     fp->input = &input;
     fp->output = nullptr;
+    fp->writer = nullptr;
     
     // Set the backend
     fp->base.backend = &cppstream_backend;
@@ -267,6 +492,13 @@ hFILE* hfile_wrap(std::istream& input) {
 }
 
 hFILE* hfile_wrap(std::ostream& output) {
+    fdoutbuf* fd_buffer = dynamic_cast<fdoutbuf*>(output.rdbuf());
+    if (fd_buffer != nullptr) {
+        // The stream is just a thin layer over a file descriptor, and it
+        // doesn't buffer, so skip it.
+        return hfile_wrap_fd(fd_buffer->file_descriptor(), "w");
+    }
+
     /// Make the base struct, making sure it knows how big we are
     hFILE_cppstream* fp = (hFILE_cppstream*) hfile_init(sizeof(hFILE_cppstream), "w", 0);
     
@@ -278,6 +510,7 @@ hFILE* hfile_wrap(std::ostream& output) {
     // Do our initialization
     fp->input = nullptr;
     fp->output = &output;
+    fp->writer = nullptr;
     
     // Set the backend
     fp->base.backend = &cppstream_backend;
@@ -302,6 +535,60 @@ hFILE* hfile_wrap(std::ostream& output) {
     return &fp->base;
 }
 
+/// Get the cppstream hFILE that the given hFILE really is, or null if it is
+/// some other kind of hFILE.
+static hFILE_cppstream* as_cppstream(hFILE* wrapped) {
+    if (wrapped == nullptr || wrapped->backend != &cppstream_backend) {
+        return nullptr;
+    }
+    return (hFILE_cppstream*) wrapped;
+}
+
+bool hfile_enable_write_behind(hFILE* wrapped, size_t max_queued_bytes) {
+    hFILE_cppstream* fp = as_cppstream(wrapped);
+    if (fp == nullptr || fp->output == nullptr) {
+        // We can only do this for our own output files.
+        return false;
+    }
+    if (fp->writer != nullptr) {
+        // Already done
+        return true;
+    }
+    
+    // Anything still in the hFILE's buffer will go through the writer.
+    try {
+        fp->writer = new WriteBehindWriter(*fp->output, max_queued_bytes);
+    } catch (std::system_error& e) {
+        // We couldn't start the thread.
+        return false;
+    }
+    return true;
+}
+
+int hfile_sync(hFILE* wrapped) {
+    // Get everything out of the hFILE's buffer
+    if (hflush(wrapped) != 0) {
+        return -1;
+    }
+    
+    hFILE_cppstream* fp = as_cppstream(wrapped);
+    if (fp != nullptr && fp->writer != nullptr && !fp->writer->sync()) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+size_t hfile_write_behind_backlog(hFILE* wrapped) {
+    hFILE_cppstream* fp = as_cppstream(wrapped);
+    return (fp != nullptr && fp->writer != nullptr) ? fp->writer->backlog() : 0;
+}
+
+size_t hfile_write_behind_stalls(hFILE* wrapped) {
+    hFILE_cppstream* fp = as_cppstream(wrapped);
+    return (fp != nullptr && fp->writer != nullptr) ? fp->writer->stalls() : 0;
+}
+
 }
 
 }
@@ -0,0 +1,250 @@
+#include "vg/io/hfile_fd.hpp"
+#include "vg/io/hfile_internal.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// Define a c-style-inheritance derived struct that holds the hFILE and the
+/// file descriptor.
+typedef struct {
+    hFILE base;
+    /// The file descriptor we read or write
+    int fd;
+    /// Whether we can use pread()/pwrite() and seek
+    bool seekable;
+    /// Whether we close the descriptor when closed
+    bool owned;
+    /// Where the next pread()/pwrite() goes, if seekable
+    off_t offset;
+} hFILE_fd;
+
+
+// Define read, write, seek (which also can tell), flush, and close functions
+
+/// Read data. Return bytes read, or a negative value on error. Set errno on error.
+static ssize_t fd_read(hFILE *fpv, void *buffer, size_t nbytes) {
+#ifdef debug
+    cerr << "fd_read(" << fpv << ", " << buffer << ", " << nbytes << ")" << endl;
+#endif
+
+    // Cast the hFILE to the derived class
+    hFILE_fd* fp = (hFILE_fd*) fpv;
+
+    ssize_t found;
+    do {
+        if (fp->seekable) {
+            found = pread(fp->fd, buffer, nbytes, fp->offset);
+        } else {
+            found = read(fp->fd, buffer, nbytes);
+        }
+    } while (found < 0 && errno == EINTR);
+
+    if (found > 0 && fp->seekable) {
+        fp->offset += found;
+    }
+
+    return found;
+}
+
+/// Write data. Return the number of bytes actually written. Return a negative
+/// value and set errno on error.
+static ssize_t fd_write(hFILE *fpv, const void *buffer, size_t nbytes) {
+#ifdef debug
+    cerr << "fd_write(" << fpv << ", " << buffer << ", " << nbytes << ")" << endl;
+#endif
+
+    // Cast the hFILE to the derived class
+    hFILE_fd* fp = (hFILE_fd*) fpv;
+
+    // The hFILE will call again for anything we don't manage to write.
+    ssize_t written;
+    do {
+        if (fp->seekable) {
+            written = pwrite(fp->fd, buffer, nbytes, fp->offset);
+        } else {
+            written = write(fp->fd, buffer, nbytes);
+        }
+    } while (written < 0 && errno == EINTR);
+
+    if (written > 0 && fp->seekable) {
+        fp->offset += written;
+    }
+
+    return written;
+}
+
+/// Seek relative to SEEK_SET (beginning), SEEK_CUR, or SEEK_END. Return the
+/// resulting offset from the beginning of the file.
+/// Returns a negative value on error.
+static off_t fd_seek(hFILE *fpv, off_t offset, int whence) {
+#ifdef debug
+    cerr << "fd_seek(" << fpv << ", " << offset << ", " << whence << ")" << endl;
+#endif
+
+    // Cast the hFILE to the derived class
+    hFILE_fd* fp = (hFILE_fd*) fpv;
+
+    if (!fp->seekable) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    off_t base;
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = fp->offset;
+        break;
+    case SEEK_END:
+        {
+            struct stat file_info;
+            if (fstat(fp->fd, &file_info) != 0) {
+                return -1;
+            }
+            base = file_info.st_size;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // We keep our own offset, so there's nothing to do to the descriptor.
+    fp->offset = base + offset;
+    return fp->offset;
+}
+
+/// Flush written data. Everything we write goes straight to the descriptor,
+/// so there is nothing to do.
+static int fd_flush(hFILE *fpv) {
+#ifdef debug
+    cerr << "fd_flush(" << fpv << ")" << endl;
+#endif
+    return 0;
+}
+
+/// Close the file. Return 0 on success, or a negative number and set errno on
+/// failure.
+static int fd_close(hFILE *fpv) {
+#ifdef debug
+    cerr << "fd_close(" << fpv << ")" << endl;
+#endif
+
+    // Cast the hFILE to the derived class
+    hFILE_fd* fp = (hFILE_fd*) fpv;
+
+    if (fp->owned) {
+        return close(fp->fd);
+    }
+
+    if (fp->seekable) {
+        // Leave the descriptor where we got to, like reading or writing
+        // through it normally would have.
+        if (lseek(fp->fd, fp->offset, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// Define an hFILE backend for file descriptors
+static const struct hFILE_backend fd_backend = {
+    fd_read,
+    fd_write,
+    fd_seek,
+    fd_flush,
+    fd_close
+};
+
+hFILE* hfile_wrap_fd(int fd, const char* mode, bool take_ownership, size_t buffer_size) {
+    if (mode == nullptr || (strcmp(mode, "r") != 0 && strcmp(mode, "w") != 0)) {
+        // We only do plain reading or writing.
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    /// Make the base struct, making sure it knows how big we are
+    hFILE_fd* fp = (hFILE_fd*) hfile_init(sizeof(hFILE_fd), mode, buffer_size);
+
+    if (fp == nullptr) {
+        // Couldn't allocate the file for some reason?
+        return nullptr;
+    }
+
+    // Do our initialization
+    fp->fd = fd;
+    fp->owned = take_ownership;
+
+    // Start wherever the descriptor is, if it can tell us.
+    struct stat file_info;
+    off_t start_pos = lseek(fd, 0, SEEK_CUR);
+    fp->seekable = (start_pos >= 0 && fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode));
+    fp->offset = fp->seekable ? start_pos : 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fp->seekable) {
+        // Most reads and all writes go front to back, so ask for aggressive
+        // read-ahead and early page reuse. This is only a hint, so we don't
+        // care if it fails.
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+
+    // Set the backend
+    fp->base.backend = &fd_backend;
+
+    // Tell the file that it is starting where the descriptor is
+    fp->base.offset = fp->offset;
+
+    // Return the base hFILE*
+    return &fp->base;
+}
+
+hFILE* hfile_open_path(const std::string& filename, const char* mode, size_t buffer_size) {
+    int flags;
+    if (mode != nullptr && strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (mode != nullptr && strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    int fd = open(filename.c_str(), flags, 0666);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    hFILE* wrapped = hfile_wrap_fd(fd, mode, true, buffer_size);
+    if (wrapped == nullptr) {
+        // Don't leak the descriptor, but keep the original error.
+        int error = errno;
+        close(fd);
+        errno = error;
+    }
+    return wrapped;
+}
+
+}
+
+}
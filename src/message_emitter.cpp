@@ -5,6 +5,8 @@
 
 #include "vg/io/message_emitter.hpp"
 
+#include <cstring>
+
 namespace vg {
 
 namespace io {
@@ -13,11 +15,14 @@ using namespace std;
 
 // Give the static member variable a .o home
 const size_t MessageEmitter::MAX_MESSAGE_SIZE = 1000000000;
+const size_t MessageEmitter::DEFAULT_MAX_GROUP_BYTES = 16 * 1024 * 1024;
 
-MessageEmitter::MessageEmitter(ostream& out, bool compress, size_t max_group_size) :
-    group(),
+MessageEmitter::MessageEmitter(ostream& out, bool compress, size_t max_group_size, int compression_level,
+                               size_t max_group_bytes) :
+    group_data(),
     max_group_size(max_group_size),
-    bgzip_out(compress ? new BlockedGzipOutputStream(out) : nullptr),
+    max_group_bytes(max_group_bytes),
+    bgzip_out(compress ? new BlockedGzipOutputStream(out, compression_level) : nullptr),
     uncompressed_out(compress ? nullptr : new google::protobuf::io::OstreamOutputStream(&out)),
     uncompressed_out_ostream(compress ? nullptr : &out),
     uncompressed_out_written(0)
@@ -52,6 +57,13 @@ MessageEmitter::~MessageEmitter() {
         emit_group();
     }
 
+    if (group_index.get() != nullptr && (bgzip_out.get() != nullptr || uncompressed_out.get() != nullptr)) {
+        // Write out the index, now that we know where the groups end.
+        group_index->set_end(tell());
+        group_index->save(*group_index_out);
+        group_index_out->flush();
+    }
+
     if (bgzip_out.get() != nullptr) {
 #ifdef debug
         cerr << "MessageEmitter ending file" << endl;
@@ -67,7 +79,7 @@ MessageEmitter::~MessageEmitter() {
 }
 
 void MessageEmitter::write(const string& tag) {
-    if (group.size() >= max_group_size || tag != group_tag) {
+    if (group_messages >= max_group_size || tag != group_tag) {
         // We have run out of buffer space or changed type
         emit_group();
     }
@@ -81,29 +93,126 @@ void MessageEmitter::write(const string& tag) {
 }
 
 void MessageEmitter::write(const string& tag, string&& message) {
+    // We need to copy the message into the buffer anyway.
+    write_copy(tag, message);
+}
+
+void MessageEmitter::write_copy(const string& tag, const string& message) {
+    uint8_t* dest = write_in_place(tag, message.size());
+    memcpy(dest, message.data(), message.size());
+}
+
+uint8_t* MessageEmitter::write_in_place(const string& tag, size_t message_size) {
+    if (message_size > MAX_MESSAGE_SIZE) {
+        throw std::runtime_error("io::MessageEmitter::write: message too large");
+    }
+    
+    if (group_messages > 0 && group_bytes + message_size > max_group_bytes) {
+        // This message would make the group too big
+        emit_group();
+    }
     // Ensure the current group is for the given tag
     write(tag);
-    group.emplace_back(std::move(message));
     
-    if (group.back().size() > MAX_MESSAGE_SIZE) {
-        throw std::runtime_error("io::MessageEmitter::write: message too large");
+    uint8_t* dest = frame_message(group_data, message_size);
+    group_messages++;
+    group_bytes += message_size;
+    return dest;
+}
+
+void MessageEmitter::write_framed(const string& tag, const string& framed_messages) {
+    const char* cursor = framed_messages.data();
+    const char* end = cursor + framed_messages.size();
+    while (cursor != end) {
+        // Read the length the message was framed with
+        const char* frame_start = cursor;
+        uint64_t message_size = 0;
+        for (size_t shift = 0; ; shift += 7) {
+            if (cursor == end || shift >= 64) {
+                throw std::runtime_error("io::MessageEmitter::write_framed: corrupt message framing");
+            }
+            uint8_t byte = (uint8_t) *cursor;
+            cursor++;
+            message_size |= (uint64_t) (byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        if (message_size > MAX_MESSAGE_SIZE || message_size > (uint64_t) (end - cursor)) {
+            throw std::runtime_error("io::MessageEmitter::write_framed: corrupt message framing");
+        }
+        
+        if (group_messages > 0 && group_bytes + message_size > max_group_bytes) {
+            // This message would make the group too big
+            emit_group();
+        }
+        // Ensure the current group is for the given tag
+        write(tag);
+        
+        // Copy over the message with its framing
+        cursor += message_size;
+        group_data.append(frame_start, cursor - frame_start);
+        group_messages++;
+        group_bytes += message_size;
     }
 }
 
-void MessageEmitter::write_copy(const string& tag, const string& message) {
-    // Ensure the current group is for the given tag
-    write(tag);
-    group.push_back(message);
+void MessageEmitter::emit_framed_group(const string& tag, string& framed_messages, size_t message_count) {
+    if (group_messages > 0 || tag != group_tag) {
+        // We can't just adopt what we have buffered
+        emit_group();
+    }
     
-    if (group.back().size() > MAX_MESSAGE_SIZE) {
-        throw std::runtime_error("io::MessageEmitter::write_copy: message too large");
+    // Send out the caller's buffer as our group, and give it back empty.
+    group_tag = tag;
+    group_data.swap(framed_messages);
+    group_messages = message_count;
+    emit_group();
+    group_data.swap(framed_messages);
+}
+
+uint8_t* MessageEmitter::frame_message(string& framed_messages, size_t message_size) {
+    // Frame the message with its length, and leave room for it after.
+    size_t length_size = ::google::protobuf::io::CodedOutputStream::VarintSize32(message_size);
+    size_t frame_start = framed_messages.size();
+    framed_messages.resize(frame_start + length_size + message_size);
+    uint8_t* frame = (uint8_t*) &framed_messages[frame_start];
+    ::google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(message_size, frame);
+    return frame + length_size;
+}
+
+bool MessageEmitter::enable_multithreading(size_t thread_count) {
+    if (bgzip_out.get() == nullptr) {
+        // Nothing to compress
+        return false;
     }
+    return bgzip_out->EnableMultiThreading(thread_count);
+}
+
+bool MessageEmitter::enable_block_aligned_groups() {
+    if (bgzip_out.get() == nullptr) {
+        // There are no blocks
+        return false;
+    }
+    block_aligned_groups = true;
+    // Make sure the next group starts a block too.
+    bgzip_out->EndBlock();
+    return true;
 }
 
 void MessageEmitter::on_group(group_listener_t&& listener) {
     group_handlers.emplace_back(std::move(listener));
 }
 
+void MessageEmitter::write_group_index(ostream& index_out) {
+    group_index.reset(new GroupIndex());
+    group_index_out = &index_out;
+}
+
+int64_t MessageEmitter::tell() const {
+    return (bgzip_out.get() != nullptr) ? bgzip_out->Tell() : (uncompressed_out_written + uncompressed_out->ByteCount());
+}
+
 void MessageEmitter::emit_group() {
     if (group_tag.empty()) {
         // Nothing have been loaded into our buffer, not even an empty group with a tag.
@@ -121,8 +230,10 @@ void MessageEmitter::emit_group() {
         }
     };
 
-    // Work out where the group we emit will start
-    int64_t virtual_offset = (bgzip_out.get() != nullptr) ? bgzip_out->Tell() : (uncompressed_out_written + uncompressed_out->ByteCount());
+    // Work out where the group we emit will start, if anyone wants to know.
+    // Finding virtual offsets can make us wait on compression threads.
+    bool need_offsets = !group_handlers.empty() || group_index.get() != nullptr;
+    int64_t virtual_offset = need_offsets ? tell() : -1;
 
     {
         // Make a CodedOutput Stream that we will clean up (to flush) before we give up control.
@@ -131,11 +242,11 @@ void MessageEmitter::emit_group() {
             (::google::protobuf::io::ZeroCopyOutputStream*) uncompressed_out.get());
 
 #ifdef debug
-        cerr << "Writing group size of " << (group.size() + 1) << endl;
+        cerr << "Writing group size of " << (group_messages + 1) << endl;
 #endif
 
         // Prefix the group with the number of objects, plus 1 for the tag header
-        coded_out.WriteVarint64(group.size() + 1);
+        coded_out.WriteVarint64(group_messages + 1);
         handle(!coded_out.HadError());
        
 #ifdef debug
@@ -148,25 +259,20 @@ void MessageEmitter::emit_group() {
         coded_out.WriteRaw(group_tag.data(), group_tag.size());
         handle(!coded_out.HadError());
 
-        for (auto& message : group) {
-            
 #ifdef debug
-            cerr << "Writing message of " << message.size() << " bytes in group of \""
-                << group_tag << "\" @ " << virtual_offset << endl;
+        cerr << "Writing " << group_messages << " messages in " << group_data.size() << " bytes in group of \""
+            << group_tag << "\" @ " << virtual_offset << endl;
 #endif
-            
-            // And prefix each object with its size
-            coded_out.WriteVarint32(message.size());
-            handle(!coded_out.HadError());
-            coded_out.WriteString(message);
-            handle(!coded_out.HadError());
-        }
+        
+        // Write the messages, which are already prefixed with their sizes
+        coded_out.WriteRaw(group_data.data(), group_data.size());
+        handle(!coded_out.HadError());
         
         coded_out.Trim();
     }
     
     // Work out where we ended
-    int64_t next_virtual_offset = (bgzip_out.get() != nullptr) ? bgzip_out->Tell() : (uncompressed_out_written + uncompressed_out->ByteCount());
+    int64_t next_virtual_offset = need_offsets ? tell() : -1;
     
     if (uncompressed_out.get() != nullptr) {
 #ifdef debug
@@ -182,14 +288,39 @@ void MessageEmitter::emit_group() {
         handler(group_tag, virtual_offset, next_virtual_offset);
     }
     
+    if (group_index.get() != nullptr) {
+        // Remember the group for the index
+        group_index->add_group(group_tag, virtual_offset, group_messages);
+    }
+    
+    if (block_aligned_groups) {
+        // Make the next group start a new block.
+        bgzip_out->EndBlock();
+    }
+    
     // Empty the buffer because everything in it is written
-    group.clear();
+    // Keep the buffer's memory to fill again.
+    group_data.clear();
+    group_messages = 0;
+    group_bytes = 0;
     
     // Clear the tag out because now nothing is buffered.
     group_tag.clear();
 }
 
-void MessageEmitter::flush() {
+bool MessageEmitter::enable_write_behind(size_t max_queued_bytes) {
+    if (bgzip_out.get() == nullptr) {
+        // We aren't using a BGZF stream
+        return false;
+    }
+    return bgzip_out->EnableWriteBehind(max_queued_bytes);
+}
+
+size_t MessageEmitter::write_behind_backlog() const {
+    return bgzip_out.get() == nullptr ? 0 : bgzip_out->GetWriteBehindBacklog();
+}
+
+void MessageEmitter::flush(bool barrier) {
     // Make sure to emit our group, if any.
     emit_group();
     
@@ -199,7 +330,7 @@ void MessageEmitter::flush() {
         cerr << "Flushing MessageEmitter to BlockedGzipOutputStream" << endl;
 #endif
 
-        bgzip_out->Flush();
+        bgzip_out->Flush(barrier);
     }
     if (uncompressed_out.get() != nullptr) {
     
@@ -6,6 +6,10 @@
 #include "vg/io/message_iterator.hpp"
 #include "vg/io/registry.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
 namespace vg {
 
 namespace io {
@@ -14,6 +18,37 @@ using namespace std;
 
 // Provide the static values a compilation unit to live in.
 const size_t MessageIterator::MAX_MESSAGE_SIZE;
+const size_t MessageIterator::MAX_DEFAULT_DECOMPRESSION_THREADS;
+
+size_t MessageBatch::size() const {
+    return offsets.size() - 1;
+}
+
+bool MessageBatch::empty() const {
+    return size() == 0;
+}
+
+size_t MessageBatch::bytes() const {
+    return offsets.back();
+}
+
+const char* MessageBatch::data(size_t i) const {
+    return arena.data() + offsets.at(i);
+}
+
+size_t MessageBatch::message_size(size_t i) const {
+    return offsets.at(i + 1) - offsets[i];
+}
+
+void MessageBatch::push_back(const char* data, size_t size) {
+    arena.insert(arena.end(), data, data + size);
+    offsets.push_back(arena.size());
+}
+
+void MessageBatch::clear() {
+    arena.clear();
+    offsets.resize(1);
+}
 
 string MessageIterator::sniff_tag(istream& stream) {
 
@@ -140,9 +175,15 @@ string MessageIterator::sniff_tag(::google::protobuf::io::ZeroCopyInputStream& s
     return tag;
 }
 
+size_t MessageIterator::decompression_threads_for(size_t parse_threads) {
+    return max<size_t>(1, min<size_t>(parse_threads / 2, MAX_DEFAULT_DECOMPRESSION_THREADS));
+}
+
 MessageIterator::MessageIterator(istream& in, bool verbose, size_t thread_count) : MessageIterator(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(in)), verbose) {
     if (thread_count > 1) {
-        // After making the BGZF, turn on multithreaded decoding
+        // After making the BGZF, turn on multithreaded decoding. Hand back
+        // what we read ahead first.
+        return_buffer();
         if (!bgzip_in->EnableMultiThreading(thread_count)) {
             throw std::runtime_error("Cound not enable multithreaded BGZF decoding");
         }
@@ -163,22 +204,58 @@ MessageIterator::MessageIterator(unique_ptr<BlockedGzipInputStream>&& bgzf, bool
 }
 
 auto MessageIterator::operator*() const -> const TaggedMessage& {
+    fill_value();
     return value;
 }
 
 auto MessageIterator::operator*() -> TaggedMessage& {
+    fill_value();
     return value;
 }
 
 
 auto MessageIterator::operator++() -> const MessageIterator& {
-    while (group_count == group_idx) {
+    next_item();
+    
+    if (message_filter) {
+        // Pass over messages that the filter doesn't want. Tag-only items
+        // have no data and always count.
+        while (has_current()) {
+            auto current = view();
+            if (current.data == nullptr || message_filter(*current.tag, current.data, current.size)) {
+                break;
+            }
+            if (this->verbose) {
+                cerr << "Message of " << current.size << " bytes is filtered out" << endl;
+            }
+            next_item();
+        }
+    }
+    
+    return *this;
+}
+
+auto MessageIterator::next_item() -> void {
+    // Get past whatever of the current message hasn't been read.
+    discard_data();
+    
+    // Set if the rest of the group we are in isn't wanted.
+    bool skip_rest = false;
+    
+    while (group_count == group_idx || skip_rest) {
+        if (skip_rest) {
+            // Jump over the messages we don't want by their lengths.
+            skip_messages(group_count - group_idx);
+            group_idx = group_count;
+            skip_rest = false;
+        }
+        
         // We have made it to the end of the group we are reading. We will
         // start a new group now (and skip through empty groups).
         
         // Determine exactly where we are positioned, if possible, before
-        // creating the CodedInputStream to read the group's item count
-        auto virtual_offset = bgzip_in->Tell();
+        // reading the group's item count
+        auto virtual_offset = tell_stream();
         
         if (virtual_offset == -1) {
             // We don't have seek capability, so we just count up the groups we read.
@@ -192,13 +269,11 @@ auto MessageIterator::operator++() -> const MessageIterator& {
         // Start at the start of the new group
         group_idx = 0;
         
-        // Make a CodedInputStream to read the group length
-        ::google::protobuf::io::CodedInputStream coded_in(bgzip_in.get());
-        // Alot space for group's length, tag's length, and tag (generously)
-        coded_in.SetTotalBytesLimit(MAX_MESSAGE_SIZE * 2);
-        
         // Try and read the group's length
-        if (!coded_in.ReadVarint64((::google::protobuf::uint64*) &group_count)) {
+        uint64_t read_count = 0;
+        bool got_count = read_varint(read_count);
+        group_count = read_count;
+        if (!got_count) {
             // We didn't get a length
             
             if (this->verbose) {
@@ -211,7 +286,8 @@ auto MessageIterator::operator++() -> const MessageIterator& {
             item_vo = -1;
             value.first.clear();
             value.second.reset();
-            return *this;
+            value_ready = true;
+            return;
         }
         
         if (this->verbose) {
@@ -222,11 +298,11 @@ auto MessageIterator::operator++() -> const MessageIterator& {
         // It could also be the first item, if it isn't a known tag string.
         
         // Get the tag's virtual offset, if available
-        virtual_offset = bgzip_in->Tell();
+        virtual_offset = tell_stream();
         
         // The tag is prefixed by its size
-        uint32_t tag_size = 0;
-        handle(coded_in.ReadVarint32(&tag_size), group_vo);
+        uint64_t tag_size = 0;
+        handle(read_varint(tag_size), group_vo);
         
         if (tag_size > MAX_MESSAGE_SIZE) {
             throw runtime_error("[vg::io::MessageIterator::operator++] (group " + 
@@ -235,9 +311,9 @@ auto MessageIterator::operator++() -> const MessageIterator& {
         }
         
         // Read it into the tag field of our value
-        value.first.clear();
+        value.first.resize(tag_size);
         if (tag_size) {
-            handle(coded_in.ReadString(&value.first, tag_size), group_vo);
+            handle(read_bytes(&value.first[0], tag_size), group_vo);
         }
         
         if (this->verbose) {
@@ -281,10 +357,24 @@ auto MessageIterator::operator++() -> const MessageIterator& {
             }
         }
     
+        if (tag_filter && !tag_filter(is_tag ? value.first : string())) {
+            // Nobody wants this group, so skip the rest of it.
+            if (this->verbose) {
+                cerr << "Group with tag \"" << (is_tag ? value.first : string()) << "\" is filtered out" << endl;
+            }
+            if (is_tag) {
+                previous_tag = value.first;
+            }
+            skip_rest = true;
+            continue;
+        }
+    
         if (!is_tag) {
             // If we get here, the registry doesn't think it's a tag.
             // Assume it is actually a message, and make the group's tag ""
-            value.second = make_unique<string>(std::move(value.first));
+            spill_buffer = std::move(value.first);
+            data_size = spill_buffer.size();
+            data_spilled = true;
             value.first.clear();
             previous_tag.clear();
             
@@ -293,8 +383,8 @@ auto MessageIterator::operator++() -> const MessageIterator& {
                 cerr << "Found message with tag \"" << value.first << "\"" << endl;
             }
             
-            // Return ourselves, after increment
-            return *this;
+            // This is the next item.
+            return;
         }
         
         // Otherwise this is a real tag.
@@ -312,7 +402,8 @@ auto MessageIterator::operator++() -> const MessageIterator& {
             }
             
             value.second.reset();
-            return *this;
+            value_ready = true;
+            return;
         }
         
         // We continue through all empty groups.
@@ -323,12 +414,7 @@ auto MessageIterator::operator++() -> const MessageIterator& {
     // Now we know we're in a group, and we know the tag, if any.
     
     // Get the item's virtual offset, if available
-    auto virtual_offset = bgzip_in->Tell();
-    
-    // We need a fresh CodedInputStream every time, because of the total byte limit
-    ::google::protobuf::io::CodedInputStream coded_in(bgzip_in.get());
-    // Alot space for size and item (generously)
-    coded_in.SetTotalBytesLimit(MAX_MESSAGE_SIZE * 2);
+    auto virtual_offset = tell_stream();
     
     // A message starts here
     if (virtual_offset == -1) {
@@ -340,8 +426,8 @@ auto MessageIterator::operator++() -> const MessageIterator& {
     }
     
     // The messages are prefixed by their size
-    uint32_t msgSize = 0;
-    handle(coded_in.ReadVarint32(&msgSize), group_vo, item_vo);
+    uint64_t msgSize = 0;
+    handle(read_varint(msgSize), group_vo, item_vo);
     
     if (msgSize > MAX_MESSAGE_SIZE) {
         throw runtime_error("[vg::io::MessageIterator::operator++] (group " + 
@@ -350,16 +436,9 @@ auto MessageIterator::operator++() -> const MessageIterator& {
     }
     
     
-    // We have a message.
-    // Make an empty string to hold it.
-    if (value.second.get() != nullptr) {
-        value.second->clear();
-    } else {
-        value.second = make_unique<string>();
-    }
-    if (msgSize) {
-        handle(coded_in.ReadString(value.second.get(), msgSize), group_vo, item_vo);
-    }
+    // We have a message. Leave it in the stream until someone wants it.
+    data_size = msgSize;
+    data_pending = true;
     
     // Fill in the tag from the previous to make sure our value pair actually has it.
     // It may have been moved away.
@@ -371,9 +450,6 @@ auto MessageIterator::operator++() -> const MessageIterator& {
     
     // Move on to the next message in the group
     group_idx++;
-    
-    // Return ourselves, after increment
-    return *this;
 }
 
 auto MessageIterator::operator==(const MessageIterator& other) const -> bool {
@@ -396,12 +472,249 @@ auto MessageIterator::advance() -> void {
 }
 
 auto MessageIterator::take() -> TaggedMessage {
+    fill_value();
     auto temp = std::move(value);
     advance();
     // Return by value, which gets moved.
     return temp;
 }
 
+auto MessageIterator::next_batch(MessageBatch& batch, size_t max_messages, size_t max_bytes) -> size_t {
+    batch.clear();
+    
+    if (max_messages == 0) {
+        // Only the byte limit applies.
+        max_messages = numeric_limits<size_t>::max();
+    }
+    
+    while (has_current() && batch.size() < max_messages) {
+        auto current = view();
+        if (current.data != nullptr) {
+            if (!batch.empty() && batch.bytes() + current.size > max_bytes) {
+                // Leave this message for the next batch.
+                break;
+            }
+            // Copy straight from the decompressed block.
+            batch.push_back(current.data, current.size);
+        }
+        advance();
+    }
+    
+    return batch.size();
+}
+
+auto MessageIterator::group_size() const -> size_t {
+    // Tags are counted in the group's count, but groups without a tag have
+    // nothing but messages.
+    return tag().empty() ? group_count : group_count - 1;
+}
+
+auto MessageIterator::skip_group() -> void {
+    if (!has_current()) {
+        return;
+    }
+    
+    // Get past the current message and everything else in its group.
+    discard_data();
+    skip_messages(group_count - group_idx);
+    group_idx = group_count;
+    
+    // And read the next group.
+    advance();
+}
+
+auto MessageIterator::set_tag_filter(const function<bool(const string&)>& filter) -> void {
+    tag_filter = filter;
+}
+
+auto MessageIterator::set_message_filter(const MessageFilter& filter) -> void {
+    message_filter = filter;
+}
+
+auto MessageIterator::skip_messages(size_t count) -> void {
+    for (; count > 0; count--) {
+        // Each message is prefixed by its size
+        uint64_t message_size = 0;
+        handle(read_varint(message_size), group_vo);
+        
+        if (message_size > MAX_MESSAGE_SIZE) {
+            throw runtime_error("[vg::io::MessageIterator::skip_messages] (group " + 
+                                to_string(group_vo) + ") message of " +
+                                to_string(message_size) + " bytes is too long");
+        }
+        
+        // Skip the message without copying it. Big skips can pass over
+        // whole blocks without decompressing them.
+        handle(skip_bytes(message_size), group_vo);
+    }
+    
+    if (this->verbose) {
+        cerr << "Skipped to end of group at " << group_vo << endl;
+    }
+}
+
+auto MessageIterator::tag() const -> const string& {
+    // The tag is always kept here, even if the value is moved away.
+    return previous_tag;
+}
+
+auto MessageIterator::view() const -> TaggedMessageView {
+    read_data();
+    
+    TaggedMessageView current;
+    current.tag = &previous_tag;
+    current.data = data_spilled ? spill_buffer.data() : data_start;
+    current.size = data_size;
+    return current;
+}
+
+auto MessageIterator::read_data() const -> void {
+    if (!data_pending) {
+        return;
+    }
+    data_pending = false;
+    
+    if (data_size == 0) {
+        // There's nothing to read, but there is a message.
+        spill_buffer.clear();
+        data_spilled = true;
+        return;
+    }
+    
+    handle(fill_buffer(), group_vo, item_vo);
+    if (buffer_end - buffer_cursor >= (ptrdiff_t) data_size) {
+        // The whole message is in the block we have, and will stay there
+        // until we read past it.
+        data_start = buffer_cursor;
+        buffer_cursor += data_size;
+    } else {
+        // The message spans blocks, so we have to stitch it together.
+        spill_buffer.resize(data_size);
+        handle(read_bytes(&spill_buffer[0], data_size), group_vo, item_vo);
+        data_spilled = true;
+    }
+    
+    if (this->verbose) {
+        cerr << "Read " << data_size << " bytes of message data" << (data_spilled ? " across blocks" : "") << endl;
+    }
+}
+
+auto MessageIterator::fill_value() const -> void {
+    if (value_ready) {
+        return;
+    }
+    
+    read_data();
+    const char* data = data_spilled ? spill_buffer.data() : data_start;
+    if (value.second.get() != nullptr) {
+        // Reuse the string we have
+        value.second->assign(data, data_size);
+    } else {
+        value.second = make_unique<string>(data, data_size);
+    }
+    // It may have been moved away.
+    value.first = previous_tag;
+    value_ready = true;
+}
+
+auto MessageIterator::fill_buffer() const -> bool {
+    while (buffer_cursor == buffer_end) {
+        // Remember where the buffer starts, so we can tell where we are in
+        // it without giving it back.
+        buffer_vo = bgzip_in->Tell();
+        const void* data = nullptr;
+        int size = 0;
+        if (!bgzip_in->Next(&data, &size)) {
+            // Out of data
+            buffer_start = buffer_cursor = buffer_end = nullptr;
+            return false;
+        }
+        buffer_start = buffer_cursor = (const char*) data;
+        buffer_end = buffer_cursor + size;
+    }
+    return true;
+}
+
+auto MessageIterator::return_buffer() const -> void {
+    if (buffer_cursor != buffer_end) {
+        bgzip_in->BackUp(buffer_end - buffer_cursor);
+    }
+    buffer_start = buffer_cursor = buffer_end = nullptr;
+}
+
+auto MessageIterator::tell_stream() const -> int64_t {
+    if (buffer_cursor == buffer_end) {
+        // We have used up our buffer, so the stream is where we are. Let it
+        // say so, since at the end of a block it knows to point to the start
+        // of the next one.
+        return bgzip_in->Tell();
+    }
+    if (buffer_vo == -1) {
+        return -1;
+    }
+    // We are partway through a buffer, which is all in one block, so just
+    // count along from its start.
+    return buffer_vo + (buffer_cursor - buffer_start);
+}
+
+auto MessageIterator::read_varint(uint64_t& dest) const -> bool {
+    dest = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        if (buffer_cursor == buffer_end && !fill_buffer()) {
+            return false;
+        }
+        uint8_t byte = (uint8_t) *buffer_cursor;
+        buffer_cursor++;
+        dest |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            // That was the last byte
+            return true;
+        }
+    }
+    // Too many bytes for a varint
+    return false;
+}
+
+auto MessageIterator::read_bytes(char* dest, size_t count) const -> bool {
+    while (count > 0) {
+        if (!fill_buffer()) {
+            return false;
+        }
+        size_t available = std::min<size_t>(count, buffer_end - buffer_cursor);
+        memcpy(dest, buffer_cursor, available);
+        buffer_cursor += available;
+        dest += available;
+        count -= available;
+    }
+    return true;
+}
+
+auto MessageIterator::skip_bytes(size_t count) const -> bool {
+    // Use what we have first
+    size_t available = std::min<size_t>(count, buffer_end - buffer_cursor);
+    buffer_cursor += available;
+    count -= available;
+    
+    if (count > 0) {
+        // We are at the end of our buffer, so the stream is where we are.
+        buffer_start = buffer_cursor = buffer_end = nullptr;
+        return bgzip_in->Skip(count);
+    }
+    return true;
+}
+
+auto MessageIterator::discard_data() -> void {
+    if (data_pending && data_size > 0) {
+        // Skip the message without decompressing it if we can.
+        handle(skip_bytes(data_size), group_vo, item_vo);
+    }
+    data_pending = false;
+    data_size = 0;
+    data_start = nullptr;
+    data_spilled = false;
+    value_ready = false;
+}
+
 auto MessageIterator::tell_group() const -> int64_t {
     if (bgzip_in->Tell() != -1) {
         // The backing file supports seek/tell (which we ascertain by attempting it).
@@ -435,7 +748,8 @@ auto MessageIterator::seek_group(int64_t virtual_offset) -> bool {
         return true;
     }
     
-    // Try and do the seek
+    // Try and do the seek, from where we really are
+    return_buffer();
     bool sought = bgzip_in->Seek(virtual_offset);
     
     if (!sought) {
@@ -446,7 +760,9 @@ auto MessageIterator::seek_group(int64_t virtual_offset) -> bool {
         return false;
     }
     
-    // Get ready to read the group that's here
+    // Get ready to read the group that's here. Any message data we haven't
+    // read is no longer where the stream is.
+    data_pending = false;
     group_count = 0;
     group_idx = 0;
     
@@ -461,6 +777,41 @@ auto MessageIterator::seek_group(int64_t virtual_offset) -> bool {
     return true;
 }
 
+auto MessageIterator::set_group_index(const shared_ptr<const GroupIndex>& index) -> void {
+    group_index = index;
+}
+
+auto MessageIterator::load_group_index(const string& index_filename) -> bool {
+    ifstream index_in(index_filename, ios::binary);
+    if (!index_in) {
+        return false;
+    }
+    shared_ptr<GroupIndex> loaded = make_shared<GroupIndex>();
+    try {
+        loaded->load(index_in);
+    } catch (runtime_error& e) {
+        // A truncated or corrupt index is as good as none.
+#ifdef debug
+        cerr << "Could not load group index " << index_filename << ": " << e.what() << endl;
+#endif
+        return false;
+    }
+    group_index = loaded;
+    return true;
+}
+
+auto MessageIterator::get_group_index() const -> const shared_ptr<const GroupIndex>& {
+    return group_index;
+}
+
+auto MessageIterator::seek_group_number(size_t group_number) -> bool {
+    if (group_index.get() == nullptr || group_number >= group_index->group_count()) {
+        // We don't know where that is
+        return false;
+    }
+    return seek_group(group_index->group_vo(group_number));
+}
+
 auto MessageIterator::range(istream& in) -> pair<MessageIterator, MessageIterator> {
     return make_pair(MessageIterator(in), MessageIterator());
 }
@@ -0,0 +1,412 @@
+/**
+ * \file message_ranges.cpp
+ * Implementations for splitting type-tagged grouped message files into
+ * independently readable ranges.
+ */
+
+#include "vg/io/message_ranges.hpp"
+#include "vg/io/message_iterator.hpp"
+#include "vg/io/bgzf_block.hpp"
+#include "vg/io/registry.hpp"
+#include "vg/io/group_index.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+/// How much compressed data to look through at a time when looking for a
+/// block header. Enough to hold a maximum-size block and the header after it.
+static const size_t BLOCK_SCAN_WINDOW = 2 * 65536 + BGZF_HEADER_SIZE;
+
+/// How far find_group_start() can get past the start of its window before it
+/// drops the data it has already looked at.
+static const size_t WINDOW_TRIM_BYTES = 65536;
+
+/// Open the given file for reading and get its size. Throws if it can't be
+/// opened.
+static int open_for_scan(const string& filename, int64_t& file_size) {
+    int fd;
+    do {
+        fd = open(filename.c_str(), O_RDONLY);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        throw runtime_error("Could not open " + filename + ": " + strerror(errno));
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        int problem = errno;
+        close(fd);
+        throw runtime_error("Could not stat " + filename + ": " + strerror(problem));
+    }
+    file_size = info.st_size;
+    return fd;
+}
+
+/// Read as much as we can of the given range of the file into the buffer.
+/// Returns the number of bytes read, or -1 on error.
+static ssize_t read_fully(int fd, char* buffer, size_t count, int64_t offset) {
+    size_t got = 0;
+    while (got < count) {
+        ssize_t found = pread(fd, buffer + got, count - got, offset + got);
+        if (found < 0 && errno == EINTR) {
+            continue;
+        }
+        if (found < 0) {
+            return -1;
+        }
+        if (found == 0) {
+            break;
+        }
+        got += found;
+    }
+    return got;
+}
+
+/// Find the first BGZF block at or after the given offset in the given open
+/// file of the given size.
+static int64_t find_bgzf_block_in(int fd, int64_t file_size, int64_t offset, const string& filename) {
+    vector<char> window(BLOCK_SCAN_WINDOW);
+    while (offset < file_size) {
+        ssize_t got = read_fully(fd, window.data(), window.size(), offset);
+        if (got < 0) {
+            throw runtime_error("Could not read " + filename + ": " + strerror(errno));
+        }
+        // Only look for headers that are all in the window
+        size_t candidates = got >= (ssize_t) BGZF_HEADER_SIZE ? got - BGZF_HEADER_SIZE + 1 : 0;
+        for (size_t i = 0; i < candidates; i++) {
+            size_t block_size = bgzf_block_size(window.data() + i);
+            if (block_size == 0) {
+                continue;
+            }
+            // A real block is followed by another block or the end of the
+            // file. Random compressed data looking like a header will almost
+            // never manage that.
+            int64_t next = offset + i + block_size;
+            if (next == file_size) {
+                return offset + i;
+            }
+            if (next + (int64_t) BGZF_HEADER_SIZE > file_size) {
+                continue;
+            }
+            char next_header[BGZF_HEADER_SIZE];
+            const char* next_data;
+            if (i + block_size + BGZF_HEADER_SIZE <= (size_t) got) {
+                next_data = window.data() + i + block_size;
+            } else {
+                if (read_fully(fd, next_header, BGZF_HEADER_SIZE, next) != (ssize_t) BGZF_HEADER_SIZE) {
+                    continue;
+                }
+                next_data = next_header;
+            }
+            if (bgzf_block_size(next_data) != 0) {
+                return offset + i;
+            }
+        }
+        if (got < (ssize_t) window.size()) {
+            // We looked at everything up to the end.
+            break;
+        }
+        offset += candidates;
+    }
+    return file_size;
+}
+
+int64_t find_bgzf_block(const string& filename, int64_t offset) {
+    int64_t file_size;
+    int fd = open_for_scan(filename, file_size);
+    int64_t found;
+    try {
+        found = find_bgzf_block_in(fd, file_size, offset, filename);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return found;
+}
+
+int64_t find_group_start(BlockedGzipInputStream& in, int64_t virtual_offset, size_t max_check_bytes) {
+    if (!in.Seek(virtual_offset)) {
+        return -1;
+    }
+
+    // We pull data from the stream into this window, and remember the virtual
+    // offset of the start of each buffer we got and where it is relative to
+    // where we started. The window only holds what we got since window_start,
+    // since we drop what is before the candidate we are looking at.
+    string window;
+    size_t window_start = 0;
+    deque<pair<size_t, int64_t>> pieces;
+    bool at_eof = false;
+
+    // Make sure the window holds everything before the given position, if the
+    // stream has it. Returns false if it does not.
+    auto ensure = [&](size_t needed) -> bool {
+        while (window_start + window.size() < needed && !at_eof) {
+            int64_t piece_vo = in.Tell();
+            const void* data;
+            int size;
+            if (!in.Next(&data, &size)) {
+                at_eof = true;
+                break;
+            }
+            if (size > 0) {
+                pieces.emplace_back(window_start + window.size(), piece_vo);
+                window.append((const char*) data, size);
+            }
+        }
+        return window_start + window.size() >= needed;
+    };
+
+    // Read a varint from the window at the given cursor, advancing it.
+    auto read_varint = [&](size_t& cursor, uint64_t& dest) -> bool {
+        dest = 0;
+        for (size_t shift = 0; shift < 64; shift += 7) {
+            if (!ensure(cursor + 1)) {
+                return false;
+            }
+            uint8_t byte = window[cursor++ - window_start];
+            dest |= (uint64_t) (byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // Return true if a group with a registered tag starts at the given place
+    // in the window, and the next group after it (if any) also does. Gives
+    // the benefit of the doubt once we have checked max_check_bytes.
+    auto check_candidate = [&](size_t start) -> bool {
+        size_t cursor = start;
+        for (size_t group = 0; group < 2; group++) {
+            if (group > 0 && !ensure(cursor + 1)) {
+                // The file ends right after the first group.
+                return true;
+            }
+
+            uint64_t group_count;
+            if (!read_varint(cursor, group_count) || group_count < 1) {
+                return false;
+            }
+            uint64_t tag_size;
+            if (!read_varint(cursor, tag_size) || tag_size == 0 || tag_size > Registry::MAX_TAG_LENGTH) {
+                return false;
+            }
+            if (!ensure(cursor + tag_size) || !Registry::is_valid_tag(window.substr(cursor - window_start, tag_size))) {
+                return false;
+            }
+            cursor += tag_size;
+
+            for (uint64_t i = 1; i < group_count; i++) {
+                // Walk the message lengths
+                uint64_t message_size;
+                if (!read_varint(cursor, message_size) || message_size > MessageIterator::MAX_MESSAGE_SIZE) {
+                    return false;
+                }
+                cursor += message_size;
+                if (cursor - start > max_check_bytes) {
+                    // Everything framed correctly for a long way.
+                    return true;
+                }
+                if (!ensure(cursor)) {
+                    // Message runs off the end of the file.
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    for (size_t candidate = 0; ensure(candidate + 1); candidate++) {
+        if (candidate - window_start >= WINDOW_TRIM_BYTES) {
+            // Forget what is before the candidate, except the start of the
+            // piece it is in.
+            window.erase(0, candidate - window_start);
+            window_start = candidate;
+            while (pieces.size() > 1 && pieces[1].first <= candidate) {
+                pieces.pop_front();
+            }
+        }
+        if (check_candidate(candidate)) {
+            // Work out the virtual offset
+            while (pieces.size() > 1 && pieces[1].first <= candidate) {
+                pieces.pop_front();
+            }
+#ifdef debug
+            cerr << "Found group start at " << pieces.front().second + (candidate - pieces.front().first)
+                << " after " << virtual_offset << endl;
+#endif
+            return pieces.front().second + (candidate - pieces.front().first);
+        }
+    }
+
+    return -1;
+}
+
+/// Return true if the given iterator can seek to the given group from the
+/// given index, and finds the group the index says is there.
+static bool group_matches(MessageIterator& it, const GroupIndex& index, size_t group_number) {
+    return it.seek_group(index.group_vo(group_number)) && it.has_current() &&
+        it.tell_group() == index.group_vo(group_number) && it.tag() == index.group_tag(group_number) &&
+        it.group_size() == index.group_messages(group_number);
+}
+
+/// Split the given file, of the given compressed size, into about range_count
+/// ranges at groups from the given index. Makes sure the index matches the
+/// file at each split, and that its last group really is the last one in the
+/// file. Returns no ranges if the index is out of date.
+static vector<MessageRange> split_with_index(const string& filename, const GroupIndex& index, int64_t file_size,
+                                             size_t range_count) {
+    vector<MessageRange> ranges;
+    if (index.group_count() == 0 || (index.end_vo() >> 16) >= file_size) {
+        // The index can't be for this file.
+        return ranges;
+    }
+
+    MessageIterator it(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+    size_t last = index.group_count() - 1;
+    if (!group_matches(it, index, last)) {
+        return ranges;
+    }
+    it.skip_group();
+    if (it.has_current()) {
+        // Something was added after the index was written.
+        return ranges;
+    }
+
+    ranges.emplace_back();
+    for (size_t i = 1; i < range_count; i++) {
+        // Find the first group starting in or after the block at this part of
+        // the file.
+        int64_t target_vo = (file_size * i / range_count) << 16;
+        size_t before = index.find_group(target_vo - 1);
+        size_t group_number = before == index.group_count() ? 0 : before + 1;
+        if (group_number >= index.group_count()) {
+            break;
+        }
+        int64_t group_vo = index.group_vo(group_number);
+        if (group_vo <= ranges.back().start_vo) {
+            continue;
+        }
+        if (!group_matches(it, index, group_number)) {
+            // The index doesn't match the file.
+#ifdef debug
+            cerr << "Group index does not match file at " << group_vo << endl;
+#endif
+            ranges.clear();
+            return ranges;
+        }
+        ranges.back().end_vo = group_vo;
+        ranges.emplace_back();
+        ranges.back().start_vo = group_vo;
+    }
+    return ranges;
+}
+
+/// Split the given file, of the given compressed size, into about range_count
+/// ranges, by walking the group framing from the start of the file and
+/// splitting at the first group that starts in or after the block at each
+/// part of the file. Each split is somewhere the framing of the range before
+/// it really ends. If the framing can't be followed, we stop splitting, and
+/// leave the problem in the last range for whoever reads it.
+static vector<MessageRange> split_by_walking(const string& filename, int64_t file_size, size_t range_count) {
+    vector<MessageRange> ranges;
+    ranges.emplace_back();
+
+    MessageIterator it(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+    try {
+        for (size_t i = 1; i < range_count; i++) {
+            int64_t target_vo = (file_size * i / range_count) << 16;
+            while (it.has_current() && it.tell_group() < target_vo) {
+                // Skip each group by message lengths, never looking at the
+                // messages.
+                it.skip_group();
+            }
+            if (!it.has_current()) {
+                // No more groups
+                break;
+            }
+            int64_t group_vo = it.tell_group();
+            ranges.back().end_vo = group_vo;
+            ranges.emplace_back();
+            ranges.back().start_vo = group_vo;
+        }
+    } catch (runtime_error& e) {
+        // Keep the ranges we are sure of.
+#ifdef debug
+        cerr << "Stopped splitting " << filename << ": " << e.what() << endl;
+#endif
+    }
+    return ranges;
+}
+
+vector<MessageRange> split_message_file(const string& filename, size_t range_count) {
+    vector<MessageRange> ranges;
+
+    BlockedGzipInputStream in(filename);
+
+    // See if there is anything, and if the file starts with a tagged group.
+    string first_tag = MessageIterator::sniff_tag(in);
+    if (!first_tag.empty() && in.IsBGZF() && in.Tell() == 0 && range_count > 1) {
+        // We can split the file.
+        int64_t file_size;
+        close(open_for_scan(filename, file_size));
+        
+        ifstream index_in(GroupIndex::sidecar_filename(filename), ios::binary);
+        if (index_in) {
+            // We can split where the sidecar index says groups are, instead of
+            // walking through the file to find them.
+            GroupIndex index;
+            try {
+                index.load(index_in);
+                ranges = split_with_index(filename, index, file_size, range_count);
+            } catch (runtime_error& e) {
+                // Ignore unusable indexes
+#ifdef debug
+                cerr << "Could not use group index: " << e.what() << endl;
+#endif
+            }
+            if (!ranges.empty()) {
+                return ranges;
+            }
+        }
+        
+        ranges = split_by_walking(filename, file_size, range_count);
+    } else {
+        // See if the file has anything in it at all.
+        const void* data;
+        int size;
+        bool nonempty = false;
+        while (in.Next(&data, &size)) {
+            if (size > 0) {
+                nonempty = true;
+                break;
+            }
+        }
+        if (nonempty) {
+            // Read the whole file as one range.
+            ranges.emplace_back();
+        }
+    }
+
+    return ranges;
+}
+
+}
+
+}
@@ -0,0 +1,213 @@
+/**
+ * \file parallel_block_deflater.cpp
+ * Implementations for the ParallelBlockDeflater write-behind pipeline.
+ */
+
+#include "vg/io/parallel_block_deflater.hpp"
+
+#include <htslib/bgzf.h>
+
+#include <iostream>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+ParallelBlockDeflater::ParallelBlockDeflater(const write_function_t& write, size_t thread_count, size_t max_queued_blocks,
+                                             int level) :
+    write(write),
+    max_queued_blocks(max_queued_blocks == 0 ? 1 : max_queued_blocks),
+    level(level),
+    written_bytes(0),
+    failed(false),
+    stopping(false) {
+
+    if (thread_count == 0) {
+        // We need someone to do the work.
+        thread_count = 1;
+    }
+
+    workers.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back(&ParallelBlockDeflater::worker_function, this);
+    }
+}
+
+ParallelBlockDeflater::~ParallelBlockDeflater() {
+    {
+        // Tell the workers to stop
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+        work_queue.clear();
+    }
+    work_ready.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+vector<char> ParallelBlockDeflater::get_buffer() {
+    vector<char> buffer;
+    if (!spare_buffers.empty()) {
+        buffer = std::move(spare_buffers.back());
+        spare_buffers.pop_back();
+    }
+    return buffer;
+}
+
+bool ParallelBlockDeflater::submit(vector<char>&& data) {
+    if (failed) {
+        return false;
+    }
+
+    // Get rid of anything that is ready, and make room if we need to.
+    if (!write_finished()) {
+        return false;
+    }
+    while (window.size() >= max_queued_blocks) {
+        if (!write_front()) {
+            return false;
+        }
+    }
+
+    shared_ptr<Slot> slot = make_shared<Slot>();
+    slot->data = std::move(data);
+    slot->level = level;
+    window.push_back(slot);
+
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        work_queue.emplace_back(std::move(slot));
+    }
+    work_ready.notify_one();
+
+    return true;
+}
+
+int64_t ParallelBlockDeflater::compressed_size() {
+    if (failed) {
+        return -1;
+    }
+
+    int64_t total = written_bytes;
+    for (auto& slot : window) {
+        if (!wait_for(*slot)) {
+            failed = true;
+            return -1;
+        }
+        total += slot->compressed.size();
+    }
+
+    // We might as well write out what we waited for.
+    if (!write_finished()) {
+        return -1;
+    }
+
+    return total;
+}
+
+bool ParallelBlockDeflater::flush() {
+    while (!window.empty()) {
+        if (!write_front()) {
+            return false;
+        }
+    }
+    return !failed;
+}
+
+void ParallelBlockDeflater::set_level(int new_level) {
+    level = new_level;
+}
+
+bool ParallelBlockDeflater::wait_for(Slot& slot) {
+    unique_lock<mutex> lock(queue_mutex);
+    slot_done.wait(lock, [&]() {
+        return slot.done;
+    });
+    return !slot.failed;
+}
+
+bool ParallelBlockDeflater::write_front() {
+    if (failed) {
+        return false;
+    }
+
+    shared_ptr<Slot> slot = std::move(window.front());
+    window.pop_front();
+
+    if (!wait_for(*slot)) {
+#ifdef debug
+        cerr << "ParallelBlockDeflater could not compress block of " << slot->data.size() << " bytes" << endl;
+#endif
+        failed = true;
+        return false;
+    }
+
+    if (!write(slot->compressed.data(), slot->compressed.size())) {
+#ifdef debug
+        cerr << "ParallelBlockDeflater could not write block of " << slot->compressed.size() << " bytes" << endl;
+#endif
+        failed = true;
+        return false;
+    }
+    written_bytes += slot->compressed.size();
+
+    // Keep the uncompressed buffer around to fill again.
+    spare_buffers.emplace_back(std::move(slot->data));
+
+    return true;
+}
+
+bool ParallelBlockDeflater::write_finished() {
+    while (!window.empty()) {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            if (!window.front()->done) {
+                // Nothing more is ready in order.
+                break;
+            }
+        }
+        if (!write_front()) {
+            return false;
+        }
+    }
+    return !failed;
+}
+
+void ParallelBlockDeflater::worker_function() {
+    while (true) {
+        shared_ptr<Slot> slot;
+        {
+            // Wait for something to do
+            unique_lock<mutex> lock(queue_mutex);
+            work_ready.wait(lock, [&]() {
+                return stopping || !work_queue.empty();
+            });
+            if (stopping) {
+                return;
+            }
+            slot = std::move(work_queue.front());
+            work_queue.pop_front();
+        }
+
+        // Compress the block outside the lock
+        slot->compressed.resize(BGZF_MAX_BLOCK_SIZE);
+        int64_t compressed = bgzf_deflate_block(slot->data.data(), slot->data.size(),
+                                                slot->compressed.data(), slot->compressed.size(), slot->level);
+        slot->compressed.resize(compressed < 0 ? 0 : compressed);
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            slot->failed = (compressed < 0);
+            slot->done = true;
+        }
+        slot_done.notify_all();
+    }
+}
+
+}
+
+}
@@ -0,0 +1,191 @@
+/**
+ * \file parallel_block_inflater.cpp
+ * Implementations for the ParallelBlockInflater read-ahead pipeline.
+ */
+
+#include "vg/io/parallel_block_inflater.hpp"
+
+#include <htslib/bgzf.h>
+
+#include <iostream>
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+ParallelBlockInflater::ParallelBlockInflater(const fetch_function_t& fetch, int64_t start_address, size_t thread_count,
+                                             size_t max_buffered_bytes) :
+    fetch(fetch),
+    max_buffered_bytes(max_buffered_bytes),
+    buffered_bytes(0),
+    delivery_address(start_address),
+    fetch_finished(false),
+    fetch_failed(false),
+    stopping(false) {
+
+    if (thread_count == 0) {
+        // We need someone to do the work.
+        thread_count = 1;
+    }
+
+    workers.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back(&ParallelBlockInflater::worker_function, this);
+    }
+}
+
+ParallelBlockInflater::~ParallelBlockInflater() {
+    {
+        // Tell the workers to stop
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+        work_queue.clear();
+    }
+    work_ready.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+int ParallelBlockInflater::next(shared_ptr<InflatedBlock>& block) {
+    // Make sure there's as much work going on as we allow.
+    fill_window();
+
+    if (window.empty()) {
+        // The fetch function ran out of blocks, or failed.
+        return fetch_failed ? -1 : 0;
+    }
+
+    shared_ptr<Slot> slot = std::move(window.front());
+    window.pop_front();
+    buffered_bytes -= slot->expected_size;
+
+    {
+        // Wait for the block to be ready
+        unique_lock<mutex> lock(queue_mutex);
+        slot_done.wait(lock, [&]() {
+            return slot->done;
+        });
+    }
+
+    if (slot->failed) {
+#ifdef debug
+        cerr << "ParallelBlockInflater could not inflate block at " << slot->block->address << endl;
+#endif
+        return -1;
+    }
+
+    block = std::move(slot->block);
+    delivery_address = block->address + block->compressed_size;
+
+    // Start working on whatever now fits in the window
+    fill_window();
+
+    return 1;
+}
+
+void ParallelBlockInflater::reset(int64_t start_address) {
+    {
+        // Cancel anything nobody has picked up. Workers will finish what they
+        // are doing and drop it.
+        lock_guard<mutex> lock(queue_mutex);
+        work_queue.clear();
+    }
+    window.clear();
+    buffered_bytes = 0;
+    delivery_address = start_address;
+    fetch_finished = false;
+    fetch_failed = false;
+}
+
+int64_t ParallelBlockInflater::next_address() const {
+    return delivery_address;
+}
+
+void ParallelBlockInflater::fill_window() {
+    size_t fetched = 0;
+    while (!fetch_finished && (window.empty() || buffered_bytes < max_buffered_bytes)) {
+        const char* compressed;
+        size_t block_size;
+        int64_t block_address;
+
+        int status = fetch(&compressed, &block_size, &block_address);
+        if (status <= 0) {
+            // We hit EOF or an error, and won't be able to go on until reset.
+            fetch_finished = true;
+            fetch_failed = (status < 0);
+            break;
+        }
+
+        // The footer tells us how much data the block holds, but a corrupt
+        // footer could ask for any amount of memory.
+        size_t expected_size = bgzf_block_uncompressed_size(compressed, block_size);
+        if (expected_size > BGZF_MAX_BLOCK_SIZE) {
+            fetch_finished = true;
+            fetch_failed = true;
+            break;
+        }
+
+        shared_ptr<Slot> slot = make_shared<Slot>();
+        slot->compressed.assign(compressed, compressed + block_size);
+        slot->expected_size = expected_size;
+        slot->block = make_shared<InflatedBlock>();
+        slot->block->address = block_address;
+        slot->block->compressed_size = block_size;
+
+        buffered_bytes += slot->expected_size;
+        window.push_back(slot);
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            work_queue.emplace_back(std::move(slot));
+        }
+        fetched++;
+    }
+
+    if (fetched == 1) {
+        work_ready.notify_one();
+    } else if (fetched > 1) {
+        work_ready.notify_all();
+    }
+}
+
+void ParallelBlockInflater::worker_function() {
+    while (true) {
+        shared_ptr<Slot> slot;
+        {
+            // Wait for something to do
+            unique_lock<mutex> lock(queue_mutex);
+            work_ready.wait(lock, [&]() {
+                return stopping || !work_queue.empty();
+            });
+            if (stopping) {
+                return;
+            }
+            slot = std::move(work_queue.front());
+            work_queue.pop_front();
+        }
+
+        // Inflate the block outside the lock
+        InflatedBlock& block = *slot->block;
+        block.data.resize(slot->expected_size);
+        int64_t inflated = bgzf_inflate_block(slot->compressed.data(), slot->compressed.size(),
+                                              block.data.data(), block.data.size());
+        // We don't need the compressed data anymore.
+        vector<char>().swap(slot->compressed);
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            slot->failed = (inflated < 0);
+            slot->done = true;
+        }
+        slot_done.notify_all();
+    }
+}
+
+}
+
+}
@@ -0,0 +1,281 @@
+/**
+ * \file prefetching_message_iterator.cpp
+ * Implementations for the PrefetchingMessageIterator for reading type-tagged
+ * grouped message files in the background.
+ */
+
+#include "vg/io/prefetching_message_iterator.hpp"
+
+namespace vg {
+
+namespace io {
+
+using namespace std;
+
+// Provide the static values a compilation unit to live in.
+const size_t PrefetchingMessageIterator::DEFAULT_PREFETCH_BYTES;
+
+/// How much message data the background thread collects before handing it
+/// over, to keep locking down.
+static const size_t PREFETCH_CHUNK_BYTES = 256 * 1024;
+
+PrefetchingMessageIterator::PrefetchingMessageIterator(istream& in, size_t max_prefetch_bytes, size_t thread_count) :
+    source(in, false, thread_count), max_prefetch_bytes(max_prefetch_bytes), queued_bytes(0), finished(false),
+    stopping(false), running(false), end_vo(-1), exhausted(false) {
+
+    start_worker();
+}
+
+PrefetchingMessageIterator::PrefetchingMessageIterator(unique_ptr<BlockedGzipInputStream>&& bgzf, size_t max_prefetch_bytes) :
+    source(std::move(bgzf)), max_prefetch_bytes(max_prefetch_bytes), queued_bytes(0), finished(false),
+    stopping(false), running(false), end_vo(-1), exhausted(false) {
+
+    start_worker();
+}
+
+PrefetchingMessageIterator::PrefetchingMessageIterator(unique_ptr<BlockedGzipInputStream>&& bgzf, const Executor& executor,
+                                                       size_t max_prefetch_bytes) :
+    source(std::move(bgzf)), max_prefetch_bytes(max_prefetch_bytes), queued_bytes(0), finished(false),
+    stopping(false), running(false), end_vo(-1), executor(executor), exhausted(false) {
+
+    start_worker();
+}
+
+PrefetchingMessageIterator::~PrefetchingMessageIterator() {
+    stop_worker();
+}
+
+auto PrefetchingMessageIterator::has_current() -> bool {
+    return fill_local();
+}
+
+auto PrefetchingMessageIterator::operator*() -> TaggedMessage& {
+    fill_local();
+    return local.front().message;
+}
+
+auto PrefetchingMessageIterator::advance() -> void {
+    if (fill_local()) {
+        local.pop_front();
+    }
+}
+
+auto PrefetchingMessageIterator::take() -> TaggedMessage {
+    fill_local();
+    auto temp = std::move(local.front().message);
+    local.pop_front();
+    // Return by value, which gets moved.
+    return temp;
+}
+
+auto PrefetchingMessageIterator::tell_group() -> int64_t {
+    if (fill_local()) {
+        return local.front().group_vo;
+    }
+    // Otherwise we are at the end, and the background thread has stopped
+    // and left the offset of the end.
+    lock_guard<mutex> lock(queue_mutex);
+    return end_vo;
+}
+
+auto PrefetchingMessageIterator::seek_group(int64_t virtual_offset) -> bool {
+    stop_worker();
+
+    // Throw out everything read ahead.
+    local.clear();
+    queue.clear();
+    queued_bytes = 0;
+    exhausted = false;
+    {
+        // Reading starts over, so anything that went wrong before is moot.
+        lock_guard<mutex> lock(queue_mutex);
+        finished = false;
+        error = nullptr;
+    }
+
+    // The source hasn't necessarily gone anywhere since the group we want,
+    // so make sure it really reads it again.
+    bool sought = source.seek_group(virtual_offset);
+
+    start_worker();
+    return sought;
+}
+
+auto PrefetchingMessageIterator::set_tag_filter(const function<bool(const string&)>& filter) -> void {
+    stop_worker();
+    source.set_tag_filter(filter);
+    bool ended;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        ended = finished;
+    }
+    if (!ended) {
+        // Keep reading from where we stopped. If we already hit the end, or
+        // an error the consumer hasn't got to yet, there is nothing more to
+        // read, and the source may not be in any state to read it.
+        start_worker();
+    }
+}
+
+auto PrefetchingMessageIterator::start_worker() -> void {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = false;
+        running = true;
+    }
+    if (executor) {
+        executor([this]() {
+            run_worker();
+        });
+    } else {
+        worker = thread(&PrefetchingMessageIterator::run_worker, this);
+    }
+}
+
+auto PrefetchingMessageIterator::stop_worker() -> void {
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        stopping = true;
+        space_ready.notify_all();
+        // Wait for the reading to actually stop, wherever it is running.
+        data_ready.wait(lock, [&]() {
+            return !running;
+        });
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+auto PrefetchingMessageIterator::fill_local() -> bool {
+    if (!local.empty()) {
+        return true;
+    }
+    if (exhausted) {
+        return false;
+    }
+
+    unique_lock<mutex> lock(queue_mutex);
+    data_ready.wait(lock, [&]() {
+        return !queue.empty() || finished;
+    });
+
+    if (queue.empty()) {
+        // The background thread is done
+        if (error) {
+            // Make sure we only throw once
+            exception_ptr to_throw = error;
+            error = nullptr;
+            exhausted = true;
+            rethrow_exception(to_throw);
+        }
+        exhausted = true;
+        return false;
+    }
+
+    // Grab the next chunk
+    for (auto& item : queue.front()) {
+        queued_bytes -= item.message.second ? item.message.second->size() : 0;
+        local.emplace_back(std::move(item));
+    }
+    queue.pop_front();
+    lock.unlock();
+    space_ready.notify_all();
+
+    return true;
+}
+
+auto PrefetchingMessageIterator::run_worker() -> void {
+    worker_function();
+    lock_guard<mutex> lock(queue_mutex);
+    running = false;
+    // Wake up the consumer, which may be waiting for data or for us to stop.
+    // Do it under the lock, since once we let go the iterator may be
+    // destroyed.
+    data_ready.notify_all();
+}
+
+auto PrefetchingMessageIterator::worker_function() -> void {
+    vector<Prefetched> chunk;
+    size_t chunk_bytes = 0;
+
+    // Put the chunk in the queue, without waiting for room. Must be called
+    // with the queue lock held.
+    auto enqueue = [&]() {
+        if (!chunk.empty()) {
+            queue.emplace_back(std::move(chunk));
+            queued_bytes += chunk_bytes;
+        }
+        chunk.clear();
+        chunk_bytes = 0;
+    };
+
+    // Hand over the chunk, waiting for room. Returns false if we should stop.
+    // Messages we have already taken from the source are handed over even
+    // then, since the source won't produce them again.
+    auto hand_over = [&]() -> bool {
+        unique_lock<mutex> lock(queue_mutex);
+        space_ready.wait(lock, [&]() {
+            // Always let something in if the consumer has nothing.
+            return stopping || queue.empty() || queued_bytes + chunk_bytes <= max_prefetch_bytes;
+        });
+        enqueue();
+        if (stopping) {
+            return false;
+        }
+        lock.unlock();
+        data_ready.notify_one();
+        return true;
+    };
+
+    try {
+        while (source.has_current()) {
+            {
+                lock_guard<mutex> lock(queue_mutex);
+                if (stopping) {
+                    // Keep what we have read for when we start again.
+                    enqueue();
+                    return;
+                }
+            }
+
+            // Frame and copy out the next message
+            int64_t group_vo = source.tell_group();
+            chunk.emplace_back();
+            chunk.back().group_vo = group_vo;
+            chunk.back().message = source.take();
+            if (chunk.back().message.second) {
+                chunk_bytes += chunk.back().message.second->size();
+            }
+
+            if (chunk_bytes >= PREFETCH_CHUNK_BYTES || chunk_bytes >= max_prefetch_bytes) {
+                if (!hand_over()) {
+                    return;
+                }
+            }
+        }
+
+        if (!chunk.empty() && !hand_over()) {
+            return;
+        }
+
+        // Remember where the end is, since we aren't going to use the source
+        // again.
+        int64_t final_vo = source.tell_group();
+        lock_guard<mutex> lock(queue_mutex);
+        end_vo = final_vo;
+        finished = true;
+    } catch (...) {
+        // Pass the problem along to the consumer, after what we already have.
+        if (!chunk.empty()) {
+            hand_over();
+        }
+        lock_guard<mutex> lock(queue_mutex);
+        error = current_exception();
+        finished = true;
+    }
+}
+
+}
+
+}
@@ -1,5 +1,6 @@
 #include "vg/io/stream.hpp"
 #include "vg/io/blocked_gzip_output_stream.hpp"
+#include "vg/io/group_index.hpp"
 
 namespace vg {
 
@@ -15,6 +16,63 @@ void finish(std::ostream& out, bool compressed) {
     }
 }
 
+/// Count messages by tag from where the given iterator is to the end.
+static map<string, size_t> count_remaining_messages(MessageIterator& it) {
+    map<string, size_t> counts;
+    while (it.has_current()) {
+        // Skip each group by message lengths, never looking at the messages.
+        counts[it.tag()] += it.group_size();
+        it.skip_group();
+    }
+    return counts;
+}
+
+map<string, size_t> count_messages(std::istream& in) {
+    MessageIterator it(in);
+    return count_remaining_messages(it);
+}
+
+map<string, size_t> count_messages(const string& filename) {
+    MessageIterator it(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+    
+    if (it.load_group_index(GroupIndex::sidecar_filename(filename))) {
+        const GroupIndex& index = *it.get_group_index();
+        
+        // Make sure the index still describes the file, by checking the last
+        // group and that nothing comes after it.
+        bool current = false;
+        if (index.group_count() == 0) {
+            current = !it.has_current();
+        } else {
+            size_t last = index.group_count() - 1;
+            if (it.seek_group_number(last) && it.has_current() && it.tell_group() == index.group_vo(last) &&
+                it.tag() == index.group_tag(last) && it.group_size() == index.group_messages(last)) {
+                it.skip_group();
+                current = !it.has_current();
+            }
+        }
+        
+        if (current) {
+            map<string, size_t> counts;
+            for (size_t i = 0; i < index.group_count(); i++) {
+                counts[index.group_tag(i)] += index.group_messages(i);
+            }
+            return counts;
+        }
+        
+#ifdef debug
+        cerr << "Group index for " << filename << " is out of date" << endl;
+#endif
+        
+        // Otherwise count the slow way, from the start.
+        if (!it.seek_group(0)) {
+            it = MessageIterator(unique_ptr<BlockedGzipInputStream>(new BlockedGzipInputStream(filename)));
+        }
+    }
+    
+    return count_remaining_messages(it);
+}
+
 size_t get_stream_length(std::istream& in) {
     in.clear();
     // Get where we are right now
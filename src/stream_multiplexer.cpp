@@ -37,18 +37,26 @@ StreamMultiplexer::~StreamMultiplexer() {
     cerr << "StreamMultiplexer destructing" << endl;
 #endif
 
+    finish();
+    
+#ifdef debug
+    cerr << "StreamMultiplexer destroyed" << endl;
+#endif
+}
+
+void StreamMultiplexer::finish() {
+    if (!writer_thread.joinable()) {
+        // We already finished.
+        return;
+    }
+
     // Tell the writer to finish.
     writer_stop.store(true);
-    // Wait for it to finish.
+    // Wait for it to write everything and stop.
     writer_thread.join();
     
     // Make sure to flush the backing stream, so output is on disk.
-    // Probably not necessary, but makes sense.
     backing_stream.flush();
-    
-#ifdef debug
-    cerr << "StreamMultiplexer destroyed" << endl;
-#endif
 }
 
 ostream& StreamMultiplexer::get_thread_stream(size_t thread_number) {